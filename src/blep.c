@@ -0,0 +1,161 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+/*
+Band-limited step synthesis.
+Each transition is added to a delta buffer as a windowed sinc impulse placed at its sub-sample position,
+reading integrates the deltas so the impulses become band-limited steps.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "blep.h"
+#include "emul.h"
+#include "misc/log4me.h"
+
+#define BLEP_TAPS           16  // kernel width in output samples
+#define BLEP_PHASES_BITS    6
+#define BLEP_PHASES         (1 << BLEP_PHASES_BITS)
+#define BLEP_UNIT_BITS      15  // kernel unity gain
+#define BLEP_CUTOFF         0.45 // fraction of the output sample rate
+
+#define BLEP_FRAC_BITS      32  // position in output samples, 32.32 fixed point
+
+struct _blep {
+    qword factor;   // output samples per input clock
+    qword offset;   // position of the frame start in the delta buffer
+    int capacity;
+    int integrator;
+    int *deltas;
+    int kernel[BLEP_PHASES][BLEP_TAPS];
+};
+
+// Windowed sinc impulse for each sub-sample phase, each phase sums exactly to the unity gain
+static void blep_buildkernel(blep b)
+{
+    int phase, t, sum;
+    double x, w, h[BLEP_TAPS], total;
+
+    for(phase=0; phase<BLEP_PHASES; phase++) {
+        total = 0;
+        for(t=0; t<BLEP_TAPS; t++) {
+            x = t - (BLEP_TAPS/2 - 1) - (double)phase/BLEP_PHASES; // distance to the impulse center
+            w = 0.42 + 0.5*SDL_cos(M_PI*x/(BLEP_TAPS/2)) + 0.08*SDL_cos(2*M_PI*x/(BLEP_TAPS/2)); // Blackman
+            if(SDL_fabs(x)>=BLEP_TAPS/2) w = 0;
+            h[t] = (x==0 ? 2*BLEP_CUTOFF : SDL_sin(2*M_PI*BLEP_CUTOFF*x) / (M_PI*x)) * w;
+            total += h[t];
+        }
+
+        for(t=0,sum=0; t<BLEP_TAPS; t++) {
+            b->kernel[phase][t] = (int)SDL_floor(h[t] * (1 << BLEP_UNIT_BITS) / total + 0.5);
+            sum += b->kernel[phase][t];
+        }
+        b->kernel[phase][BLEP_TAPS/2] += (1 << BLEP_UNIT_BITS) - sum; // rounding error on the center tap
+    }
+}
+
+blep blep_new(int clockrate, int samplerate, int capacity)
+{
+    blep b = calloc(1, sizeof(struct _blep));
+    if(b==NULL) return NULL;
+
+    b->factor = ((qword)samplerate << BLEP_FRAC_BITS) / clockrate;
+    b->capacity = capacity;
+    b->deltas = calloc(capacity + BLEP_TAPS, sizeof(int));
+    if(b->deltas==NULL) {
+        free(b);
+        return NULL;
+    }
+
+    blep_buildkernel(b);
+    blep_clear(b);
+
+    return b;
+}
+
+// Change the conversion ratio, only between two frames
+void blep_setrate(blep b, qword clockrate, qword samplerate)
+{
+    b->factor = (samplerate << BLEP_FRAC_BITS) / clockrate;
+}
+
+void blep_release(blep b)
+{
+    if(b==NULL) return;
+    free(b->deltas);
+    free(b);
+}
+
+void blep_clear(blep b)
+{
+    b->offset = 0;
+    b->integrator = 0;
+    memset(b->deltas, 0, (b->capacity + BLEP_TAPS) * sizeof(int));
+}
+
+// Add an amplitude transition at time (input clocks since the frame start)
+void blep_add(blep b, dword time, int delta)
+{
+    qword pos = b->offset + time * b->factor;
+    int i, *out = b->deltas + (pos >> BLEP_FRAC_BITS);
+    const int *kernel = b->kernel[(pos >> (BLEP_FRAC_BITS - BLEP_PHASES_BITS)) & (BLEP_PHASES - 1)];
+
+    assert((pos >> BLEP_FRAC_BITS) < b->capacity);
+    for(i=0; i<BLEP_TAPS; i++)
+        out[i] += kernel[i] * delta;
+}
+
+// Close the frame at time (input clocks), the next frame starts there
+void blep_endframe(blep b, dword time)
+{
+    b->offset += time * b->factor;
+    assert((b->offset >> BLEP_FRAC_BITS) <= b->capacity);
+}
+
+// Samples which will not receive any other transition
+int blep_available(blep b)
+{
+    return (int)(b->offset >> BLEP_FRAC_BITS);
+}
+
+// Integrate and decimate up to count samples into out (every stride values), returns the samples read
+int blep_read(blep b, short *out, int count, int stride)
+{
+    int i, sample, remaining;
+
+    count = MIN(count, blep_available(b));
+
+    for(i=0; i<count; i++, out+=stride) {
+        b->integrator += b->deltas[i];
+        sample = b->integrator >> BLEP_UNIT_BITS;
+        *out = sample>32767 ? 32767 : (sample<-32768 ? -32768 : sample);
+    }
+
+    // Keep the transitions not read yet
+    remaining = blep_available(b) - count + BLEP_TAPS;
+    memmove(b->deltas, b->deltas + count, remaining * sizeof(int));
+    memset(b->deltas + remaining, 0, count * sizeof(int));
+    b->offset -= (qword)count << BLEP_FRAC_BITS;
+
+    return count;
+}
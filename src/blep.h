@@ -0,0 +1,23 @@
+#ifndef BLEP_H_INCLUDED
+#define BLEP_H_INCLUDED
+
+#include "misc/types.h"
+
+// Band-limited step synthesis buffer : amplitude transitions are added at the input clock resolution,
+// then integrated and decimated to the output sample rate.
+
+struct _blep;
+typedef struct _blep * blep;
+
+blep blep_new(int clockrate, int samplerate, int capacity);
+void blep_setrate(blep b, qword clockrate, qword samplerate);
+void blep_release(blep b);
+void blep_clear(blep b);
+
+void blep_add(blep b, dword time, int delta);
+void blep_endframe(blep b, dword time);
+
+int blep_available(blep b);
+int blep_read(blep b, short *out, int count, int stride);
+
+#endif // BLEP_H_INCLUDED
@@ -19,23 +19,83 @@
 
 ************************************************************************/
 
+#ifdef HAVE_CONFIG_H
+	#include "config.h"
+#endif
+
 #include <assert.h>
 #include <SDL.h>
 
+#if defined(HAVE_CLOCK_NANOSLEEP)
+#include <errno.h>
+#include <time.h>
+#endif
+
 #include "clock.h"
 #include "misc/list.h"
 #include "misc/exit.h"
 
+// Deadlines are kept in the units of the time source : nanoseconds with
+// clock_nanosleep(), performance counter ticks otherwise. The period of a
+// clock is split in an integer part and a remainder carried from frame to
+// frame, so that a clock runs at exactly its frequency over the long run.
 typedef struct {
-    int *lkptable;
     int frequency;
-    int index;
-    Uint32 ticks;
+    Uint64 deadline;
+    Uint64 period;
+    Uint64 remainder;
+    Uint64 fraction;
+
+    // Lateness of the wake-ups since the last clock_getstats()
+    int waits;
+    double sum, sum2;
+    Uint64 max;
 } sclock;
 
-Uint32 _pause;
+Uint64 _units;
+Uint64 _pause;
 glist *_clocks;
 
+#if defined(HAVE_CLOCK_NANOSLEEP)
+
+static Uint64 clock_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (Uint64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void clock_sleepuntil(Uint64 deadline)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)==EINTR);
+}
+
+#else
+
+static Uint64 clock_now()
+{
+    return SDL_GetPerformanceCounter();
+}
+
+// SDL_Delay() has a millisecond resolution, the wake-up is within half a
+// millisecond of the deadline, which is kept exact for the next frames.
+static void clock_sleepuntil(Uint64 deadline)
+{
+    Uint64 t = clock_now();
+
+    if(deadline>t) {
+        Uint32 ms = (Uint32)(((deadline-t)*1000 + _units/2) / _units);
+        if(ms>0) SDL_Delay(ms);
+    }
+}
+
+#endif
+
 static void clock_free()
 {
     assert(lcount(_clocks)==0);
@@ -44,6 +104,11 @@ static void clock_free()
 
 void clock_init()
 {
+#if defined(HAVE_CLOCK_NANOSLEEP)
+    _units = 1000000000;
+#else
+    _units = SDL_GetPerformanceFrequency();
+#endif
     _clocks = lcreate();
     pushexit(clock_free);
 }
@@ -52,20 +117,17 @@ sdlclock clock_new(int frequency)
 {
     sclock *c = malloc(sizeof(sclock));
 
-    c->lkptable = malloc(sizeof(int) * frequency);
-    c->frequency = frequency;
-    c->index = 0;
-    c->ticks = SDL_GetTicks();
+    assert(frequency>0);
 
-    int i;
-    for(i=0;i<frequency;i++)
-        c->lkptable[i] = ((1000*(i+1)) / frequency) - ((1000*i) / frequency);
+    c->frequency = frequency;
+    c->period = _units / frequency;
+    c->remainder = _units % frequency;
+    c->fraction = 0;
+    c->deadline = clock_now();
 
-#ifdef DEBUG
-    int s = 0;
-    for(i=0;i<frequency;i++) s += c->lkptable[i];
-    assert(s==1000);
-#endif
+    c->waits = 0;
+    c->sum = c->sum2 = 0;
+    c->max = 0;
 
     ladd(_clocks, c);
 
@@ -81,64 +143,110 @@ void clock_release(sdlclock c)
 
     lremove(_clocks, _c);
 
-    free(_c->lkptable);
     free(_c);
 }
 
 
+// Change the rate of a clock, the next deadline is one new period from now
+void clock_setfrequency(sdlclock c, int frequency)
+{
+    sclock *_c = (sclock*)c;
+
+    assert(frequency>0);
+
+    _c->frequency = frequency;
+    _c->period = _units / frequency;
+    _c->remainder = _units % frequency;
+    _c->fraction = 0;
+    _c->deadline = clock_now() + _c->period;
+}
+
+
 void clock_step(sdlclock c)
 {
     sclock *_c = (sclock*)c;
 
-    _c->ticks += _c->lkptable[_c->index];
-    if(++_c->index>=_c->frequency) _c->index = 0;
+    _c->deadline += _c->period;
+    _c->fraction += _c->remainder;
+    if(_c->fraction>=_c->frequency) {
+        _c->fraction -= _c->frequency;
+        _c->deadline += 1;
+    }
 }
 
 
 int clock_elapsed(sdlclock c)
 {
-    return SDL_GetTicks()>=((sclock*)c)->ticks;
+    return clock_now()>=((sclock*)c)->deadline;
 }
 
 
-#define DELAY   2
-
 void clock_wait(sdlclock c)
 {
     sclock *_c = (sclock*)c;
+    Uint64 t;
 
-    Uint32 t = SDL_GetTicks();
-    if(_c->ticks>(t+DELAY)) {
-        SDL_Delay(_c->ticks-(t+DELAY));
+    // Behind schedule, the frame starts at once
+    if(clock_elapsed(c)) return;
+
+    clock_sleepuntil(_c->deadline);
+
+    t = clock_now();
+    t = t>_c->deadline ? t-_c->deadline : _c->deadline-t;
+
+    _c->waits += 1;
+    _c->sum += (double)t;
+    _c->sum2 += (double)t*t;
+    if(t>_c->max) _c->max = t;
+}
+
+
+void clock_getstats(sdlclock c, clockstats *stats)
+{
+    sclock *_c = (sclock*)c;
+    double mean = 0, var = 0;
+
+    if(_c->waits>0) {
+        mean = _c->sum / _c->waits;
+        var = _c->sum2 / _c->waits - mean*mean;
+        if(var<0) var = 0;
     }
 
-    while(!clock_elapsed(c));
+    stats->waits = _c->waits;
+    stats->mean = mean * 1000000 / _units;
+    stats->jitter = SDL_sqrt(var) * 1000000 / _units;
+    stats->max = (double)_c->max * 1000000 / _units;
+
+    _c->waits = 0;
+    _c->sum = _c->sum2 = 0;
+    _c->max = 0;
 }
 
 
 void clock_reset()
 {
-    Uint32 i, t = SDL_GetTicks();
-    int count;
+    Uint64 t = clock_now();
+    int i, count;
 
     count = lcount(_clocks);
-    for(i=0;i<count;i++)
-        ((sclock*)lget(_clocks, i))->ticks = t;
+    for(i=0;i<count;i++) {
+        ((sclock*)lget(_clocks, i))->deadline = t;
+        ((sclock*)lget(_clocks, i))->fraction = 0;
+    }
 }
 
 
 void clock_pause(int enable)
 {
-    Uint32 i, t;
-    int count;
+    Uint64 t;
+    int i, count;
 
     if(enable) {
-        _pause = SDL_GetTicks();
+        _pause = clock_now();
     } else {
-        t = SDL_GetTicks() - _pause;
+        t = clock_now() - _pause;
         count = lcount(_clocks);
         for(i=0;i<count;i++)
-            ((sclock*)lget(_clocks, i))->ticks += t;
+            ((sclock*)lget(_clocks, i))->deadline += t;
     }
 }
-
@@ -4,13 +4,23 @@
 struct _sdlclock;
 typedef struct _sdlclock * sdlclock;
 
+// Wake-up lateness of clock_wait(), in microseconds
+typedef struct {
+    int waits;
+    double mean;
+    double jitter; // standard deviation
+    double max;
+} clockstats;
+
 void clock_init(void);
 
 sdlclock clock_new(int frequency);
 void clock_release(sdlclock c);
+void clock_setfrequency(sdlclock c, int frequency);
 void clock_step(sdlclock c);
 int clock_elapsed(sdlclock c);
 void clock_wait(sdlclock c);
+void clock_getstats(sdlclock c, clockstats *stats);
 void clock_reset();
 void clock_pause(int enable);
 
@@ -2303,3 +2303,40 @@ void cpuZ80_loadsnapshot(cpuZ80 *cpu, xmlNode *cpunode)
         )
     )
 }
+
+void cpuZ80_savestate(const cpuZ80 *cpu, statewriter *w)
+{
+    state_write16(w, cpu->w.AF); state_write16(w, cpu->w.BC); state_write16(w, cpu->w.DE); state_write16(w, cpu->w.HL);
+    state_write16(w, cpu->wp.AFp); state_write16(w, cpu->wp.BCp); state_write16(w, cpu->wp.DEp); state_write16(w, cpu->wp.HLp);
+    state_write16(w, cpu->IX); state_write16(w, cpu->IY); state_write16(w, cpu->SP); state_write16(w, cpu->PC);
+
+    state_write8(w, cpu->I); state_write8(w, cpu->R); state_write8(w, cpu->R7); state_write8(w, cpu->IM);
+    state_write8(w, cpu->IFF1); state_write8(w, cpu->IFF2);
+    state_write8(w, cpu->halted);
+    state_write32(w, (dword)cpu->cycles);
+}
+
+// The state is read without being loaded, returns 0 when a value is out of the CPU range
+int cpuZ80_checkstate(statereader *r)
+{
+    state_skip(r, 12 * 2 + 3); // registers, I, R and R7
+    if(state_read8(r)>2) return 0; // IM
+    if(state_read8(r)>1) return 0; // IFF1
+    if(state_read8(r)>1) return 0; // IFF2
+    if(state_read8(r)>1) return 0; // halted
+    state_skip(r, 4); // cycles
+
+    return !r->error;
+}
+
+void cpuZ80_loadstate(cpuZ80 *cpu, statereader *r)
+{
+    cpu->w.AF = state_read16(r); cpu->w.BC = state_read16(r); cpu->w.DE = state_read16(r); cpu->w.HL = state_read16(r);
+    cpu->wp.AFp = state_read16(r); cpu->wp.BCp = state_read16(r); cpu->wp.DEp = state_read16(r); cpu->wp.HLp = state_read16(r);
+    cpu->IX = state_read16(r); cpu->IY = state_read16(r); cpu->SP = state_read16(r); cpu->PC = state_read16(r);
+
+    cpu->I = state_read8(r); cpu->R = state_read8(r); cpu->R7 = state_read8(r); cpu->IM = state_read8(r);
+    cpu->IFF1 = state_read8(r); cpu->IFF2 = state_read8(r);
+    cpu->halted = state_read8(r);
+    cpu->cycles = (int)state_read32(r);
+}
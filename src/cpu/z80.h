@@ -4,6 +4,7 @@
 #include "../emul.h"
 #include "../misc/types.h"
 #include "../misc/xml.h"
+#include "../savestate.h"
 
 #define FLAG_CARRY      0x01
 #define FLAG_ADD_SUB    0x02
@@ -112,6 +113,10 @@ void cpuZ80_dasm(cpuZ80 *cpu, word addr, char *buffer, int len);
 void cpuZ80_takesnapshot(cpuZ80 *cpu, xmlTextWriterPtr writer);
 void cpuZ80_loadsnapshot(cpuZ80 *cpu, xmlNode *cpunode);
 
+void cpuZ80_savestate(const cpuZ80 *cpu, statewriter *w);
+int cpuZ80_checkstate(statereader *r);
+void cpuZ80_loadstate(cpuZ80 *cpu, statereader *r);
+
 typedef void (*opcode_function)(cpuZ80 *cpu);
 typedef struct {
     opcode_function func;
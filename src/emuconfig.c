@@ -24,6 +24,7 @@
 #include "misc/list.h"
 #include "misc/log4me.h"
 #include "misc/xml.h"
+#include "sn76489.h"
 
 #define SET_PROFILE_PROP(profile, prop, value) { \
     switch(profile->base.type) { \
@@ -36,15 +37,37 @@
     } \
 }
 
+sync_mode parsesyncmode(const char *name)
+{
+    if(strcasecmp(name, "audio")==0) return SYNC_AUDIO;
+    if(strcasecmp(name, "video")==0) return SYNC_VIDEO;
+    return SYNC_TIMER;
+}
+
 void initconfig(emuconfig *config)
 {
     config->fullscreen = 0;
     config->noaspectratio = 0;
     config->scale = DEFAULT_SCALE;
     config->bezelfilename = NULL;
+    config->exportfilename = NULL;
+    config->vgmfilename = NULL;
     config->overlayfilename = NULL;
     config->volume = 100;
     config->nosound = 0;
+    config->psgsynthesis = PSG_POINT;
+    config->latency = SN7_DEFAULT_LATENCY;
+    config->samplerate = 44100;
+    config->audiobuffer = 512;
+    config->frameskip = 0;
+    config->sync = SYNC_TIMER;
+    config->background = 0;
+    config->runahead = 0;
+    config->inputlatency = 0;
+    config->rewind = 0;
+    config->rewindinterval = 1;
+    config->speed = 1;
+    config->turbo = 4;
 }
 
 void readconfig(const string configfilename, emuconfig *config, iprofile **player1, iprofile **player2)
@@ -132,6 +155,9 @@ void readconfig(const string configfilename, emuconfig *config, iprofile **playe
             XML_ELEMENT_CONTENT("bezel", video,
                 config->bezelfilename = strcrec((const char*)content);
             )
+            XML_ELEMENT_CONTENT("frameskip", video,
+                config->frameskip = atoi((const char*)content);
+            )
         )
 
         XML_ELEMENT_ENUM_CHILD("audio", node, audio,
@@ -142,6 +168,45 @@ void readconfig(const string configfilename, emuconfig *config, iprofile **playe
             XML_ELEMENT_CONTENT("nosound", audio,
                 config->nosound = atoi((const char*)content);
             )
+            XML_ELEMENT_CONTENT("latency", audio,
+                config->latency = atoi((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("samplerate", audio,
+                config->samplerate = atoi((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("buffer", audio,
+                config->audiobuffer = atoi((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("psg", audio,
+                config->psgsynthesis = strcasecmp((const char*)content, "blep")==0 ? PSG_BLEP : PSG_POINT;
+            )
+        )
+
+        XML_ELEMENT_ENUM_CHILD("emulation", node, emulation,
+            XML_ELEMENT_CONTENT("sync", emulation,
+                config->sync = parsesyncmode((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("background", emulation,
+                config->background = atoi((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("runahead", emulation,
+                config->runahead = atoi((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("inputlatency", emulation,
+                config->inputlatency = atoi((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("rewind", emulation,
+                config->rewind = atoi((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("rewindinterval", emulation,
+                config->rewindinterval = atoi((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("speed", emulation,
+                config->speed = atoi((const char*)content);
+            )
+            XML_ELEMENT_CONTENT("turbo", emulation,
+                config->turbo = atoi((const char*)content);
+            )
         )
     )
 
@@ -176,4 +241,6 @@ void freeconfig(emuconfig *config)
 {
     strfree(config->bezelfilename);
     strfree(config->overlayfilename);
+    strfree(config->exportfilename);
+    strfree(config->vgmfilename);
 }
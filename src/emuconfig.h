@@ -11,11 +11,28 @@ typedef struct {
     float scale;
     string overlayfilename;
     string bezelfilename;
+    int frameskip;
     /* audio */
     int volume;
     int nosound;
+    psg_synthesis psgsynthesis;
+    int latency;
+    int samplerate;
+    int audiobuffer;
+    string exportfilename;
+    string vgmfilename;
+    /* emulation */
+    sync_mode sync;
+    int background;
+    int runahead;
+    int inputlatency;
+    int rewind; // MB of history, 0 when disabled
+    int rewindinterval;
+    int speed;
+    int turbo;
 } emuconfig;
 
+sync_mode parsesyncmode(const char *name);
 void initconfig(emuconfig *config);
 void readconfig(const string configfilename, emuconfig *config, iprofile **player1, iprofile **player2);
 void freeconfig(emuconfig *config);
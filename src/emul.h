@@ -75,6 +75,17 @@ typedef enum {
     SND_ON
 } sound_onoff;
 
+typedef enum {
+    SYNC_TIMER, /* frames paced by the timer, the audio rate follows the audio buffer */
+    SYNC_AUDIO, /* frames paced by the audio device consumption, at a fixed audio rate */
+    SYNC_VIDEO  /* frames paced by the display vsync, the audio rate follows the audio buffer */
+} sync_mode;
+
+typedef enum {
+    PSG_POINT,  /* point sampled at the output rate */
+    PSG_BLEP    /* band-limited steps at the chip clock */
+} psg_synthesis;
+
 typedef enum {
     SC_MONO = 1,
     SC_STEREO = 2
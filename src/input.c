@@ -37,6 +37,11 @@ typedef struct {
 kstat *statuskeys = NULL;
 jstat *statuspads = NULL;
 
+// SDL timestamp of the oldest event on a joypad key or button not yet taken by the emulation
+Uint32 _eventstamp = 0;
+int _eventpending = 0;
+const iprofile *_profiles[2] = { NULL, NULL }; // profiles in use, set by input_setprofile
+
 void input_free()
 {
     free(statuskeys);
@@ -77,8 +82,63 @@ void input_init()
     pushexit(input_free);
 }
 
+static int input_profilekey(const iprofile *profile, SDL_Scancode k)
+{
+    return (profile->kbd.up==k) || (profile->kbd.down==k) || (profile->kbd.left==k) || (profile->kbd.right==k) ||
+           (profile->kbd.btn_a==k) || (profile->kbd.btn_b==k) || (profile->kbd.btn_start==k);
+}
+
+static int input_profilebutton(const iprofile *profile, byte button)
+{
+    return (profile->pad.btn_a==button) || (profile->pad.btn_b==button) || (profile->pad.btn_start==button);
+}
+
+// The axis event moves a direction of the profile across the pressed threshold
+static int input_profileaxis(const iprofile *profile, byte axis, sword previous, sword value)
+{
+    const byte directions[4] = { profile->pad.up, profile->pad.down, profile->pad.left, profile->pad.right };
+    int i;
+
+    for(i=0; i<4; i++) {
+        if((directions[i] & 0x0F)!=axis) continue;
+        if((directions[i] & 0xF0) ? ((previous<=-8192)!=(value<=-8192)) : ((previous>=8192)!=(value>=8192))) return 1;
+    }
+    return 0;
+}
+
+// Only the events on the keys and buttons of the players profiles change the joypads
+static int input_joypadevent(const SDL_Event *event)
+{
+    const iprofile *profile;
+    int i;
+
+    for(i=0; i<2; i++) {
+        if((profile = _profiles[i])==NULL) continue;
+        switch(event->type) {
+            case SDL_KEYDOWN:
+            case SDL_KEYUP:
+                if((profile->base.type==INP_KEYBOARD) && !event->key.repeat && input_profilekey(profile, event->key.keysym.scancode)) return 1;
+                break;
+            case SDL_JOYBUTTONDOWN:
+            case SDL_JOYBUTTONUP:
+                if((profile->base.type==INP_JOYPAD) && (profile->pad.index==event->jbutton.which) && input_profilebutton(profile, event->jbutton.button)) return 1;
+                break;
+            case SDL_JOYAXISMOTION:
+                if((profile->base.type==INP_JOYPAD) && (profile->pad.index==event->jaxis.which) &&
+                   input_profileaxis(profile, event->jaxis.axis, statuspads[event->jaxis.which].axis[event->jaxis.axis], event->jaxis.value)) return 1;
+                break;
+        }
+    }
+    return 0;
+}
+
 void input_process_event(const SDL_Event *event)
 {
+    if(!_eventpending && input_joypadevent(event)) {
+        _eventstamp = event->common.timestamp;
+        _eventpending = 1;
+    }
+
     switch(event->type) {
         case SDL_KEYDOWN:
             assert(event->key.keysym.scancode<SDL_NUM_SCANCODES);
@@ -121,6 +181,17 @@ void input_process_event(const SDL_Event *event)
     }
 }
 
+// Take the timestamp of the oldest input event processed since the last call, returns 0 when there is none
+int input_takeeventstamp(Uint32 *timestamp)
+{
+    int pending = _eventpending;
+
+    *timestamp = _eventstamp;
+    _eventpending = 0;
+
+    return pending;
+}
+
 int input_key_pressed(SDL_Scancode k)
 {
     assert(k<SDL_NUM_SCANCODES);
@@ -362,6 +433,13 @@ void input_loaddefaultprofile(iprofile **p1, iprofile **p2)
     }
 }
 
+// The events on the keys and buttons of the profiles in use are stamped for the input latency
+static void input_useprofile(const iprofile *profile)
+{
+    if((_profiles[0]==NULL) || (_profiles[0]==profile)) _profiles[0] = profile;
+    else _profiles[1] = profile;
+}
+
 int input_setprofile(iprofile *profile)
 {
     int i;
@@ -371,11 +449,13 @@ int input_setprofile(iprofile *profile)
 
     switch(profile->base.type) {
         case INP_KEYBOARD:
+            input_useprofile(profile);
             return 1;
         case INP_JOYPAD:
             for(i=SDL_NumJoysticks()-1; i>=0; i--) {
                 if(strcmp(CSTR(profile->pad.name), SDL_JoystickName(statuspads[i].joy))==0) {
                     profile->pad.index = i;
+                    input_useprofile(profile);
                     return 1;
                 }
             }
@@ -387,6 +467,8 @@ int input_setprofile(iprofile *profile)
 
 void input_freeprofile(iprofile *profile)
 {
+    if(_profiles[0]==profile) _profiles[0] = NULL;
+    if(_profiles[1]==profile) _profiles[1] = NULL;
     if(profile) {
         strfree(profile->base.name);
         free(profile);
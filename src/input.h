@@ -49,6 +49,7 @@ typedef union {
 void input_init(void);
 
 void input_process_event(const SDL_Event *event);
+int input_takeeventstamp(Uint32 *timestamp);
 
 int input_key_pressed(SDL_Scancode k);
 int input_key_down(SDL_Scancode k);
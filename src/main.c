@@ -24,6 +24,7 @@
 #endif
 
 #include <getopt.h>
+#include <time.h>
 #include <zip.h>
 
 #include "emuconfig.h"
@@ -46,6 +47,8 @@
     #endif
 #endif /* HAVE_ENDIAN_H */
 
+#define IDLE_WAIT_MIN   10      // ms, first wait for an event while paused
+#define IDLE_WAIT_MAX   640     // ms, the wait doubles while no event arrives
 
 typedef struct {
     string basedir;
@@ -89,13 +92,40 @@ void initmodules(const string basedir)
     seticon(video_getcurrentwindow());
 }
 
+static void processevent(const SDL_Event *event, int *done, int *focused)
+{
+    video_event(event);
+    input_process_event(event);
+    *done |= (event->type==SDL_QUIT);
+
+    if(event->type==SDL_WINDOWEVENT) {
+        if(event->window.event==SDL_WINDOWEVENT_FOCUS_LOST) *focused = 0;
+        if(event->window.event==SDL_WINDOWEVENT_FOCUS_GAINED) *focused = 1;
+    }
+}
+
+static void idlereport(Uint32 ticks, clock_t cpu, int wakeups)
+{
+    ticks = SDL_GetTicks() - ticks;
+    if(ticks==0) return;
+
+    log4me_info(LOG_EMU_MAIN, "idle for %u ms : %d wake-up(s), %.1f%% CPU\n", ticks, wakeups,
+                (double)(clock() - cpu) * 100000 / CLOCKS_PER_SEC / ticks);
+}
+
 int main ( int argc, char** argv )
 {
-    int done, pause, bookmark;
+    int done, pause, bookmark, turbo;
+    int focused, focuspause, idle, idlewait, idlewakeups;
+    Uint32 idleticks = 0;
+    clock_t idlecpu = 0;
+    int fps, realtime;
+    char title[256];
 
     string configfilename  = NULL;
 
     mastersystem *sms = NULL;
+    snapshotwriter *snapshots = NULL;
     appenv *environment = NULL;
     romspecs *rspecs = NULL;
 
@@ -184,6 +214,13 @@ int main ( int argc, char** argv )
     assert((vmode==VM_NTSC) || (vmode==VM_PAL));
     log4me_print("SMS : Use %s machine with %s video mode\n", machine==EXPORT ? "Export" : "Japan", vmode==VM_PAL ? "PAL" : "NTSC");
 
+    // The vsync paces the emulation only when the display runs at the frame rate, it is disabled otherwise
+    if((config.sync==SYNC_VIDEO) && (ABS(video_getrefreshrate() - (vmode==VM_PAL ? 50 : 60))>1)) {
+        log4me_print("SYNC: Display refresh rate %d Hz, use the timer synchronization\n", video_getrefreshrate());
+        config.sync = SYNC_TIMER;
+    }
+    video_setvsync(config.sync==SYNC_VIDEO);
+
     screen.minscale = (float)224.0 / 192;
 
     switch(getromgameconsole(rspecs)) {
@@ -211,6 +248,14 @@ int main ( int argc, char** argv )
         video_setbezel(&screen, CSTR(config.bezelfilename));
 
     audio_setvolume(config.volume);
+    audio_setsynthesis(config.psgsynthesis);
+    audio_setlatency(config.latency);
+    audio_setsamplerate(config.samplerate);
+    audio_setbuffer(config.audiobuffer);
+    if(config.exportfilename)
+        audio_setexport(CSTR(config.exportfilename));
+    if(config.vgmfilename)
+        ms_setvgmlog(CSTR(config.vgmfilename));
 
     sms = ms_init(&screen, rspecs, config.nosound ? SND_OFF : SND_ON, player1, player2, environment->backup);
     if(sms==NULL) {
@@ -220,16 +265,51 @@ int main ( int argc, char** argv )
 
     SDL_SetWindowTitle(video_getcurrentwindow(), CSTR(sms->romname));
 
-    done = pause = bookmark = 0;
+    ms_setsync(sms, config.sync);
+    ms_setspeed(sms, config.speed);
+    ms_setframeskip(sms, config.frameskip);
+    ms_setrunahead(sms, config.runahead);
+    ms_setlatencyreport(sms, config.inputlatency);
+    ms_setrewind(sms, config.rewind, config.rewindinterval);
+
+    snapshots = createsnapshotwriter(sms, environment->snapshots);
+
+    done = pause = bookmark = turbo = 0;
+    focused = 1;
+    focuspause = idle = idlewait = idlewakeups = 0;
 
     ms_start(sms);
     while (!done)
     {
         SDL_Event event;
-        while(SDL_PollEvent(&event)) {
-            video_event(&event);
-            input_process_event(&event);
-            done |= (event.type==SDL_QUIT);
+
+        // Paused, the loop sleeps until an event arrives
+        if(ms_ispaused(sms)) {
+            if(!idle) {
+                idle = 1;
+                idlewait = IDLE_WAIT_MIN;
+                idlewakeups = 0;
+                idleticks = SDL_GetTicks();
+                idlecpu = clock();
+            }
+            idlewakeups++;
+            if(SDL_WaitEventTimeout(&event, idlewait)) {
+                processevent(&event, &done, &focused);
+                idlewait = IDLE_WAIT_MIN;
+            } else if(idlewait<IDLE_WAIT_MAX)
+                idlewait *= 2;
+        } else if(idle) {
+            idle = 0;
+            idlereport(idleticks, idlecpu, idlewakeups);
+        }
+
+        while(SDL_PollEvent(&event))
+            processevent(&event, &done, &focused);
+
+        // The emulation is paused while the window is in the background
+        if(!config.background && ((!focused)!=focuspause)) {
+            focuspause = !focused;
+            ms_pause(sms, focuspause);
         }
 
         done |= input_key_pressed(SDL_SCANCODE_ESCAPE);
@@ -240,11 +320,16 @@ int main ( int argc, char** argv )
         }
 
         if(input_key_down(SDL_SCANCODE_F9))
-            takesnapshot(sms, environment->snapshots);
+            takesnapshot(snapshots);
 
         if(input_key_down(SDL_SCANCODE_F10))
             takescreenshot(sms, environment->screenshots);
 
+        if(input_key_down(SDL_SCANCODE_F11) && !ms_ispaused(sms)) {
+            turbo ^= 1;
+            ms_setspeed(sms, turbo ? config.turbo : config.speed);
+        }
+
         if(input_key_down(SDL_SCANCODE_F2)) {
             ms_pause(sms, 1);
             screen.scale -= 0.2;
@@ -277,9 +362,19 @@ int main ( int argc, char** argv )
             tms9918a_toggledisplaypalette(&sms->vdp);
 #endif
 
-        if(!ms_ispaused(sms)) ms_execute(sms);
+        // Backspace held steps back through the history
+        if(!ms_ispaused(sms) && !(input_key_pressed(SDL_SCANCODE_BACKSPACE) && ms_rewind(sms)))
+            ms_execute(sms);
+
+        if(ms_getspeed(sms, &fps, &realtime)) {
+            snprintf(title, sizeof(title), "%s - %d fps (%d%%)", CSTR(sms->romname), fps, realtime);
+            SDL_SetWindowTitle(video_getcurrentwindow(), title);
+        }
     }
 
+    if(idle) idlereport(idleticks, idlecpu, idlewakeups);
+
+    releaseobject(snapshots);
     releaseobject(sms);
     releaseobject(rspecs);
 
@@ -306,6 +401,21 @@ void printhelp()
     log4me_print("  --mode TYPE\t\t: Set the video mode NTSC/PAL [ntsc/pal] (default=ntsc)\n");
     log4me_print("  --nosound\t\t: Set the sound to off\n");
     log4me_print("  --volume VOL\t\t: Set the volume [0..100] (default=100)\n");
+    log4me_print("  --psg ENGINE\t\t: Set the PSG synthesis [point/blep] (default=point)\n");
+    log4me_print("  --latency MS\t\t: Set the audio latency [10..200] (default=%d)\n", SN7_DEFAULT_LATENCY);
+    log4me_print("  --samplerate HZ\t: Set the audio output rate (default=%d)\n", SND_DEFAULT_FREQUENCY);
+    log4me_print("  --audiobuffer NUM\t: Set the audio device buffer in samples (default=%d)\n", SDL_SAMPLES);
+    log4me_print("  --export FILE\t\t: Export the sound to a WAV file (raw PCM if FILE ends with .raw or .pcm)\n");
+    log4me_print("  --vgm FILE\t\t: Log the sound chips to a VGM file\n");
+    log4me_print("  --sync MODE\t\t: Set the master clock of the emulation [timer/audio/video] (default=timer)\n");
+    log4me_print("  --background\t\t: Keep running when the window loses the focus\n");
+    log4me_print("  --runahead NUM\t: Present the frame emulated NUM frames ahead to reduce the input latency [0..%d] (default=0)\n", MS_MAX_RUNAHEAD);
+    log4me_print("  --inputlatency\t: Print the histogram of the input to display latency on exit\n");
+    log4me_print("  --rewind MB\t\t: Keep MB megabytes of history to rewind with the backspace key, 0 to disable (default=0)\n");
+    log4me_print("  --rewindinterval NUM\t: Capture a state every NUM frames for the rewind (default=1)\n");
+    log4me_print("  --speed NUM\t\t: Set the emulation speed multiplier, 0 for unthrottled (default=1)\n");
+    log4me_print("  --turbo NUM\t\t: Set the speed multiplier toggled with F11, 0 for unthrottled (default=%d)\n", MS_DEFAULT_TURBO);
+    log4me_print("  --frameskip NUM\t: Skip NUM frames after each displayed frame (default=0)\n");
     log4me_print("  --noaspectratio\t: Don't keep aspect ratio\n");
     log4me_print("  --scale NUM\t\t: Increase the size of the screen by NUM (default=%d)\n", DEFAULT_SCALE);
     log4me_print("  --codemasters\t\t: Force the compatibility of Codemasters games\n");
@@ -329,6 +439,21 @@ void getconfigfilename(int argc, char **argv, const appenv *env, string *configf
         {"mode"         , no_argument       , NULL, 0   },
         {"volume"       , no_argument       , NULL, 0   },
         {"nosound"      , no_argument       , NULL, 0   },
+        {"psg"          , no_argument       , NULL, 0   },
+        {"latency"      , no_argument       , NULL, 0   },
+        {"samplerate"   , no_argument       , NULL, 0   },
+        {"audiobuffer"  , no_argument       , NULL, 0   },
+        {"export"       , no_argument       , NULL, 0   },
+        {"vgm"          , no_argument       , NULL, 0   },
+        {"sync"         , no_argument       , NULL, 0   },
+        {"background"   , no_argument       , NULL, 0   },
+        {"runahead"     , no_argument       , NULL, 0   },
+        {"inputlatency" , no_argument       , NULL, 0   },
+        {"rewind"       , no_argument       , NULL, 0   },
+        {"rewindinterval", no_argument      , NULL, 0   },
+        {"speed"        , no_argument       , NULL, 0   },
+        {"turbo"        , no_argument       , NULL, 0   },
+        {"frameskip"    , no_argument       , NULL, 0   },
         {"noaspectratio", no_argument       , NULL, 0   },
         {"scale"        , no_argument       , NULL, 0   },
         {"codemasters"  , no_argument       , NULL, 0   },
@@ -368,6 +493,21 @@ void readoptions(int argc, char **argv, char **romfilename, tmachine *machine, v
         {"mode", required_argument, NULL, 'm'},
         {"volume", required_argument, NULL, 'v'},
         {"nosound", no_argument, &config->nosound, 1},
+        {"psg", required_argument, NULL, 'p'},
+        {"latency", required_argument, NULL, 'l'},
+        {"samplerate", required_argument, NULL, 'r'},
+        {"audiobuffer", required_argument, NULL, 'a'},
+        {"export", required_argument, NULL, 'e'},
+        {"vgm", required_argument, NULL, 'g'},
+        {"sync", required_argument, NULL, 'y'},
+        {"background", no_argument, &config->background, 1},
+        {"runahead", required_argument, NULL, 'n'},
+        {"inputlatency", no_argument, &config->inputlatency, 1},
+        {"rewind", required_argument, NULL, 'w'},
+        {"rewindinterval", required_argument, NULL, 'i'},
+        {"speed", required_argument, NULL, 'x'},
+        {"turbo", required_argument, NULL, 'u'},
+        {"frameskip", required_argument, NULL, 'f'},
         {"noaspectratio", no_argument, &config->noaspectratio, 1},
         {"scale", required_argument, NULL, 's'},
         {"codemasters", no_argument, codemasters, 1},
@@ -396,6 +536,47 @@ void readoptions(int argc, char **argv, char **romfilename, tmachine *machine, v
             case 'v':
                 config->volume = atoi(optarg);
                 break;
+            case 'p':
+                config->psgsynthesis = strcasecmp(optarg, "blep")==0 ? PSG_BLEP : PSG_POINT;
+                break;
+            case 'l':
+                config->latency = atoi(optarg);
+                break;
+            case 'r':
+                config->samplerate = atoi(optarg);
+                break;
+            case 'a':
+                config->audiobuffer = atoi(optarg);
+                break;
+            case 'e':
+                strfree(config->exportfilename);
+                config->exportfilename = strcrec(optarg);
+                break;
+            case 'g':
+                strfree(config->vgmfilename);
+                config->vgmfilename = strcrec(optarg);
+                break;
+            case 'y':
+                config->sync = parsesyncmode(optarg);
+                break;
+            case 'n':
+                config->runahead = atoi(optarg);
+                break;
+            case 'w':
+                config->rewind = atoi(optarg);
+                break;
+            case 'i':
+                config->rewindinterval = atoi(optarg);
+                break;
+            case 'x':
+                config->speed = atoi(optarg);
+                break;
+            case 'u':
+                config->turbo = atoi(optarg);
+                break;
+            case 'f':
+                config->frameskip = atoi(optarg);
+                break;
             case 't':
                 *machine = strcasecmp(optarg, "export")==0 ? EXPORT : JAPAN;
                 break;
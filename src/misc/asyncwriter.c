@@ -0,0 +1,136 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <SDL.h>
+
+#include "asyncwriter.h"
+#include "ringbuf.h"
+
+// The producer queues the data in a ring buffer, the writer thread empties it to the file by blocks of chunk bytes.
+// When the file is slower than the producer, the producer waits : no data is ever dropped.
+struct _asyncwriter {
+    FILE *file;
+    ringbuf *buffer;
+    int chunk;
+    unsigned char *block;
+    int error;
+    int closing;
+    SDL_Thread *thread;
+    SDL_mutex *lock;
+    SDL_cond *cond; // data available for the writer or room available for the producer
+};
+
+static int awthread(void *data)
+{
+    asyncwriter *aw = data;
+    int len, available;
+
+    SDL_LockMutex(aw->lock);
+    for(;;) {
+        while(((available = rbavailable(aw->buffer))<aw->chunk) && !aw->closing)
+            SDL_CondWait(aw->cond, aw->lock);
+        if(aw->closing && (available==0)) break;
+        SDL_UnlockMutex(aw->lock);
+
+        len = rbread(aw->buffer, aw->block, available<aw->chunk ? available : aw->chunk);
+        if(fwrite(aw->block, 1, len, aw->file)!=(size_t)len) aw->error = 1;
+
+        SDL_LockMutex(aw->lock);
+        SDL_CondSignal(aw->cond);
+    }
+    SDL_UnlockMutex(aw->lock);
+
+    return 0;
+}
+
+asyncwriter *awcreate(FILE *file, int size, int chunk)
+{
+    asyncwriter *aw;
+
+    assert((chunk>0) && (chunk<=size));
+    if((aw = (asyncwriter*)calloc(1, sizeof(asyncwriter)))==NULL) return NULL;
+
+    aw->file = file;
+    aw->chunk = chunk;
+    if(((aw->buffer = rbcreate(size))==NULL) ||
+       ((aw->block = (unsigned char*)malloc(chunk))==NULL) ||
+       ((aw->lock = SDL_CreateMutex())==NULL) ||
+       ((aw->cond = SDL_CreateCond())==NULL) ||
+       ((aw->thread = SDL_CreateThread(awthread, "asyncwriter", aw))==NULL)) {
+        if(aw->buffer) rbdelete(aw->buffer);
+        if(aw->lock) SDL_DestroyMutex(aw->lock);
+        if(aw->cond) SDL_DestroyCond(aw->cond);
+        free(aw->block);
+        free(aw);
+        return NULL;
+    }
+
+    return aw;
+}
+
+void awwrite(asyncwriter *aw, const void *data, int len)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    int n, before;
+
+    while(len>0) {
+        before = rbavailable(aw->buffer);
+        n = rbwrite(aw->buffer, p, len<rbspace(aw->buffer) ? len : rbspace(aw->buffer));
+        p += n;
+        len -= n;
+
+        // Wake up the writer once a block is ready, wait for it when the buffer is full
+        if(((before<aw->chunk) && (before+n>=aw->chunk)) || (len>0)) {
+            SDL_LockMutex(aw->lock);
+            SDL_CondSignal(aw->cond);
+            if((len>0) && (rbspace(aw->buffer)==0))
+                SDL_CondWait(aw->cond, aw->lock);
+            SDL_UnlockMutex(aw->lock);
+        }
+    }
+}
+
+// Write the queued data and stop the writer thread, the file stays open. Returns 0 when a write failed.
+int awdelete(asyncwriter *aw)
+{
+    int ok;
+
+    if(aw==NULL) return 1;
+
+    SDL_LockMutex(aw->lock);
+    aw->closing = 1;
+    SDL_CondSignal(aw->cond);
+    SDL_UnlockMutex(aw->lock);
+    SDL_WaitThread(aw->thread, NULL);
+
+    ok = !aw->error;
+    rbdelete(aw->buffer);
+    SDL_DestroyMutex(aw->lock);
+    SDL_DestroyCond(aw->cond);
+    free(aw->block);
+    free(aw);
+
+    return ok;
+}
@@ -0,0 +1,16 @@
+#ifndef ASYNCWRITER_H_INCLUDED
+#define ASYNCWRITER_H_INCLUDED
+
+#include <stdio.h>
+
+// Buffered file output written by a background thread
+
+struct _asyncwriter;
+typedef struct _asyncwriter asyncwriter;
+
+asyncwriter *awcreate(FILE *file, int size, int chunk);
+int awdelete(asyncwriter *aw);
+
+void awwrite(asyncwriter *aw, const void *data, int len);
+
+#endif // ASYNCWRITER_H_INCLUDED
@@ -0,0 +1,111 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+// Debug helper checking that a code section does not allocate memory.
+// The glibc allocator entry points are overridden and forwarded to their __libc_ counterparts,
+// allocations are counted only for the thread which armed the check.
+
+#ifdef DEBUG
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memcheck.h"
+#include "../emul.h"
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread const char *_section = NULL;
+static __thread int _suspended = 0;
+static __thread int _allocations = 0;
+
+#define memcheck_count() { if(_section && !_suspended) _allocations++; }
+
+void *malloc(size_t size)
+{
+    memcheck_count();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    memcheck_count();
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    memcheck_count();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if(ptr) memcheck_count();
+    __libc_free(ptr);
+}
+
+void memcheck_begin(const char *section)
+{
+    assert(_section==NULL);
+    _section = section;
+    _suspended = 0;
+    _allocations = 0;
+}
+
+void memcheck_end()
+{
+    const char *section = _section;
+    int allocations = _allocations;
+
+    assert(section!=NULL);
+    _section = NULL; // the log below is allowed to allocate
+    if(allocations)
+        log4me_warning(LOG_EMU_MAIN, "%s : %d memory allocation(s)\n", section, allocations);
+    assert(allocations==0);
+}
+
+void memcheck_suspend()
+{
+    _suspended++;
+}
+
+void memcheck_resume()
+{
+    assert(_suspended>0);
+    _suspended--;
+}
+
+#else
+
+void memcheck_begin(const char *section) {}
+void memcheck_end() {}
+void memcheck_suspend() {}
+void memcheck_resume() {}
+
+#endif /* __GLIBC__ */
+
+#endif /* DEBUG */
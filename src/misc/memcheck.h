@@ -0,0 +1,17 @@
+#ifndef MEMCHECK_H_INCLUDED
+#define MEMCHECK_H_INCLUDED
+
+#ifdef DEBUG
+void memcheck_begin(const char *section);
+void memcheck_end(void);
+
+void memcheck_suspend(void);
+void memcheck_resume(void);
+#else
+#define memcheck_begin(s)   (void)0
+#define memcheck_end()      (void)0
+#define memcheck_suspend()  (void)0
+#define memcheck_resume()   (void)0
+#endif /* DEBUG */
+
+#endif // MEMCHECK_H_INCLUDED
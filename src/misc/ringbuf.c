@@ -0,0 +1,154 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <SDL.h>
+
+#include "ringbuf.h"
+
+// head and tail are free running counters, only the producer updates head and only the consumer updates tail.
+// The size is a power of two so (head - tail) is the number of bytes stored, even when the counters wrap.
+struct _ringbuf {
+    unsigned char *data;
+    unsigned int size;
+    unsigned int mask;
+    SDL_atomic_t head;
+    SDL_atomic_t tail;
+    SDL_atomic_t overruns;
+    SDL_atomic_t underruns;
+};
+
+ringbuf *rbcreate(int size)
+{
+    ringbuf *rb;
+    unsigned int pow2 = 1;
+
+    assert(size>0);
+    while(pow2<(unsigned int)size) pow2 <<= 1;
+
+    if((rb = (ringbuf*)calloc(1, sizeof(ringbuf)))==NULL) return NULL;
+    if((rb->data = (unsigned char*)calloc(pow2, 1))==NULL) {
+        free(rb);
+        return NULL;
+    }
+    rb->size = pow2;
+    rb->mask = pow2 - 1;
+    return rb;
+}
+
+void rbdelete(ringbuf *rb)
+{
+    if(rb==NULL) return;
+    free(rb->data);
+    free(rb);
+}
+
+int rbavailable(const ringbuf *rb)
+{
+    return (int)((unsigned int)SDL_AtomicGet((SDL_atomic_t*)&rb->head) - (unsigned int)SDL_AtomicGet((SDL_atomic_t*)&rb->tail));
+}
+
+int rbspace(const ringbuf *rb)
+{
+    return rb->size - rbavailable(rb);
+}
+
+// Copy len bytes from/to the ring at position pos, in two parts when the copy wraps
+static void rbcopyin(ringbuf *rb, unsigned int pos, const unsigned char *src, int len)
+{
+    unsigned int offset = pos & rb->mask, part = SDL_min((unsigned int)len, rb->size - offset);
+
+    memcpy(rb->data + offset, src, part);
+    memcpy(rb->data, src + part, len - part);
+}
+
+static void rbcopyout(const ringbuf *rb, unsigned int pos, unsigned char *dst, int len)
+{
+    unsigned int offset = pos & rb->mask, part = SDL_min((unsigned int)len, rb->size - offset);
+
+    memcpy(dst, rb->data + offset, part);
+    memcpy(dst + part, rb->data, len - part);
+}
+
+// Write up to len bytes, the bytes not fitting in the ring are dropped and counted as an overrun
+int rbwrite(ringbuf *rb, const void *data, int len)
+{
+    unsigned int head = (unsigned int)SDL_AtomicGet(&rb->head);
+    int space = rbspace(rb);
+
+    if(len>space) {
+        SDL_AtomicIncRef(&rb->overruns);
+        len = space;
+    }
+    if(len<=0) return 0;
+
+    rbcopyin(rb, head, (const unsigned char*)data, len);
+    SDL_AtomicSet(&rb->head, (int)(head + len)); // publish the data only once it is copied
+    return len;
+}
+
+// Read up to len bytes, a read with not enough data is counted as an underrun
+int rbread(ringbuf *rb, void *data, int len)
+{
+    unsigned int tail = (unsigned int)SDL_AtomicGet(&rb->tail);
+    int available = rbavailable(rb);
+
+    if(len>available) {
+        SDL_AtomicIncRef(&rb->underruns);
+        len = available;
+    }
+    if(len<=0) return 0;
+
+    rbcopyout(rb, tail, (unsigned char*)data, len);
+    SDL_AtomicSet(&rb->tail, (int)(tail + len)); // release the space only once it is copied
+    return len;
+}
+
+// Same as rbread without consuming the data
+int rbpeek(const ringbuf *rb, void *data, int len)
+{
+    unsigned int tail = (unsigned int)SDL_AtomicGet((SDL_atomic_t*)&rb->tail);
+
+    len = SDL_min(len, rbavailable(rb));
+    if(len<=0) return 0;
+
+    rbcopyout(rb, tail, (unsigned char*)data, len);
+    return len;
+}
+
+void rbreset(ringbuf *rb)
+{
+    SDL_AtomicSet(&rb->head, 0);
+    SDL_AtomicSet(&rb->tail, 0);
+}
+
+int rboverruns(const ringbuf *rb)
+{
+    return SDL_AtomicGet((SDL_atomic_t*)&rb->overruns);
+}
+
+int rbunderruns(const ringbuf *rb)
+{
+    return SDL_AtomicGet((SDL_atomic_t*)&rb->underruns);
+}
@@ -0,0 +1,27 @@
+#ifndef RINGBUF_H_INCLUDED
+#define RINGBUF_H_INCLUDED
+
+// Lock-free single producer / single consumer ring buffer
+
+struct _ringbuf;
+typedef struct _ringbuf ringbuf;
+
+ringbuf *rbcreate(int size);
+void rbdelete(ringbuf *rb);
+
+// Producer side
+int rbwrite(ringbuf *rb, const void *data, int len);
+int rbspace(const ringbuf *rb);
+
+// Consumer side
+int rbread(ringbuf *rb, void *data, int len);
+int rbpeek(const ringbuf *rb, void *data, int len);
+int rbavailable(const ringbuf *rb);
+
+// Neither the producer nor the consumer must be running
+void rbreset(ringbuf *rb);
+
+int rboverruns(const ringbuf *rb);
+int rbunderruns(const ringbuf *rb);
+
+#endif // RINGBUF_H_INCLUDED
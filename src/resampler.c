@@ -0,0 +1,186 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+/*
+Polyphase resampler.
+The input is low-pass filtered by a windowed sinc evaluated at the output sample positions,
+the kernel is precomputed for RS_PHASES sub-sample positions and the nearest one is used.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "resampler.h"
+#include "emul.h"
+
+#define RS_TAPS         32  // kernel width in input samples, multiple of 8
+#define RS_PHASES_BITS  8
+#define RS_PHASES       (1 << RS_PHASES_BITS)
+#define RS_UNIT_BITS    14  // kernel unity gain, leaves room for the overshoot in 16 bits
+#define RS_CUTOFF       0.45 // fraction of the lowest sample rate
+
+#define RS_FRAC_BITS    32  // position in input samples, 32.32 fixed point
+
+struct _resampler {
+    int channels;
+    int capacity;   // input samples per call
+    int length;     // samples in the history
+    qword pos;      // next output position in the history
+    qword step;     // input samples per output sample
+    short *history[2];
+    short kernel[RS_PHASES][RS_TAPS];
+};
+
+// Windowed sinc for each sub-sample phase, each phase sums exactly to the unity gain
+static void resampler_buildkernel(resampler r, double cutoff)
+{
+    int phase, t, sum;
+    double x, w, h[RS_TAPS], total;
+
+    for(phase=0; phase<RS_PHASES; phase++) {
+        total = 0;
+        for(t=0; t<RS_TAPS; t++) {
+            x = t - (RS_TAPS/2 - 1) - (double)phase/RS_PHASES; // distance to the output position
+            w = 0.42 + 0.5*SDL_cos(M_PI*x/(RS_TAPS/2)) + 0.08*SDL_cos(2*M_PI*x/(RS_TAPS/2)); // Blackman
+            if(SDL_fabs(x)>=RS_TAPS/2) w = 0;
+            h[t] = (x==0 ? 2*cutoff : SDL_sin(2*M_PI*cutoff*x) / (M_PI*x)) * w;
+            total += h[t];
+        }
+
+        for(t=0,sum=0; t<RS_TAPS; t++) {
+            r->kernel[phase][t] = (short)SDL_floor(h[t] * (1 << RS_UNIT_BITS) / total + 0.5);
+            sum += r->kernel[phase][t];
+        }
+        r->kernel[phase][RS_TAPS/2] += (1 << RS_UNIT_BITS) - sum; // rounding error on the center tap
+    }
+}
+
+resampler resampler_new(int inrate, int outrate, int channels, int capacity)
+{
+    int c;
+    resampler r = calloc(1, sizeof(struct _resampler));
+    if(r==NULL) return NULL;
+
+    assert((channels>=1) && (channels<=2));
+    r->channels = channels;
+    r->capacity = capacity;
+    r->step = ((qword)inrate << RS_FRAC_BITS) / outrate;
+
+    for(c=0; c<channels; c++) {
+        if((r->history[c] = calloc(capacity + RS_TAPS, sizeof(short)))==NULL) {
+            resampler_release(r);
+            return NULL;
+        }
+    }
+
+    // Downsampling moves the cutoff below the output Nyquist frequency
+    resampler_buildkernel(r, outrate<inrate ? RS_CUTOFF * outrate / inrate : RS_CUTOFF);
+    resampler_clear(r);
+
+    return r;
+}
+
+void resampler_release(resampler r)
+{
+    if(r==NULL) return;
+    free(r->history[0]);
+    free(r->history[1]);
+    free(r);
+}
+
+void resampler_clear(resampler r)
+{
+    int c;
+
+    // The history starts with the samples before the kernel center so the output is not delayed
+    r->length = RS_TAPS/2 - 1;
+    r->pos = 0;
+    for(c=0; c<r->channels; c++)
+        memset(r->history[c], 0, (r->capacity + RS_TAPS) * sizeof(short));
+}
+
+// Small corrections of the ratio keep the kernel, the rates only need the same unit
+void resampler_setrate(resampler r, int inrate, int outrate)
+{
+    r->step = ((qword)inrate << RS_FRAC_BITS) / outrate;
+}
+
+// Upper bound of the output samples produced by count input samples
+int resampler_maxoutput(resampler r, int count)
+{
+    return (int)((((qword)(count + RS_TAPS) << RS_FRAC_BITS) / r->step) + 1);
+}
+
+static inline short resampler_dot(const short *x, const short *h)
+{
+    int sum;
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    int t;
+
+    for(t=0; t<RS_TAPS; t+=8)
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(x + t)), _mm_loadu_si128((const __m128i*)(h + t))));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = _mm_cvtsi128_si32(acc);
+#else
+    int t;
+
+    for(t=0,sum=0; t<RS_TAPS; t++)
+        sum += x[t] * h[t];
+#endif
+    sum = (sum + (1 << (RS_UNIT_BITS - 1))) >> RS_UNIT_BITS;
+    return sum>32767 ? 32767 : (sum<-32768 ? -32768 : sum);
+}
+
+// Resample count interleaved input samples (at most the capacity) into out, returns the output samples
+int resampler_process(resampler r, const short *in, int count, short *out)
+{
+    int c, i, n, consumed;
+    const short *kernel;
+
+    assert(count<=r->capacity);
+
+    for(c=0; c<r->channels; c++)
+        for(i=0; i<count; i++)
+            r->history[c][r->length + i] = in[i*r->channels + c];
+    r->length += count;
+
+    for(n=0; (int)(r->pos >> RS_FRAC_BITS) + RS_TAPS <= r->length; n++, r->pos+=r->step) {
+        i = (int)(r->pos >> RS_FRAC_BITS);
+        kernel = r->kernel[(r->pos >> (RS_FRAC_BITS - RS_PHASES_BITS)) & (RS_PHASES - 1)];
+        for(c=0; c<r->channels; c++)
+            out[n*r->channels + c] = resampler_dot(r->history[c] + i, kernel);
+    }
+
+    // Keep the samples still needed by the next outputs
+    consumed = (int)(r->pos >> RS_FRAC_BITS);
+    for(c=0; c<r->channels; c++)
+        memmove(r->history[c], r->history[c] + consumed, (r->length - consumed) * sizeof(short));
+    r->length -= consumed;
+    r->pos -= (qword)consumed << RS_FRAC_BITS;
+
+    return n;
+}
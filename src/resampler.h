@@ -0,0 +1,19 @@
+#ifndef RESAMPLER_H_INCLUDED
+#define RESAMPLER_H_INCLUDED
+
+#include "misc/types.h"
+
+// Sample rate converter for interleaved 16 bits mono or stereo streams.
+
+struct _resampler;
+typedef struct _resampler * resampler;
+
+resampler resampler_new(int inrate, int outrate, int channels, int capacity);
+void resampler_release(resampler r);
+void resampler_clear(resampler r);
+void resampler_setrate(resampler r, int inrate, int outrate);
+
+int resampler_maxoutput(resampler r, int count);
+int resampler_process(resampler r, const short *in, int count, short *out);
+
+#endif // RESAMPLER_H_INCLUDED
@@ -0,0 +1,302 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+
+#define REWIND_NONE     ((qword)-1)
+
+typedef struct {
+    int offset; // encoded state in the ring
+    int size; // encoded size
+    int length; // state size
+    qword keyframe; // sequence number of the keyframe it is encoded against, its own for a keyframe
+} rewind_entry;
+
+struct _rewindring {
+    byte *ring;
+    int ringsize;
+
+    rewind_entry *entries; // indexed by sequence number modulo maxentries
+    int maxentries;
+    qword first, next; // sequence numbers of the oldest state and of the next state
+    int used; // ring bytes holding states
+
+    int maxstate;
+    int keyinterval;
+    byte *key; // decoded keyframe, zero padded to maxstate
+    qword keyseq; // sequence number of the decoded keyframe, REWIND_NONE when stale
+    byte *zero; // reference of the keyframes
+    byte *scratch; // encoding buffer, large enough for the worst case
+};
+
+rewindring *rewind_create(int size, int maxstate, int keyinterval)
+{
+    rewindring *rw = calloc(1, sizeof(rewindring));
+
+    if(rw==NULL) return NULL;
+
+    rw->ringsize = size;
+    rw->maxentries = size / REWIND_ENTRY_BYTES + 1;
+    rw->maxstate = maxstate;
+    rw->keyinterval = keyinterval>0 ? keyinterval : REWIND_DEFAULT_KEYINTERVAL;
+    rw->first = rw->next = 0;
+    rw->used = 0;
+    rw->keyseq = REWIND_NONE;
+
+    rw->ring = malloc(size);
+    rw->entries = malloc(rw->maxentries * sizeof(rewind_entry));
+    rw->key = calloc(1, maxstate);
+    rw->zero = calloc(1, maxstate);
+    rw->scratch = malloc(2 * maxstate + 16);
+    if(!rw->ring || !rw->entries || !rw->key || !rw->zero || !rw->scratch) {
+        rewind_release(rw);
+        return NULL;
+    }
+
+    return rw;
+}
+
+void rewind_release(rewindring *rw)
+{
+    if(rw==NULL) return;
+
+    free(rw->ring);
+    free(rw->entries);
+    free(rw->key);
+    free(rw->zero);
+    free(rw->scratch);
+    free(rw);
+}
+
+static inline rewind_entry *rewind_entry_at(const rewindring *rw, qword seq)
+{
+    return &rw->entries[seq % rw->maxentries];
+}
+
+static inline int rewind_putsize(byte *p, int value)
+{
+    int n = 0;
+
+    while(value>=0x80) {
+        p[n++] = (byte)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (byte)value;
+
+    return n;
+}
+
+// Returns -1 past the end of the input or when the value overflows
+static inline int rewind_getsize(const byte *p, int size, int *pos)
+{
+    int value = 0, shift = 0;
+    byte b;
+
+    do {
+        if((*pos>=size) || (shift>28)) return -1;
+        b = p[(*pos)++];
+        value |= (b & 0x7F) << shift;
+        shift += 7;
+    } while(b & 0x80);
+
+    return value<0 ? -1 : value;
+}
+
+// Unchanged bytes from i, compared 8 bytes at a time
+static inline int rewind_same(const byte *state, const byte *ref, int i, int length)
+{
+    qword a, b;
+
+    while(i + 8<=length) {
+        memcpy(&a, state + i, 8);
+        memcpy(&b, ref + i, 8);
+        if(a!=b) break;
+        i += 8;
+    }
+    while((i<length) && (state[i]==ref[i])) i++;
+
+    return i;
+}
+
+// Runs of unchanged bytes and runs of changed bytes XORed with the reference :
+// (unchanged count, changed count, changed bytes)...
+static int rewind_encode(const byte *state, const byte *ref, int length, byte *out)
+{
+    int i = 0, j, start, size = 0;
+
+    while(i<length) {
+        start = i;
+        i = rewind_same(state, ref, i, length);
+        size += rewind_putsize(out + size, i - start);
+
+        // A literal run ends with REWIND_MIN_RUN unchanged bytes
+        start = i;
+        while(i<length) {
+            if(state[i]!=ref[i]) {
+                i++;
+                continue;
+            }
+            for(j=i; (j<length) && (j-i<REWIND_MIN_RUN) && (state[j]==ref[j]); j++);
+            if((j-i>=REWIND_MIN_RUN) || (j==length)) break;
+            i = j;
+        }
+        size += rewind_putsize(out + size, i - start);
+        for(j=start; j<i; j++)
+            out[size++] = state[j] ^ ref[j];
+    }
+
+    return size;
+}
+
+// Returns 0 when the runs go past the state or the input
+static int rewind_decode(const byte *in, int size, const byte *ref, int length, byte *state)
+{
+    int pos = 0, i = 0, n;
+
+    memcpy(state, ref, length);
+    while(pos<size) {
+        if(((n = rewind_getsize(in, size, &pos))<0) || (n>length - i)) return 0;
+        i += n;
+        if(((n = rewind_getsize(in, size, &pos))<0) || (n>length - i) || (n>size - pos)) return 0;
+        while(n-->0)
+            state[i++] ^= in[pos++];
+    }
+
+    return 1;
+}
+
+static void rewind_dropoldest(rewindring *rw)
+{
+    rw->used -= rewind_entry_at(rw, rw->first++)->size;
+    if(rw->keyseq<rw->first) rw->keyseq = REWIND_NONE;
+
+    // The states encoded against a dropped keyframe are dropped with it
+    while((rw->first<rw->next) && (rewind_entry_at(rw, rw->first)->keyframe!=rw->first))
+        rw->used -= rewind_entry_at(rw, rw->first++)->size;
+}
+
+static inline int rewind_overlaps(const rewind_entry *e, int offset, int size)
+{
+    return (e->offset<offset + size) && (offset<e->offset + e->size);
+}
+
+// Store a state, the oldest ones are dropped to make room
+void rewind_push(rewindring *rw, const byte *state, int length)
+{
+    rewind_entry *e;
+    int size, offset, head, wrap, keyframe;
+
+    if((length<=0) || (length>rw->maxstate)) return;
+
+    keyframe = (rw->keyseq==REWIND_NONE) || (rw->next - rw->keyseq>=(qword)rw->keyinterval);
+    for(;;) {
+        size = rewind_encode(state, keyframe ? rw->zero : rw->key, length, rw->scratch);
+        if(size>rw->ringsize) return;
+
+        // After the newest state, at the start of the ring when it does not fit before the end
+        head = wrap = 0;
+        if(rw->first!=rw->next) {
+            e = rewind_entry_at(rw, rw->next - 1);
+            head = e->offset + e->size;
+        }
+        offset = head;
+        if(offset + size>rw->ringsize) {
+            offset = 0;
+            wrap = 1;
+        }
+
+        // The states are stored in the order of the ring from the head : on a wrap, the states of the
+        // previous lap between the head and the end of the ring are the oldest ones and are dropped first
+        while((rw->first<rw->next) &&
+              ((rw->next - rw->first>=(qword)rw->maxentries) ||
+               (wrap && (rewind_entry_at(rw, rw->first)->offset>=head)) ||
+               rewind_overlaps(rewind_entry_at(rw, rw->first), offset, size)))
+            rewind_dropoldest(rw);
+
+        // The keyframe of the delta has just been dropped
+        if(keyframe || (rw->keyseq!=REWIND_NONE)) break;
+        keyframe = 1;
+    }
+
+    memcpy(rw->ring + offset, rw->scratch, size);
+    e = rewind_entry_at(rw, rw->next);
+    e->offset = offset;
+    e->size = size;
+    e->length = length;
+    e->keyframe = keyframe ? rw->next : rw->keyseq;
+
+    if(keyframe) {
+        memcpy(rw->key, state, length);
+        memset(rw->key + length, 0, rw->maxstate - length);
+        rw->keyseq = rw->next;
+    }
+    rw->used += size;
+    rw->next++;
+}
+
+// Take back the newest state, returns its length or 0 when the history is empty.
+// A state that does not decode empties the history.
+int rewind_pop(rewindring *rw, byte *state)
+{
+    rewind_entry *e, *k;
+    int ok;
+
+    if(rw->first==rw->next) return 0;
+
+    e = rewind_entry_at(rw, --rw->next);
+    rw->used -= e->size;
+    if(e->keyframe==rw->next) {
+        ok = rewind_decode(rw->ring + e->offset, e->size, rw->zero, e->length, state);
+        rw->keyseq = REWIND_NONE; // the next state pushed is a keyframe
+    } else {
+        ok = 1;
+        if(rw->keyseq!=e->keyframe) {
+            k = rewind_entry_at(rw, e->keyframe);
+            memset(rw->key, 0, rw->maxstate);
+            ok = rewind_decode(rw->ring + k->offset, k->size, rw->zero, k->length, rw->key);
+            rw->keyseq = ok ? e->keyframe : REWIND_NONE;
+        }
+        ok = ok && rewind_decode(rw->ring + e->offset, e->size, rw->key, e->length, state);
+    }
+
+    if(!ok) {
+        rw->first = rw->next;
+        rw->used = 0;
+        rw->keyseq = REWIND_NONE;
+        return 0;
+    }
+
+    return e->length;
+}
+
+int rewind_count(const rewindring *rw)
+{
+    return (int)(rw->next - rw->first);
+}
+
+// Ring bytes holding states
+int rewind_used(const rewindring *rw)
+{
+    return rw->used;
+}
@@ -0,0 +1,26 @@
+#ifndef REWIND_H_INCLUDED
+#define REWIND_H_INCLUDED
+
+#include "misc/types.h"
+
+// History of machine states in a ring of fixed size. A keyframe is stored every
+// keyinterval states, the others are stored as the XOR with their keyframe, run
+// length encoded. The oldest states are dropped when the ring is full.
+
+#define REWIND_DEFAULT_KEYINTERVAL  60      // states between two keyframes
+#define REWIND_MIN_RUN              4       // unchanged bytes ending a literal run
+#define REWIND_ENTRY_BYTES          1024    // ring bytes per state, sizes the index of the states
+
+struct _rewindring;
+typedef struct _rewindring rewindring;
+
+rewindring *rewind_create(int size, int maxstate, int keyinterval);
+void rewind_release(rewindring *rw);
+
+void rewind_push(rewindring *rw, const byte *state, int length);
+int rewind_pop(rewindring *rw, byte *state);
+
+int rewind_count(const rewindring *rw);
+int rewind_used(const rewindring *rw);
+
+#endif // REWIND_H_INCLUDED
@@ -0,0 +1,131 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+// Checks of the rewind history : the states popped are the ones pushed, in reverse order,
+// whatever the sizes of the records and the wraps of the ring
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+
+#define MAXSTATE    50000
+#define HISTORY     256     /* more than the states held by the rings */
+
+static byte history[HISTORY][MAXSTATE];
+static int lengths[HISTORY];
+static int failures = 0;
+
+static void check(int condition, const char *test, const char *what)
+{
+    if(condition) return;
+    printf("%s : %s\n", test, what);
+    failures++;
+}
+
+static void randomize(byte *state, int length)
+{
+    int i;
+
+    for(i=0; i<length; i++) state[i] = (byte)rand();
+}
+
+// Pop every state left and compare them to the last ones pushed, newest first
+static void checkpops(rewindring *rw, int pushed, const char *test)
+{
+    byte state[MAXSTATE];
+    int count = rewind_count(rw), i, length;
+
+    check(count<=pushed, test, "more states than pushed");
+    for(i=pushed-1; i>=pushed-count; i--) {
+        length = rewind_pop(rw, state);
+        check(length==lengths[i % HISTORY], test, "wrong length");
+        check((length==lengths[i % HISTORY]) && (memcmp(state, history[i % HISTORY], length)==0), test, "wrong state");
+    }
+    check(rewind_pop(rw, state)==0, test, "history not empty");
+    check(rewind_used(rw)==0, test, "ring bytes left");
+}
+
+// Keyframes of mixed sizes : the last one wraps while the oldest state is at the end of the ring,
+// after the head, and the states of the current lap are at the start of the ring
+static void testwrap(void)
+{
+    static const int sizes[] = { 30000, 30000, 30000, 5000, 45000, 20000, 40000 };
+    rewindring *rw = rewind_create(100000, MAXSTATE, 1);
+    int i, n = sizeof(sizes) / sizeof(sizes[0]);
+
+    for(i=0; i<n; i++) {
+        lengths[i] = sizes[i];
+        randomize(history[i], lengths[i]);
+        rewind_push(rw, history[i], lengths[i]);
+        check(rewind_used(rw)<=100000, "wrap", "ring overflow");
+    }
+    check(rewind_count(rw)>=1, "wrap", "newest state dropped");
+    checkpops(rw, n, "wrap");
+
+    rewind_release(rw);
+}
+
+// Mixed sizes and small changes between the states, with pops in between
+static void testmixed(void)
+{
+    rewindring *rw = rewind_create(200000, MAXSTATE, 4);
+    byte state[MAXSTATE];
+    int i, k, n, pushed = 0, length, changes;
+
+    randomize(state, MAXSTATE);
+    for(i=0; i<2000; i++) {
+        length = 1000 + rand() % (MAXSTATE - 1000);
+        changes = rand() % 4==0 ? length : rand() % 200;
+        for(k=0; k<changes; k++) state[rand() % length] = (byte)rand();
+
+        memcpy(history[pushed % HISTORY], state, length);
+        lengths[pushed % HISTORY] = length;
+        rewind_push(rw, state, length);
+        pushed++;
+        check(rewind_used(rw)<=200000, "mixed", "ring overflow");
+
+        // Step back a few states, the next pushes go on from there
+        if(rand() % 50==0) {
+            n = rand() % 8;
+            for(k=0; (k<n) && (rewind_count(rw)>0); k++) {
+                pushed--;
+                length = rewind_pop(rw, state);
+                check((length==lengths[pushed % HISTORY]) && (memcmp(state, history[pushed % HISTORY], length)==0), "mixed", "wrong state while stepping back");
+            }
+        }
+    }
+    checkpops(rw, pushed, "mixed");
+
+    rewind_release(rw);
+}
+
+int main(void)
+{
+    srand(1);
+
+    testwrap();
+    testmixed();
+
+    if(failures==0) printf("rewind : all checks passed\n");
+    return failures==0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
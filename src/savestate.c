@@ -0,0 +1,214 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+#include <string.h>
+
+#include "savestate.h"
+
+static inline void state_put(byte *p, qword value, int len)
+{
+    int i;
+
+    for(i=0; i<len; i++, value>>=8)
+        p[i] = (byte)value;
+}
+
+static inline qword state_get(const byte *p, int len)
+{
+    qword value = 0;
+    int i;
+
+    for(i=len-1; i>=0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+void state_writebegin(statewriter *w, byte *buffer, int size)
+{
+    w->buffer = buffer;
+    w->size = size;
+    w->pos = 0;
+    w->chunk = -1;
+    w->overflow = 0;
+
+    state_write(w, STATE_MAGIC, 4);
+    state_write16(w, STATE_VERSION);
+}
+
+// Returns the size of the state, 0 when the buffer is too small
+int state_writeend(statewriter *w)
+{
+    return w->overflow ? 0 : w->pos;
+}
+
+void state_beginchunk(statewriter *w, dword tag, int version)
+{
+    w->chunk = w->pos;
+    state_write32(w, tag);
+    state_write16(w, (word)version);
+    state_write32(w, 0); // size, set when the chunk is closed
+}
+
+void state_endchunk(statewriter *w)
+{
+    if(!w->overflow)
+        state_put(w->buffer + w->chunk + 6, w->pos - w->chunk - STATE_CHUNK_SIZE, 4);
+    w->chunk = -1;
+}
+
+void state_write(statewriter *w, const void *data, int len)
+{
+    if(w->overflow || (w->pos + len > w->size)) {
+        w->overflow = 1;
+        return;
+    }
+    memcpy(w->buffer + w->pos, data, len);
+    w->pos += len;
+}
+
+static inline void state_writevalue(statewriter *w, qword value, int len)
+{
+    if(w->overflow || (w->pos + len > w->size)) {
+        w->overflow = 1;
+        return;
+    }
+    state_put(w->buffer + w->pos, value, len);
+    w->pos += len;
+}
+
+void state_write8(statewriter *w, byte value)
+{
+    state_writevalue(w, value, 1);
+}
+
+void state_write16(statewriter *w, word value)
+{
+    state_writevalue(w, value, 2);
+}
+
+void state_write32(statewriter *w, dword value)
+{
+    state_writevalue(w, value, 4);
+}
+
+void state_write64(statewriter *w, qword value)
+{
+    state_writevalue(w, value, 8);
+}
+
+// Returns 0 when the buffer does not hold a state of a known format version
+int state_readbegin(statereader *r, const byte *buffer, int size)
+{
+    r->buffer = buffer;
+    r->size = size;
+    r->pos = r->end = STATE_HEADER_SIZE;
+    r->error = 0;
+
+    if((size<STATE_HEADER_SIZE) || (memcmp(buffer, STATE_MAGIC, 4)!=0)) return 0;
+    return state_get(buffer + 4, 2)<=STATE_VERSION;
+}
+
+// Move to the next chunk, the rest of the current one is skipped. Returns 0 after the last chunk.
+int state_nextchunk(statereader *r, dword *tag, int *version)
+{
+    dword size;
+
+    r->pos = r->end;
+    if(r->pos + STATE_CHUNK_SIZE > r->size) {
+        r->error |= r->pos!=r->size;
+        return 0;
+    }
+
+    *tag = (dword)state_get(r->buffer + r->pos, 4);
+    *version = (int)state_get(r->buffer + r->pos + 4, 2);
+    size = (dword)state_get(r->buffer + r->pos + 6, 4);
+    r->pos += STATE_CHUNK_SIZE;
+
+    if(size > (dword)(r->size - r->pos)) {
+        r->error = 1;
+        r->end = r->size;
+        return 0;
+    }
+    r->end = r->pos + size;
+
+    return 1;
+}
+
+void state_read(statereader *r, void *data, int len)
+{
+    if(r->pos + len > r->end) {
+        r->error = 1;
+        memset(data, 0, len);
+        return;
+    }
+    memcpy(data, r->buffer + r->pos, len);
+    r->pos += len;
+}
+
+// Move past len bytes of the chunk, used to check a state without loading it
+void state_skip(statereader *r, int len)
+{
+    if(r->pos + len > r->end) {
+        r->error = 1;
+        return;
+    }
+    r->pos += len;
+}
+
+// The chunk is read up to its end without error
+int state_chunkend(const statereader *r)
+{
+    return !r->error && (r->pos==r->end);
+}
+
+static inline qword state_readvalue(statereader *r, int len)
+{
+    qword value;
+
+    if(r->pos + len > r->end) {
+        r->error = 1;
+        return 0;
+    }
+    value = state_get(r->buffer + r->pos, len);
+    r->pos += len;
+
+    return value;
+}
+
+byte state_read8(statereader *r)
+{
+    return (byte)state_readvalue(r, 1);
+}
+
+word state_read16(statereader *r)
+{
+    return (word)state_readvalue(r, 2);
+}
+
+dword state_read32(statereader *r)
+{
+    return (dword)state_readvalue(r, 4);
+}
+
+qword state_read64(statereader *r)
+{
+    return state_readvalue(r, 8);
+}
@@ -0,0 +1,56 @@
+#ifndef SAVESTATE_H_INCLUDED
+#define SAVESTATE_H_INCLUDED
+
+#include "misc/types.h"
+
+// Binary machine state : a header followed by tagged chunks, one per subsystem.
+//   header : "EMKS", format version (16 bits)
+//   chunk  : tag (4 bytes), chunk version (16 bits), data size (32 bits), data
+// The values are little endian, the chunks unknown to the reader are skipped.
+// The state is written into and read from a buffer provided by the caller.
+
+#define STATE_MAGIC         "EMKS"
+#define STATE_VERSION       1
+#define STATE_HEADER_SIZE   6
+#define STATE_CHUNK_SIZE    10  // chunk header
+
+#define STATE_TAG(a, b, c, d)   ((dword)(a) | ((dword)(b) << 8) | ((dword)(c) << 16) | ((dword)(d) << 24))
+
+typedef struct {
+    byte *buffer;
+    int size, pos;
+    int chunk; // position of the header of the open chunk
+    int overflow; // the buffer is too small
+} statewriter;
+
+typedef struct {
+    const byte *buffer;
+    int size, pos;
+    int end; // end of the current chunk
+    int error; // read beyond the chunk or malformed state
+} statereader;
+
+void state_writebegin(statewriter *w, byte *buffer, int size);
+int state_writeend(statewriter *w);
+
+void state_beginchunk(statewriter *w, dword tag, int version);
+void state_endchunk(statewriter *w);
+
+void state_write(statewriter *w, const void *data, int len);
+void state_write8(statewriter *w, byte value);
+void state_write16(statewriter *w, word value);
+void state_write32(statewriter *w, dword value);
+void state_write64(statewriter *w, qword value);
+
+int state_readbegin(statereader *r, const byte *buffer, int size);
+int state_nextchunk(statereader *r, dword *tag, int *version);
+
+void state_read(statereader *r, void *data, int len);
+void state_skip(statereader *r, int len);
+int state_chunkend(const statereader *r);
+byte state_read8(statereader *r);
+word state_read16(statereader *r);
+dword state_read32(statereader *r);
+qword state_read64(statereader *r);
+
+#endif // SAVESTATE_H_INCLUDED
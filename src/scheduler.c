@@ -0,0 +1,114 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+#include <assert.h>
+
+#include "scheduler.h"
+
+static inline int scheduler_before(const sched_event *a, const sched_event *b)
+{
+    return (a->cycle<b->cycle) || ((a->cycle==b->cycle) && (a->type<b->type));
+}
+
+static inline void scheduler_place(scheduler *s, int i, const sched_event *e)
+{
+    s->heap[i] = *e;
+    s->position[e->type] = i;
+}
+
+static void scheduler_up(scheduler *s, int i)
+{
+    sched_event e = s->heap[i];
+
+    while(i>0) {
+        int parent = (i - 1) >> 1;
+        if(!scheduler_before(&e, &s->heap[parent])) break;
+        scheduler_place(s, i, &s->heap[parent]);
+        i = parent;
+    }
+    scheduler_place(s, i, &e);
+}
+
+static void scheduler_down(scheduler *s, int i)
+{
+    sched_event e = s->heap[i];
+
+    for(;;) {
+        int child = (i << 1) + 1;
+        if(child>=s->count) break;
+        if((child+1<s->count) && scheduler_before(&s->heap[child+1], &s->heap[child])) child++;
+        if(!scheduler_before(&s->heap[child], &e)) break;
+        scheduler_place(s, i, &s->heap[child]);
+        i = child;
+    }
+    scheduler_place(s, i, &e);
+}
+
+static void scheduler_removeat(scheduler *s, int i)
+{
+    s->position[s->heap[i].type] = SCHED_NONE;
+    if(--s->count==i) return;
+
+    // The last event fills the hole, then moves up or down
+    scheduler_place(s, i, &s->heap[s->count]);
+    if((i>0) && scheduler_before(&s->heap[i], &s->heap[(i - 1) >> 1]))
+        scheduler_up(s, i);
+    else
+        scheduler_down(s, i);
+}
+
+void scheduler_init(scheduler *s)
+{
+    int i;
+
+    s->count = 0;
+    for(i=0;i<SCHED_EVENTS;i++)
+        s->position[i] = SCHED_NONE;
+}
+
+// Schedule an event at the tstate cycle, an event of the same type already scheduled is moved
+void scheduler_add(scheduler *s, int type, qword cycle)
+{
+    sched_event e;
+
+    assert((type>=0) && (type<SCHED_EVENTS));
+
+    if(s->position[type]!=SCHED_NONE)
+        scheduler_removeat(s, s->position[type]);
+
+    e.cycle = cycle;
+    e.type = type;
+    scheduler_place(s, s->count, &e);
+    scheduler_up(s, s->count++);
+}
+
+// Remove and return the earliest event due at the tstate cycle, SCHED_NONE when there is none
+int scheduler_pop(scheduler *s, qword cycle)
+{
+    int type;
+
+    if((s->count==0) || (s->heap[0].cycle>cycle)) return SCHED_NONE;
+
+    type = s->heap[0].type;
+    scheduler_removeat(s, 0);
+
+    return type;
+}
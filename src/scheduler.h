@@ -0,0 +1,35 @@
+#ifndef SCHEDULER_H_INCLUDED
+#define SCHEDULER_H_INCLUDED
+
+#include "misc/types.h"
+
+// Timestamp ordered events, keyed on the CPU tstates : a binary min-heap of
+// event types, each type being scheduled at most once. Events due at the
+// same tstate are delivered by increasing type.
+
+#define SCHED_EVENTS    8       // event types
+#define SCHED_NONE      (-1)
+
+typedef struct {
+    qword cycle;
+    int type;
+} sched_event;
+
+typedef struct {
+    sched_event heap[SCHED_EVENTS];
+    int position[SCHED_EVENTS]; // index of each type in the heap, SCHED_NONE when not scheduled
+    int count;
+} scheduler;
+
+void scheduler_init(scheduler *s);
+
+void scheduler_add(scheduler *s, int type, qword cycle);
+int scheduler_pop(scheduler *s, qword cycle);
+
+// Tstate of the earliest event, the CPU runs up to it without interruption
+static inline qword scheduler_next(const scheduler *s)
+{
+    return s->count>0 ? s->heap[0].cycle : (qword)-1;
+}
+
+#endif // SCHEDULER_H_INCLUDED
@@ -234,6 +234,12 @@ seeprom *seeprom_create()
     return e;
 }
 
+// In-memory state capture, for the run-ahead
+void seeprom_copy(seeprom *dst, const seeprom *src)
+{
+    *dst = *src;
+}
+
 void seeprom_savedata(const seeprom *cpn, const string filename)
 {
     FILE *f;
@@ -357,3 +363,59 @@ void seeprom_loadsnapshot(seeprom *cpn, xmlNode *eepromnode)
         )
     )
 }
+
+void seeprom_savestate(const seeprom *cpn, statewriter *w)
+{
+    int i;
+
+    state_write8(w, cpn->cs);
+    state_write8(w, cpn->clk);
+    state_write8(w, cpn->din);
+    state_write8(w, cpn->dout);
+    state_write8(w, cpn->readonly);
+    state_write8(w, (byte)cpn->state);
+    state_write8(w, cpn->command);
+    state_write16(w, cpn->addr);
+    state_write16(w, cpn->value);
+    state_write16(w, (word)cpn->shift); // negative once the last bit is shifted
+    for(i=0; i<64; i++)
+        state_write16(w, cpn->data[i]);
+}
+
+// The state is read without being loaded, returns 0 when the lines, the state or the position are out of range
+int seeprom_checkstate(statereader *r)
+{
+    sword shift;
+
+    if(state_read8(r)>1) return 0; // cs
+    if(state_read8(r)>1) return 0; // clk
+    if(state_read8(r)>1) return 0; // din
+    state_skip(r, 2); // dout, readonly
+    if(state_read8(r)>ES_WRITING_DATA) return 0;
+    state_skip(r, 1); // command
+    if(state_read16(r)>=64) return 0; // addr
+    state_skip(r, 2); // value
+    shift = (sword)state_read16(r);
+    if((shift<-1) || (shift>15)) return 0;
+    state_skip(r, 64 * 2);
+
+    return !r->error;
+}
+
+void seeprom_loadstate(seeprom *cpn, statereader *r)
+{
+    int i;
+
+    cpn->cs = state_read8(r);
+    cpn->clk = state_read8(r);
+    cpn->din = state_read8(r);
+    cpn->dout = state_read8(r);
+    cpn->readonly = state_read8(r);
+    cpn->state = (sestate)state_read8(r);
+    cpn->command = state_read8(r);
+    cpn->addr = state_read16(r);
+    cpn->value = state_read16(r);
+    cpn->shift = (sword)state_read16(r);
+    for(i=0; i<64; i++)
+        cpn->data[i] = state_read16(r);
+}
@@ -4,6 +4,7 @@
 #include "emul.h"
 #include "misc/string.h"
 #include "misc/xml.h"
+#include "savestate.h"
 
 struct _seeprom;
 typedef struct _seeprom seeprom;
@@ -12,6 +13,7 @@ seeprom *seeprom_create(void);
 void seeprom_free(seeprom *cpn);
 
 void seeprom_init(seeprom *cpn);
+void seeprom_copy(seeprom *dst, const seeprom *src);
 
 void seeprom_getlines(const seeprom *cpn, byte *cs, byte *clk, byte *dout);
 void seeprom_setlines(seeprom *cpn, byte cs, byte clk, byte din);
@@ -22,4 +24,8 @@ void seeprom_loaddata(seeprom *cpn, const string filename);
 void seeprom_takesnapshot(const seeprom *cpn, xmlTextWriterPtr writer);
 void seeprom_loadsnapshot(seeprom *cpn, xmlNode *eepromnode);
 
+void seeprom_savestate(const seeprom *cpn, statewriter *w);
+int seeprom_checkstate(statereader *r);
+void seeprom_loadstate(seeprom *cpn, statereader *r);
+
 #endif // SEEPROM_H_INCLUDED
@@ -32,6 +32,7 @@
 #include "misc/log4me.h"
 #include "misc/exit.h"
 #include "misc/xml.h"
+#include "misc/memcheck.h"
 
 #define CPU_CLOCK_NTSC  3579545 // Hz for NTSC systems
 #define CPU_CLOCK_PAL   3546893 // Hz for PAL/SECAM
@@ -79,11 +80,16 @@ struct _iomap {
     writeiofunc writeio;
 };
 
+const char *_vgmfilename = NULL;
+
 static void sms_updatejoypads(mastersystem *sms);
 static string sms_getbackupfilename(mastersystem *sms);
 static string sms_geteepromfilename(mastersystem *sms);
 static void sms_loadrom(mastersystem *sms);
 static void sms_loadsnapshot(mastersystem *sms, xmlDocPtr doc);
+static void sms_latencyreport(const ms_latency *latency);
+static void sms_runaheadreport(mastersystem *sms);
+static void sms_markdirty(mastersystem *sms);
 
 static byte ms_readmemory(void* param, dword address)
 {
@@ -111,11 +117,14 @@ static void ms_writemregister(mastersystem *sms, int reg, byte data)
                         sms->rdmap[5] = sms->rdmap[4] + 8192; // 8ko
                         sms->wrmap[4] = sms->rdmap[4];
                         sms->wrmap[5] = sms->rdmap[5];
+                        sms->wrpages[4] = sms->cartpages + MS_DIRTY_PAGES(sms->rdmap[4] - sms->cartridgeram);
+                        sms->wrpages[5] = sms->wrpages[4] + MS_DIRTY_PAGES(8192);
                         sms->cartridgeram_detected = 1;
                     } else {
                         log4me_debug(LOG_EMU_SMS, "disable on-board cartridge ram\n");
                         sms->wrmap[4] = sms->mnull;
                         sms->wrmap[5] = sms->mnull;
+                        sms->wrpages[4] = sms->wrpages[5] = sms->nullpages;
                         ms_writemregister(sms, 3, sms->mregisters[3]);
                     }
                     break;
@@ -164,6 +173,7 @@ static void ms_writememory(void* param, dword address, byte data)
     mastersystem *sms = (mastersystem*)param;
 
     sms->wrmap[address>>13][address&0x1FFF] = data;
+    sms->wrpages[address>>13][(address&0x1FFF) >> MS_DIRTY_SHIFT] = sms->writeseq;
     if(address>=0xFFFC)
         ms_writemregister(sms, address & 0x03, data);
 
@@ -201,6 +211,7 @@ static void ms_writememory_segaeeprom(void* param, dword address, byte data)
     }
 
     sms->wrmap[address>>13][address&0x1FFF] = data;
+    sms->wrpages[address>>13][(address&0x1FFF) >> MS_DIRTY_SHIFT] = sms->writeseq;
     if(address>=0xFFFC)
         ms_writemregister(sms, address & 0x03, data);
 
@@ -220,6 +231,7 @@ static void sms_writememorycodemasters(void* param, dword address, byte data)
     mastersystem *sms = (mastersystem*)param;
 
     sms->wrmap[address>>13][address&0x1FFF] = data;
+    sms->wrpages[address>>13][(address&0x1FFF) >> MS_DIRTY_SHIFT] = sms->writeseq;
     if(address==0x8000) {
         sms->cmregister = data;
         sms->rdmap[4] = sms->rom + ((data % sms->rombanks) << 14); // 8ko
@@ -312,10 +324,10 @@ static byte sms_readioF2(mastersystem *sms, byte port)
     // The SMS normally assigns reads from $C0-$FF to the I/O chip. You must
     // disable the I/O chip by setting bit 2 of port $3E if you want to read
     // port $F2 to perform YM2413 detection.
-    byte data = ~sms->port_f2; // YM2413 not implemented return false value
+    // Without the FM sound unit the written value is not read back
+    byte data = sms->fmunit ? sms->port_f2 & 0x03 : ~sms->port_f2;
     log4me_debug(LOG_EMU_SMS, "Read I/O port F2 = %02X (%d) => Try to detect YM2413\n", data, data);
     return data;
-    // return sms->machine==JAPAN ? sms->port_f2 : 0xFF;
 
 }
 
@@ -378,12 +390,19 @@ static void sms_writeiogg(mastersystem *sms, byte port, byte data)
     sms->ports[port] = data;
 }
 
-static void sms_writeioF2(mastersystem *sms, byte port, byte data)
+static void sms_writeioF2latch(mastersystem *sms, byte port, byte data)
 {
     sms->port_f2 = data;
     log4me_debug(LOG_EMU_SMS, "Write %02X (%d) to port F2 => Try to detect YM2413\n", data, data);
 }
 
+static void sms_writeioF2(mastersystem *sms, byte port, byte data)
+{
+    sms_writeioF2latch(sms, port, data);
+    // The bits 0-1 select the PSG and/or the FM output
+    if(sms->fmunit) ym2413_setcontrol(&sms->fmsnd, data);
+}
+
 static void sms_initiomapper(mastersystem *sms)
 {
 #define INIT_IO_MAP(p,ro,r,wo,w)  {   \
@@ -424,6 +443,19 @@ if(sms->gconsole==GC_GG) {
     INIT_IO_MAP(0xF0, NULL          , NULL                  , &sms->fmsnd   , ym2413_write);
     INIT_IO_MAP(0xF1, NULL          , NULL                  , &sms->fmsnd   , ym2413_write);
     INIT_IO_MAP(0xF2, sms           , sms_readioF2          , sms           , sms_writeioF2);
+
+    // Same map without the sound chips, the audio control is still read back
+    memcpy(sms->iosilent, sms->iomapper, 256 * sizeof(iomap));
+    sms->iomapper = sms->iosilent;
+if(sms->gconsole==GC_GG) {
+    INIT_IO_MAP(0x06, NULL          , NULL                  , sms           , sms_writeionull);
+}
+    INIT_IO_MAP(0x7E, &sms->vdp     , tms9918a_getscanline  , sms           , sms_writeionull);
+    INIT_IO_MAP(0x7F, &sms->vdp     , tms9918a_getscanline  , sms           , sms_writeionull);
+    INIT_IO_MAP(0xF0, NULL          , NULL                  , sms           , sms_writeionull);
+    INIT_IO_MAP(0xF1, NULL          , NULL                  , sms           , sms_writeionull);
+    INIT_IO_MAP(0xF2, sms           , sms_readioF2          , sms           , sms_writeioF2latch);
+    sms->iomapper = sms->iosound;
 }
 
 void ms_free(mastersystem *sms)
@@ -431,6 +463,9 @@ void ms_free(mastersystem *sms)
     string bkpfilename;
     FILE *f;
 
+    if(sms->latency.enabled) sms_latencyreport(&sms->latency);
+    if(sms->runahead>0) sms_runaheadreport(sms);
+
     if(sms->cartridgeram_detected) {
         bkpfilename = sms_getbackupfilename(sms);
 
@@ -450,18 +485,71 @@ void ms_free(mastersystem *sms)
     }
 
     seeprom_free(sms->mc93c46);
+    if(!vgmlog_close(sms->vgm))
+        log4me_error(LOG_EMU_SMS, "Unable to write the VGM file %s.\n", _vgmfilename);
     ym2413_free(&sms->fmsnd);
     sn76489_free(&sms->snd);
     tms9918a_free(&sms->vdp);
     clock_release(sms->idclock1s);
     strfree(sms->romname);
-    if(sms->iomapper) free(sms->iomapper);
+    if(sms->iosound) free(sms->iosound);
+    if(sms->iosilent) free(sms->iosilent);
+    if(sms->ahead) {
+        seeprom_free(sms->ahead->mc93c46);
+        free(sms->ahead);
+    }
+    rewind_release(sms->history);
+    if(sms->statebuffer) free(sms->statebuffer);
     if(sms->rom) free(sms->rom);
     if(sms->lkptsps) free(sms->lkptsps);
     if(sms->z80) cpuZ80_free(sms->z80);
     free(sms);
 }
 
+static void sms_latencyreport(const ms_latency *latency)
+{
+    int i, peak = 1;
+
+    if(latency->samples==0) {
+        log4me_print("Input latency : no joypad change presented\n");
+        return;
+    }
+
+    log4me_print("Input latency : %d sample(s), mean %u ms, max %u ms\n", latency->samples, latency->sum / latency->samples, latency->max);
+    for(i=0; i<MS_LATENCY_BUCKETS; i++)
+        if(latency->histogram[i]>peak) peak = latency->histogram[i];
+
+    for(i=0; i<MS_LATENCY_BUCKETS; i++) {
+        if(latency->histogram[i]==0) continue;
+        if(i<MS_LATENCY_BUCKETS-1)
+            log4me_print("  %3d-%3d ms : %5d %.*s\n", i * MS_LATENCY_BUCKET, (i + 1) * MS_LATENCY_BUCKET - 1, latency->histogram[i],
+                         latency->histogram[i] * 40 / peak, "########################################");
+        else
+            log4me_print("  %3d+    ms : %5d %.*s\n", i * MS_LATENCY_BUCKET, latency->histogram[i],
+                         latency->histogram[i] * 40 / peak, "########################################");
+    }
+}
+
+// Cost of the run-ahead since power on, the frames of the last second included
+static void sms_runaheadreport(mastersystem *sms)
+{
+    Uint64 ticks = sms->aheadticks + sms->aheadsave + sms->aheadrun + sms->aheadload;
+    int frames = sms->aheadtotal + sms->aheadframes;
+    double us;
+
+    if(frames==0) return;
+
+    us = ticks * 1000000.0 / SDL_GetPerformanceFrequency() / frames;
+    log4me_print("Run-ahead : %d frame(s) ahead, %d frame(s), %.0f us per frame, %.0f%% of the frame period\n",
+                 sms->runahead, frames, us, us * sms->vdp.framerate / 10000);
+}
+
+// Log the sound chips register writes to a VGM file from the power on
+void ms_setvgmlog(const char *filename)
+{
+    _vgmfilename = filename;
+}
+
 mastersystem* ms_init(const display *screen, const romspecs *rspecs, sound_onoff playsound, const iprofile *player1, const iprofile *player2, string backupdir)
 {
     int i;
@@ -516,6 +604,8 @@ mastersystem* ms_init(const display *screen, const romspecs *rspecs, sound_onoff
     sms->wrmap[5] = sms->mnull;
     sms->rdmap[6] = sms->wrmap[6] = sms->mem;
     sms->rdmap[7] = sms->wrmap[7] = sms->mem;
+    for(i=0;i<6;i++) sms->wrpages[i] = sms->nullpages;
+    sms->wrpages[6] = sms->wrpages[7] = sms->rampages;
 
     // => Software Reference Manual for the SEGA Mark III Console
     // When power is applied, the following data is set by the system ROM program:
@@ -549,20 +639,62 @@ mastersystem* ms_init(const display *screen, const romspecs *rspecs, sound_onoff
     sms->player2 = player2;
 
     sms->pause = 0;
+    sms->sync = SYNC_TIMER;
+    sms->speed = 1;
+    sms->frameskip = 0;
+    sms->speedcount = sms->skipcount = 0;
+    sms->lastframe = 0;
+    sms->fps = sms->realtime = sms->readout = 0;
+    sms->runahead = 0;
+    sms->ahead = NULL;
+    sms->aheadsave = sms->aheadrun = sms->aheadload = 0;
+    sms->aheadframes = 0;
+    sms->aheadticks = 0;
+    sms->aheadtotal = 0;
+    memset(&sms->latency, 0, sizeof(ms_latency));
+    sms->history = NULL;
+    sms->statebuffer = NULL;
+    sms->rewindinterval = 1;
+    sms->rewindcount = 0;
+    sms->rewindticks = 0;
+    sms->rewindcaptures = 0;
+    memset(&sms->dirty, 0, sizeof(ms_dirtystats));
+    memset(&sms->dirtyreadout, 0, sizeof(ms_dirtystats));
 
     tms9918a_init(&sms->vdp, sms->gconsole, screen, getromvideomode(rspecs));
+    sms->vdp.writeseq = &sms->writeseq;
+    sms->writeseq = 1;
+    sms_markdirty(sms);
     sms->scanlinespersecond = sms->vdp.framerate * sms->vdp.internalscanlines;
     sms->curscanlineps = 0;
 
-    sms->tstates = 0;
+    sms->cycles = 0;
 
-    sn76489_init(&sms->snd, sms->clock, sms->scanlinespersecond, sms->gconsole==GC_GG ? SC_STEREO : SC_MONO, playsound);
-    ym2413_init(&sms->fmsnd);
+    sn76489_init(&sms->snd, sms->clock, &sms->cycles, sms->gconsole==GC_GG ? SC_STEREO : SC_MONO, playsound);
+    sms->fmunit = (sms->gconsole==GC_SMS) && (getrommachine(rspecs)==JAPAN);
+    ym2413_init(&sms->fmsnd, sms->clock, sms->fmunit ? &sms->snd : NULL);
+    if(sms->fmunit) sms->snd.fm = &sms->fmsnd;
+
+    sms->vgm = NULL;
+    if(_vgmfilename!=NULL) {
+        if((sms->vgm = vgmlog_open(_vgmfilename, &sms->cycles, sms->clock, sms->vdp.framerate))==NULL) {
+            log4me_error(LOG_EMU_SMS, "Unable to create the VGM file %s.\n", _vgmfilename);
+            exit(EXIT_FAILURE);
+        }
+        sms->snd.vgm = sms->fmsnd.vgm = sms->vgm;
+        log4me_info(LOG_EMU_SMS, "log the sound chips to %s\n", _vgmfilename);
+    }
 
     sms->backupdir = backupdir;
     sms->idclock1s = clock_new(1);
 
-    sms->iomapper = calloc(256, sizeof(iomap));
+    sms->iosound = calloc(256, sizeof(iomap));
+    sms->iosilent = calloc(256, sizeof(iomap));
+    if((sms->iosound==NULL) || (sms->iosilent==NULL)) {
+        log4me_error(LOG_EMU_SMS, "Unable to allocate the memory block.\n");
+        exit(EXIT_FAILURE);
+    }
+    sms->iomapper = sms->iosound;
     sms_initiomapper(sms);
 
     sms->lkptsps = malloc(sizeof(int)*sms->scanlinespersecond);
@@ -574,6 +706,10 @@ mastersystem* ms_init(const display *screen, const romspecs *rspecs, sound_onoff
     for(i=0;i<sms->scanlinespersecond;i++)
         sms->lkptsps[i] = (((uint64_t)sms->clock*(i+1)) / sms->scanlinespersecond) - (((uint64_t)sms->clock*i) / sms->scanlinespersecond);
 
+    scheduler_init(&sms->events);
+    sms->lineend = sms->lkptsps[0];
+    scheduler_add(&sms->events, MS_EVENT_LINE, sms->lineend);
+
     sms_loadrom(sms);
 
     if(romhavesnapshot(rspecs))
@@ -634,6 +770,7 @@ static void sms_loadrom(mastersystem *sms)
         else
             memset(sms->cartridgeram, 0, MS_CARTRIDGE_RAM);
         fclose(fbkp) ;
+        sms_markdirty(sms);
     }
     strfree(bkpfilename);
 
@@ -677,59 +814,336 @@ static inline int sms_cpustep(mastersystem *sms)
     return cpuZ80_step(sms->z80);
 }
 
-void ms_execute(mastersystem *sms)
+// Emulate one frame, the sound chips get the writes of the I/O map in use
+static void sms_runframe(mastersystem *sms)
 {
 #define interrupt() { \
     if(tms9918a_int_pending(&sms->vdp)) { \
         tstates_op = sms_cpustep(sms); \
         if(cpuZ80_int_accepted(sms->z80)) tstates_op += cpuZ80_int(sms->z80); \
-        sms->tstates += tstates_op; \
         sms->cpu += tstates_op; \
+        sms->cycles += tstates_op; \
     } \
 }
-    int monitor_scanlines;
-    int tstates_per_scanline, tstates_op;
+    int i, monitor_scanlines, line, framedone;
+    int tstates_op;
+    qword next, frameend;
 
     assert(sms->vdp.scanline==0);
-    assert(sms->pause==0);
 
     monitor_scanlines = tms9918a_getmonitorscanlines(&sms->vdp);
 
-    // wait next frame
-    tms9918a_waitnextframe(&sms->vdp);
+    // The frame ends with its last scanline, the input is only read between frames
+    frameend = sms->lineend;
+    for(i=1, line=sms->curscanlineps; i<monitor_scanlines; i++) {
+        if(++line>=sms->scanlinespersecond) line = 0;
+        frameend += sms->lkptsps[line];
+    }
+    scheduler_add(&sms->events, MS_EVENT_FRAME, frameend);
 
-    while(monitor_scanlines>0) {
-        tstates_per_scanline = sms->lkptsps[sms->curscanlineps];
+    if((sms->gconsole==GC_SMS) && input_button_down(sms->player1, BTN_START))
+        scheduler_add(&sms->events, MS_EVENT_NMI, sms->lineend);
 
-        do {
+    framedone = 0;
+    while(!framedone) {
+        // The CPU runs up to the next event, only the interrupt line is checked between instructions
+        next = scheduler_next(&sms->events);
+        while(sms->cycles<next) {
             interrupt();
 
             tstates_op = sms_cpustep(sms);
-            sms->tstates += tstates_op;
             sms->cpu += tstates_op;
-        } while(sms->tstates<tstates_per_scanline);
-        sms->tstates -= tstates_per_scanline;
+            sms->cycles += tstates_op;
+        }
 
-        if((sms->gconsole==GC_SMS) && input_button_down(sms->player1, BTN_START))
-            cpuZ80_nmi(sms->z80);
+        while((i = scheduler_pop(&sms->events, sms->cycles))!=SCHED_NONE) {
+            switch(i) {
+                case MS_EVENT_NMI:
+                    cpuZ80_nmi(sms->z80);
+                    break;
 
-        sn76489_execute(&sms->snd);
+                case MS_EVENT_LINE:
+                    tms9918a_execute(&sms->vdp);
+
+                    interrupt();
+
+                    if(++sms->curscanlineps>=sms->scanlinespersecond) sms->curscanlineps = 0;
+                    sms->lineend += sms->lkptsps[sms->curscanlineps];
+                    scheduler_add(&sms->events, MS_EVENT_LINE, sms->lineend);
+                    break;
+
+                case MS_EVENT_FRAME:
+                    framedone = 1;
+                    break;
+            }
+        }
+    }
+#undef interrupt
+}
+
+// Copy the pages written after the checkpoint in the source or the destination
+static void sms_copydirty(byte *dst, const byte *src, const qword *dstpages, const qword *srcpages, int pages, qword checkpoint)
+{
+    int i;
+
+    for(i=0; i<pages; i++)
+        if((srcpages[i]>checkpoint) || (dstpages[i]>checkpoint))
+            memcpy(dst + (i << MS_DIRTY_SHIFT), src + (i << MS_DIRTY_SHIFT), 1 << MS_DIRTY_SHIFT);
+}
+
+// The memories hold the previous capture, only the pages written since then are copied
+static void sms_capturestate(mastersystem *sms, ms_state *state)
+{
+    state->z80 = *sms->z80;
+    tms9918a_copystate(&state->vdp, &sms->vdp, state->checkpoint);
+    if(sms->mc93c46) seeprom_copy(state->mc93c46, sms->mc93c46);
+
+    memcpy(state->rdmap, sms->rdmap, sizeof(sms->rdmap));
+    memcpy(state->wrmap, sms->wrmap, sizeof(sms->wrmap));
+    memcpy(state->wrpages, sms->wrpages, sizeof(sms->wrpages));
+    sms_copydirty(state->mem, sms->mem, state->rampages, sms->rampages, MS_DIRTY_PAGES(MS_MEM_SIZE), state->checkpoint);
+    memcpy(state->mregisters, sms->mregisters, sizeof(sms->mregisters));
+    state->cmregister = sms->cmregister;
+    sms_copydirty(state->cartridgeram, sms->cartridgeram, state->cartpages, sms->cartpages, MS_DIRTY_PAGES(MS_CARTRIDGE_RAM), state->checkpoint);
+    state->cartridgeram_detected = sms->cartridgeram_detected;
+    memcpy(state->rampages, sms->rampages, sizeof(sms->rampages));
+    memcpy(state->cartpages, sms->cartpages, sizeof(sms->cartpages));
+    state->checkpoint = ms_checkpoint(sms);
+
+    memcpy(state->ports, sms->ports, sizeof(sms->ports));
+    state->port_3e = sms->port_3e;
+    state->port_3f = sms->port_3f;
+    state->port_dc = sms->port_dc;
+    state->port_dd = sms->port_dd;
+    state->port_f2 = sms->port_f2;
+
+    state->cpu = sms->cpu;
+    state->cycles = sms->cycles;
+    state->curscanlineps = sms->curscanlineps;
+    state->lineend = sms->lineend;
+    state->events = sms->events;
+}
+
+// Only the pages written since the capture are copied back, their write sequences are restored as well
+static void sms_restorestate(mastersystem *sms, const ms_state *state)
+{
+    *sms->z80 = state->z80;
+    tms9918a_copystate(&sms->vdp, &state->vdp, state->checkpoint);
+    if(sms->mc93c46) seeprom_copy(sms->mc93c46, state->mc93c46);
+
+    memcpy(sms->rdmap, state->rdmap, sizeof(sms->rdmap));
+    memcpy(sms->wrmap, state->wrmap, sizeof(sms->wrmap));
+    memcpy(sms->wrpages, state->wrpages, sizeof(sms->wrpages));
+    sms_copydirty(sms->mem, state->mem, sms->rampages, state->rampages, MS_DIRTY_PAGES(MS_MEM_SIZE), state->checkpoint);
+    memcpy(sms->mregisters, state->mregisters, sizeof(sms->mregisters));
+    sms->cmregister = state->cmregister;
+    sms_copydirty(sms->cartridgeram, state->cartridgeram, sms->cartpages, state->cartpages, MS_DIRTY_PAGES(MS_CARTRIDGE_RAM), state->checkpoint);
+    sms->cartridgeram_detected = state->cartridgeram_detected;
+    memcpy(sms->rampages, state->rampages, sizeof(sms->rampages));
+    memcpy(sms->cartpages, state->cartpages, sizeof(sms->cartpages));
+
+    memcpy(sms->ports, state->ports, sizeof(sms->ports));
+    sms->port_3e = state->port_3e;
+    sms->port_3f = state->port_3f;
+    sms->port_dc = state->port_dc;
+    sms->port_dd = state->port_dd;
+    sms->port_f2 = state->port_f2;
+
+    sms->cpu = state->cpu;
+    sms->cycles = state->cycles;
+    sms->curscanlineps = state->curscanlineps;
+    sms->lineend = state->lineend;
+    sms->events = state->events;
+}
+
+// The frame is emulated and heard but not presented, then the state is saved, the next frames are
+// emulated silently and the last one is presented before the state is restored
+static void sms_runahead(mastersystem *sms)
+{
+    int i, present = sms->vdp.present;
+    Uint64 t0, t1, t2;
+
+    sms->vdp.present = 0;
+    sms_runframe(sms);
+
+    t0 = SDL_GetPerformanceCounter();
+    sms_capturestate(sms, sms->ahead);
+    t1 = SDL_GetPerformanceCounter();
+
+    sms->iomapper = sms->iosilent;
+    sms->vdp.paced = 0;
+    for(i=1; i<=sms->runahead; i++) {
+        sms->vdp.present = present && (i==sms->runahead);
+        sms_runframe(sms);
+    }
+    sms->iomapper = sms->iosound;
+    t2 = SDL_GetPerformanceCounter();
+
+    sms_restorestate(sms, sms->ahead);
 
-        tms9918a_execute(&sms->vdp);
+    sms->aheadsave += t1 - t0;
+    sms->aheadrun += t2 - t1;
+    sms->aheadload += SDL_GetPerformanceCounter() - t2;
+    sms->aheadframes++;
+}
 
-        interrupt();
+void ms_execute(mastersystem *sms)
+{
+    int audible, ram, cartridgeram, vram, pages;
+    qword checkpoint;
 
-        if(++sms->curscanlineps>=sms->scanlinespersecond) sms->curscanlineps = 0;
-        monitor_scanlines--;
+    assert(sms->vdp.scanline==0);
+    assert(sms->pause==0);
+
+    // Only one emulated frame per real time frame is heard and may be presented
+    if(sms->speed==MS_UNTHROTTLED) {
+        Uint32 t = SDL_GetTicks();
+        audible = (t - sms->lastframe) * sms->vdp.framerate >= 1000;
+        if(audible) sms->lastframe = t;
+    } else {
+        audible = ++sms->speedcount>=sms->speed;
+        if(audible) sms->speedcount = 0;
+    }
+    sms->vdp.present = audible && (sms->skipcount==0);
+    if(audible && (++sms->skipcount>sms->frameskip)) sms->skipcount = 0;
+
+    // Wait next frame : the frames not seen by the master clock are paced by the timer
+    if(sms->speed!=MS_UNTHROTTLED) {
+        switch(sms->sync) {
+            case SYNC_AUDIO:
+                if(audible)
+                    sn76489_waitbuffer(&sms->snd);
+                else
+                    tms9918a_waitnextframe(&sms->vdp);
+                break;
+            case SYNC_VIDEO:
+                // A presented frame waits for the vsync
+                if(!sms->vdp.present) tms9918a_waitnextframe(&sms->vdp);
+                break;
+            default:
+                tms9918a_waitnextframe(&sms->vdp);
+                break;
+        }
+    }
 
-        if(clock_elapsed(sms->idclock1s)) {
-            //log4me_info("[DBG] FPS : %d - Sound : %d - CPU : %d - Sound buffer : %d\n", sms->vdp.frame, sms->snd.samplerate, sms->cpu, sms->snd.curpos);
-            sms->vdp.frame = 0;
-            sms->snd.samplerate = 0;
-            sms->cpu = 0;
-            clock_step(sms->idclock1s);
+    // The emulation of a frame must not allocate memory
+    memcheck_begin("ms_execute");
+
+    checkpoint = ms_checkpoint(sms);
+
+    sn76489_beginframe(&sms->snd, audible ? SN7_FRAME_AUDIBLE : SN7_FRAME_EXPORTED);
+    if(sms->runahead>0)
+        sms_runahead(sms);
+    else
+        sms_runframe(sms);
+
+    pages = ms_getdirtypages(sms, checkpoint, &ram, &cartridgeram, &vram);
+    sms->dirty.frames++;
+    sms->dirty.ram += ram;
+    sms->dirty.cartridgeram += cartridgeram;
+    sms->dirty.vram += vram;
+    if(pages>sms->dirty.peak) sms->dirty.peak = pages;
+
+    if(clock_elapsed(sms->idclock1s)) {
+        sms->fps = sms->vdp.frame;
+        sms->realtime = (sms->vdp.frame * 100) / sms->vdp.framerate;
+        sms->readout = 1;
+        log4me_debug(LOG_EMU_SMS, "speed : %d fps, %d%% of real time\n", sms->fps, sms->realtime);
+        if(sms->snd.playsound==SND_ON)
+            log4me_debug(LOG_EMU_SN76489, "audio : %d ms buffered, rate %+d ppm, %d underrun(s), %d overrun(s)\n", sn76489_getlatency(&sms->snd), sms->snd.rateppm, rbunderruns(sms->snd.buffer), rboverruns(sms->snd.buffer));
+        clockstats pacing;
+        clock_getstats(sms->vdp.idclock, &pacing);
+        log4me_debug(LOG_EMU_SMS, "pacing : %d wait(s), lateness %.0f us, jitter %.0f us, max %.0f us\n", pacing.waits, pacing.mean, pacing.jitter, pacing.max);
+        if(sms->aheadframes>0) {
+#ifdef DEBUG
+            double us = 1000000.0 / SDL_GetPerformanceFrequency() / sms->aheadframes;
+            log4me_debug(LOG_EMU_SMS, "run-ahead : %d frame(s), save %.0f us, frames %.0f us, load %.0f us per frame, %.0f%% of the frame period\n",
+                         sms->runahead, sms->aheadsave * us, sms->aheadrun * us, sms->aheadload * us,
+                         (sms->aheadsave + sms->aheadrun + sms->aheadload) * us * sms->vdp.framerate / 10000);
+#endif
+            sms->aheadticks += sms->aheadsave + sms->aheadrun + sms->aheadload;
+            sms->aheadtotal += sms->aheadframes;
+            sms->aheadsave = sms->aheadrun = sms->aheadload = 0;
+            sms->aheadframes = 0;
         }
+        if(sms->rewindcaptures>0) {
+            log4me_debug(LOG_EMU_SMS, "rewind : %d state(s), %d KB, capture %.0f us\n", rewind_count(sms->history), rewind_used(sms->history) / 1024,
+                         sms->rewindticks * 1000000.0 / SDL_GetPerformanceFrequency() / sms->rewindcaptures);
+            sms->rewindticks = 0;
+            sms->rewindcaptures = 0;
+        }
+        if(sms->dirty.frames>0)
+            log4me_debug(LOG_EMU_SMS, "dirty pages : %.1f RAM, %.1f cartridge RAM, %.1f VRAM per frame, peak %d (%d bytes)\n",
+                         (double)sms->dirty.ram / sms->dirty.frames, (double)sms->dirty.cartridgeram / sms->dirty.frames,
+                         (double)sms->dirty.vram / sms->dirty.frames, sms->dirty.peak, sms->dirty.peak << MS_DIRTY_SHIFT);
+        sms->dirtyreadout = sms->dirty;
+        memset(&sms->dirty, 0, sizeof(ms_dirtystats));
+        sms->vdp.frame = 0;
+        sms->snd.samplerate = 0;
+        sms->cpu = 0;
+        clock_step(sms->idclock1s);
     }
+
+    // The latched joypad change is seen once a frame is presented
+    if(sms->latency.pending) {
+        Uint32 ticks;
+        if(video_getpresents(&ticks)!=sms->latency.presents) {
+            Uint32 ms = ticks - sms->latency.stamp;
+            int bucket = ms / MS_LATENCY_BUCKET;
+            sms->latency.histogram[bucket<MS_LATENCY_BUCKETS ? bucket : MS_LATENCY_BUCKETS-1]++;
+            sms->latency.samples++;
+            sms->latency.sum += ms;
+            if(ms>sms->latency.max) sms->latency.max = ms;
+            sms->latency.pending = 0;
+        }
+    }
+
+    // Synthesize the sound of the whole frame
+    sn76489_execute(&sms->snd);
+
+    if((sms->history!=NULL) && (++sms->rewindcount>=sms->rewindinterval)) {
+        Uint64 t = SDL_GetPerformanceCounter();
+        rewind_push(sms->history, sms->statebuffer, ms_savestate(sms, sms->statebuffer, MS_STATE_SIZE));
+        sms->rewindticks += SDL_GetPerformanceCounter() - t;
+        sms->rewindcaptures++;
+        sms->rewindcount = 0;
+    }
+
+    memcheck_end();
+}
+
+// Step back through the history : the last state captured is loaded and its frame is shown without sound,
+// the emulation stands still once the history is exhausted. Returns 0 when the rewind is disabled.
+int ms_rewind(mastersystem *sms)
+{
+    int size;
+    qword from;
+
+    if(sms->history==NULL) return 0;
+
+    assert(sms->pause==0);
+
+    if(sms->sync!=SYNC_VIDEO) tms9918a_waitnextframe(&sms->vdp);
+
+    memcheck_begin("ms_rewind");
+
+    if((size = rewind_pop(sms->history, sms->statebuffer))>0) {
+        ms_loadstate(sms, sms->statebuffer, size);
+        sn76489_beginframe(&sms->snd, SN7_FRAME_SILENT);
+        // The sound chips registers follow the replayed frame, its writes are neither heard nor logged
+        sms->snd.vgm = sms->fmsnd.vgm = NULL;
+        sms->vdp.present = 1;
+        from = sms->cycles;
+        sms_runframe(sms);
+        sms->snd.vgm = sms->fmsnd.vgm = sms->vgm;
+        vgmlog_rebase(sms->vgm, from); // the replayed frame takes no time in the log
+        sn76489_execute(&sms->snd);
+    }
+    sms->rewindcount = 0;
+
+    memcheck_end();
+
+    return 1;
 }
 
 void ms_pause(mastersystem *sms, int pause)
@@ -739,6 +1153,7 @@ void ms_pause(mastersystem *sms, int pause)
         if(sms->pause==1) {
             clock_pause(1);
             sn76489_pause(&sms->snd, 1);
+            sms->latency.pending = 0; // the pause is not input latency
         }
     } else {
         sms->pause -= 1;
@@ -754,6 +1169,134 @@ int ms_ispaused(mastersystem *sms)
     return (sms->pause>0);
 }
 
+// The audio master clock runs the synthesis at the nominal rate, the others adjust it to the audio buffer fill level
+void ms_setsync(mastersystem *sms, sync_mode sync)
+{
+    if((sync==SYNC_AUDIO) && (sms->snd.playsound==SND_OFF)) {
+        log4me_info(LOG_EMU_SMS, "no audio device, the timer paces the emulation\n");
+        sync = SYNC_TIMER;
+    }
+
+    sms->sync = sync;
+    sn76489_setratecontrol(&sms->snd, sync!=SYNC_AUDIO);
+}
+
+// Speed multiplier, 1 for real time. Fast-forward presents and plays one frame out of speed,
+// MS_UNTHROTTLED drops the frame pacing and keeps one frame per display period.
+void ms_setspeed(mastersystem *sms, int speed)
+{
+    sms->speed = speed<0 ? 1 : speed;
+    sms->speedcount = sms->skipcount = 0;
+    sms->lastframe = SDL_GetTicks();
+
+    if(sms->speed!=MS_UNTHROTTLED)
+        clock_setfrequency(sms->vdp.idclock, sms->vdp.framerate * sms->speed);
+}
+
+void ms_setframeskip(mastersystem *sms, int frameskip)
+{
+    sms->frameskip = frameskip<0 ? 0 : frameskip;
+    sms->skipcount = 0;
+}
+
+// Frames emulated ahead of the presented one, 0 to disable the run-ahead
+void ms_setrunahead(mastersystem *sms, int frames)
+{
+    if(frames<0) frames = 0;
+    if(frames>MS_MAX_RUNAHEAD) frames = MS_MAX_RUNAHEAD;
+
+    if((frames>0) && (sms->ahead==NULL)) {
+        if(((sms->ahead = calloc(1, sizeof(ms_state)))==NULL) ||
+           ((sms->mc93c46!=NULL) && ((sms->ahead->mc93c46 = seeprom_create())==NULL))) {
+            log4me_error(LOG_EMU_SMS, "Unable to allocate the memory block.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sms->runahead = frames;
+}
+
+// Measure the input to photon latency, the histogram is printed when the emulation ends
+void ms_setlatencyreport(mastersystem *sms, int enable)
+{
+    sms->latency.enabled = enable;
+    sms->latency.pending = 0;
+}
+
+// Keep a history of megabytes MB, a state every interval frames. 0 disables the rewind.
+void ms_setrewind(mastersystem *sms, int megabytes, int interval)
+{
+    rewind_release(sms->history);
+    sms->history = NULL;
+    sms->rewindinterval = interval>0 ? interval : 1;
+    sms->rewindcount = 0;
+
+    if(megabytes<=0) return;
+
+    if((sms->statebuffer==NULL) && ((sms->statebuffer = malloc(MS_STATE_SIZE))==NULL)) {
+        log4me_error(LOG_EMU_SMS, "Unable to allocate the memory block.\n");
+        exit(EXIT_FAILURE);
+    }
+    if((sms->history = rewind_create(megabytes << 20, MS_STATE_SIZE, REWIND_DEFAULT_KEYINTERVAL))==NULL) {
+        log4me_error(LOG_EMU_SMS, "Unable to allocate the memory block.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Start a new write sequence : the pages written from now on are dirty for the returned checkpoint
+qword ms_checkpoint(mastersystem *sms)
+{
+    return sms->writeseq++;
+}
+
+static int sms_countdirty(const qword *pages, int count, qword checkpoint)
+{
+    int i, dirty = 0;
+
+    for(i=0; i<count; i++)
+        if(pages[i]>checkpoint) dirty++;
+
+    return dirty;
+}
+
+// Pages of RAM, cartridge RAM and VRAM written since the checkpoint, returns their sum
+int ms_getdirtypages(mastersystem *sms, qword checkpoint, int *ram, int *cartridgeram, int *vram)
+{
+    *ram = sms_countdirty(sms->rampages, MS_DIRTY_PAGES(MS_MEM_SIZE), checkpoint);
+    *cartridgeram = sms_countdirty(sms->cartpages, MS_DIRTY_PAGES(MS_CARTRIDGE_RAM), checkpoint);
+    *vram = sms_countdirty(sms->vdp.vrampages, TMS_DIRTY_PAGES, checkpoint);
+
+    return *ram + *cartridgeram + *vram;
+}
+
+// Dirty pages of the frames of the last second
+void ms_getdirtystats(mastersystem *sms, ms_dirtystats *stats)
+{
+    *stats = sms->dirtyreadout;
+}
+
+// Every page is written : after a load, nothing is known of the memories
+static void sms_markdirty(mastersystem *sms)
+{
+    int i;
+
+    for(i=0; i<MS_DIRTY_PAGES(MS_MEM_SIZE); i++) sms->rampages[i] = sms->writeseq;
+    for(i=0; i<MS_DIRTY_PAGES(MS_CARTRIDGE_RAM); i++) sms->cartpages[i] = sms->writeseq;
+    for(i=0; i<TMS_DIRTY_PAGES; i++) sms->vdp.vrampages[i] = sms->writeseq;
+}
+
+// Once per second readout of the emulation speed, returns 0 when it is unchanged since the last call
+int ms_getspeed(mastersystem *sms, int *fps, int *realtime)
+{
+    int readout = sms->readout;
+
+    *fps = sms->fps;
+    *realtime = sms->realtime;
+    sms->readout = 0;
+
+    return readout;
+}
+
 #define SET_RES_PAD(value, port, flag) {\
     if((value)) port &= ~flag; else port |= flag; \
 }
@@ -762,22 +1305,32 @@ int ms_ispaused(mastersystem *sms)
     SET_RES_PAD(input_key_pressed(key), port, flag); \
 }
 
-static void sms_updatejoypads(mastersystem *sms)
+// Process the pending events of a type range in the order they were queued
+static void sms_processevents(Uint32 mintype, Uint32 maxtype)
 {
-    int nevents;
+    int i, nevents;
     SDL_Event events[10];
 
-    SDL_PumpEvents();
+    do {
+        nevents = SDL_PeepEvents(events, 10, SDL_GETEVENT, mintype, maxtype);
+        for(i=0; i<nevents; i++)
+            input_process_event(&events[i]);
+    } while(nevents==10);
+}
+
+// The joypads are latched when the game reads them, with the events queued up to the read
+static void sms_updatejoypads(mastersystem *sms)
+{
+    byte dc = sms->port_dc, dd = sms->port_dd, start = sms->ports[0];
+    Uint32 stamp;
 
-    // Keyboard
-    nevents = SDL_PeepEvents(events, 10, SDL_GETEVENT, SDL_KEYDOWN, SDL_KEYUP);
-    while(--nevents>=0)
-        input_process_event(&events[nevents]);
+    // The events queue is managed by SDL
+    memcheck_suspend();
+    SDL_PumpEvents();
+    memcheck_resume();
 
-    // Joysticks
-    nevents = SDL_PeepEvents(events, 10, SDL_GETEVENT, SDL_JOYAXISMOTION, SDL_JOYBUTTONUP);
-    while(--nevents>=0)
-        input_process_event(&events[nevents]);
+    sms_processevents(SDL_KEYDOWN, SDL_KEYUP); // Keyboard
+    sms_processevents(SDL_JOYAXISMOTION, SDL_JOYBUTTONUP); // Joysticks
 
     // Joypad 1
     SET_RES_PAD(input_button_pressed(sms->player1, BTN_UP   ), sms->port_dc, JOYPAD1_DC_UP);
@@ -807,6 +1360,15 @@ static void sms_updatejoypads(mastersystem *sms)
             log4me_print("Software reset\n");
         KEY_PAD(SDL_SCANCODE_R, sms->port_dd, JOYPAD2_DD_RESET);
     }
+
+    // Input latency : the change is timed from its oldest event until the next frame presented
+    if(input_takeeventstamp(&stamp) && sms->latency.enabled && !sms->latency.pending) {
+        if((dc!=sms->port_dc) || (dd!=sms->port_dd) || (start!=sms->ports[0])) {
+            sms->latency.pending = 1;
+            sms->latency.stamp = stamp;
+            sms->latency.presents = video_getpresents(NULL);
+        }
+    }
 }
 
 static string sms_getbackupfilename(mastersystem *sms)
@@ -829,8 +1391,58 @@ static string sms_geteepromfilename(mastersystem *sms)
     return bkpfilename;
 }
 
-void sms_takesnapshot(mastersystem *sms, xmlTextWriterPtr writer)
+ms_snapshot *ms_createsnapshot(mastersystem *sms)
 {
+    ms_snapshot *snapshot = calloc(1, sizeof(ms_snapshot));
+
+    if((snapshot==NULL) || ((sms->mc93c46!=NULL) && ((snapshot->mc93c46 = seeprom_create())==NULL))) {
+        log4me_error(LOG_EMU_SMS, "Unable to allocate the memory block.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(sms->snd.playsound==SND_ON) {
+        snapshot->samplessize = rbspace(sms->snd.buffer) + rbavailable(sms->snd.buffer);
+        if((snapshot->samples = malloc(snapshot->samplessize))==NULL) {
+            log4me_error(LOG_EMU_SMS, "Unable to allocate the memory block.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return snapshot;
+}
+
+void ms_freesnapshot(ms_snapshot *snapshot)
+{
+    if(snapshot==NULL) return;
+
+    seeprom_free(snapshot->mc93c46);
+    if(snapshot->samples) free(snapshot->samples);
+    free(snapshot);
+}
+
+// Copy the machine between two frames : the synthesis thread is synced, then nothing of the copy
+// is shared with the running emulation but the ROM specifications and name
+void ms_copysnapshot(mastersystem *sms, ms_snapshot *snapshot)
+{
+    assert(sms->vdp.scanline==0);
+
+    sn76489_sync(&sms->snd);
+
+    snapshot->machine = *sms;
+    snapshot->z80 = *sms->z80;
+    snapshot->machine.z80 = &snapshot->z80;
+    if(sms->mc93c46) seeprom_copy(snapshot->mc93c46, sms->mc93c46);
+    snapshot->machine.mc93c46 = snapshot->mc93c46;
+    memcpy(snapshot->framebuffer, sms->vdp.buffer8, sizeof(snapshot->framebuffer));
+    snapshot->machine.vdp.buffer8 = snapshot->framebuffer;
+
+    snapshot->nsamples = snapshot->samples ? rbpeek(sms->snd.buffer, snapshot->samples, snapshot->samplessize) : 0;
+}
+
+// Write the copy, may run on any thread
+void ms_writesnapshot(ms_snapshot *snapshot, xmlTextWriterPtr writer)
+{
+    mastersystem *sms = &snapshot->machine;
     int i;
 
     xmlTextWriterStartElement(writer, BAD_CAST "machine");
@@ -929,7 +1541,8 @@ void sms_takesnapshot(mastersystem *sms, xmlTextWriterPtr writer)
         xmlTextWriterEndElement(writer); /* video */
 
         xmlTextWriterStartElement(writer, BAD_CAST "sound");
-            sn76489_takesnapshot(&sms->snd, writer);
+            sn76489_takesnapshot(&sms->snd, snapshot->samples, snapshot->nsamples, writer);
+            if(sms->fmunit) ym2413_takesnapshot(&sms->fmsnd, writer);
         xmlTextWriterEndElement(writer); /* sound */
 
     xmlTextWriterEndElement(writer); /* machine */
@@ -1020,6 +1633,315 @@ static void sms_loadsnapshot(mastersystem *sms, xmlDocPtr doc)
             XML_ELEMENT("sn76489", sound,
                 sn76489_loadsnapshot(&sms->snd, sound);
             )
+            XML_ELEMENT("ym2413", sound,
+                if(sms->fmunit) ym2413_loadsnapshot(&sms->fmsnd, sound);
+            )
         )
     )
+
+    sms_markdirty(sms);
+}
+
+#define MS_CHUNK_MACHINE    STATE_TAG('M','A','C','H')
+#define MS_CHUNK_MAPPER     STATE_TAG('M','A','P',' ')
+#define MS_CHUNK_PORTS      STATE_TAG('P','O','R','T')
+#define MS_CHUNK_RAM        STATE_TAG('R','A','M',' ')
+#define MS_CHUNK_CARTRAM    STATE_TAG('C','R','A','M')
+#define MS_CHUNK_EEPROM     STATE_TAG('E','E','P','R')
+#define MS_CHUNK_TIMING     STATE_TAG('T','I','M','E')
+#define MS_CHUNK_Z80        STATE_TAG('Z','8','0',' ')
+#define MS_CHUNK_VDP        STATE_TAG('V','D','P',' ')
+#define MS_CHUNK_PSG        STATE_TAG('P','S','G',' ')
+#define MS_CHUNK_FM         STATE_TAG('F','M',' ',' ')
+#define MS_CHUNK_VERSION    1 // all the chunks of the machine
+
+// Binary state of the machine between two frames, written into a buffer of MS_STATE_SIZE bytes at most.
+// Returns the size of the state, 0 when the buffer is too small.
+int ms_savestate(mastersystem *sms, byte *buffer, int size)
+{
+    const char *digest = CSTR(getromdigest(sms->rspecs));
+    statewriter w;
+    int i;
+
+    assert(sms->vdp.scanline==0);
+
+    state_writebegin(&w, buffer, size);
+
+    // The machine chunk comes first : the state is only loaded for the same console and ROM
+    state_beginchunk(&w, MS_CHUNK_MACHINE, MS_CHUNK_VERSION);
+        state_write8(&w, (byte)sms->gconsole);
+        state_write8(&w, (byte)strlen(digest));
+        state_write(&w, digest, strlen(digest));
+    state_endchunk(&w);
+
+    state_beginchunk(&w, MS_CHUNK_MAPPER, MS_CHUNK_VERSION);
+        state_write(&w, sms->mregisters, MS_REGISTERS);
+        state_write8(&w, sms->cmregister);
+    state_endchunk(&w);
+
+    state_beginchunk(&w, MS_CHUNK_PORTS, MS_CHUNK_VERSION);
+        state_write(&w, sms->ports, MS_GG_NUM_PORTS);
+        state_write8(&w, sms->port_3e);
+        state_write8(&w, sms->port_3f);
+        state_write8(&w, sms->port_dc);
+        state_write8(&w, sms->port_dd);
+        state_write8(&w, sms->port_f2);
+    state_endchunk(&w);
+
+    state_beginchunk(&w, MS_CHUNK_RAM, MS_CHUNK_VERSION);
+        state_write(&w, sms->mem, MS_MEM_SIZE);
+    state_endchunk(&w);
+
+    if(sms->cartridgeram_detected) {
+        state_beginchunk(&w, MS_CHUNK_CARTRAM, MS_CHUNK_VERSION);
+            state_write(&w, sms->cartridgeram, MS_CARTRIDGE_RAM);
+        state_endchunk(&w);
+    }
+
+    if(sms->mc93c46) {
+        state_beginchunk(&w, MS_CHUNK_EEPROM, MS_CHUNK_VERSION);
+            seeprom_savestate(sms->mc93c46, &w);
+        state_endchunk(&w);
+    }
+
+    state_beginchunk(&w, MS_CHUNK_TIMING, MS_CHUNK_VERSION);
+        state_write64(&w, sms->cycles);
+        state_write32(&w, (dword)sms->cpu);
+        state_write32(&w, (dword)sms->curscanlineps);
+        state_write64(&w, sms->lineend);
+        state_write8(&w, (byte)sms->events.count);
+        for(i=0; i<sms->events.count; i++) {
+            state_write8(&w, (byte)sms->events.heap[i].type);
+            state_write64(&w, sms->events.heap[i].cycle);
+        }
+    state_endchunk(&w);
+
+    state_beginchunk(&w, MS_CHUNK_Z80, MS_CHUNK_VERSION);
+        cpuZ80_savestate(sms->z80, &w);
+    state_endchunk(&w);
+
+    state_beginchunk(&w, MS_CHUNK_VDP, MS_CHUNK_VERSION);
+        tms9918a_savestate(&sms->vdp, &w);
+    state_endchunk(&w);
+
+    // The FM registers are written again after the PSG ones, they share its timeline
+    state_beginchunk(&w, MS_CHUNK_PSG, MS_CHUNK_VERSION);
+        sn76489_savestate(&sms->snd, &w);
+    state_endchunk(&w);
+
+    if(sms->fmunit) {
+        state_beginchunk(&w, MS_CHUNK_FM, MS_CHUNK_VERSION);
+            ym2413_savestate(&sms->fmsnd, &w);
+        state_endchunk(&w);
+    }
+
+    return state_writeend(&w);
+}
+
+// The current line and the events must belong to the video timing of this machine
+static int sms_checktiming(mastersystem *sms, statereader *r)
+{
+    qword cycles, lineend;
+    dword line;
+    int i, n;
+
+    cycles = state_read64(r);
+    state_skip(r, 4); // CPU tstates of the current second
+    line = state_read32(r);
+    lineend = state_read64(r);
+    if(line>=(dword)sms->scanlinespersecond) return 0;
+    if((lineend<cycles) || (lineend - cycles>(qword)sms->lkptsps[line])) return 0;
+
+    n = state_read8(r);
+    if(n>SCHED_EVENTS) return 0;
+    for(i=0; i<n; i++) {
+        if(state_read8(r)>=SCHED_EVENTS) return 0;
+        state_skip(r, 8);
+    }
+
+    return !r->error;
+}
+
+// The chunks written for every machine
+#define MS_HAS_MAPPER       0x01
+#define MS_HAS_PORTS        0x02
+#define MS_HAS_RAM          0x04
+#define MS_HAS_TIMING       0x08
+#define MS_HAS_Z80          0x10
+#define MS_HAS_VDP          0x20
+#define MS_HAS_PSG          0x40
+#define MS_CHUNKS_REQUIRED  0x7F
+
+// The whole state is checked before anything is loaded : each known chunk is read to its exact end
+static int sms_checkstate(mastersystem *sms, const byte *buffer, int size)
+{
+    const char *digest = CSTR(getromdigest(sms->rspecs));
+    char loaded[64];
+    statereader r;
+    dword tag;
+    int version, len, chunks = 0, found = 0, ok;
+
+    if(!state_readbegin(&r, buffer, size)) return 0;
+
+    while(state_nextchunk(&r, &tag, &version)) {
+        if(version>MS_CHUNK_VERSION) return 0;
+        if(chunks++==0) {
+            if((tag!=MS_CHUNK_MACHINE) || (state_read8(&r)!=sms->gconsole)) return 0;
+            len = state_read8(&r);
+            if(len>=(int)sizeof(loaded)) return 0;
+            state_read(&r, loaded, len);
+            loaded[len] = 0;
+            if(strcasecmp(loaded, digest)!=0) return 0;
+            continue;
+        }
+
+        switch(tag) {
+            case MS_CHUNK_MAPPER:
+                state_skip(&r, MS_REGISTERS + 1);
+                ok = 1;
+                found |= MS_HAS_MAPPER;
+                break;
+            case MS_CHUNK_PORTS:
+                state_skip(&r, MS_GG_NUM_PORTS + 5);
+                ok = 1;
+                found |= MS_HAS_PORTS;
+                break;
+            case MS_CHUNK_RAM:
+                state_skip(&r, MS_MEM_SIZE);
+                ok = 1;
+                found |= MS_HAS_RAM;
+                break;
+            case MS_CHUNK_CARTRAM:
+                state_skip(&r, MS_CARTRIDGE_RAM);
+                ok = 1;
+                break;
+            case MS_CHUNK_EEPROM:
+                ok = seeprom_checkstate(&r);
+                break;
+            case MS_CHUNK_TIMING:
+                ok = sms_checktiming(sms, &r);
+                found |= MS_HAS_TIMING;
+                break;
+            case MS_CHUNK_Z80:
+                ok = cpuZ80_checkstate(&r);
+                found |= MS_HAS_Z80;
+                break;
+            case MS_CHUNK_VDP:
+                ok = tms9918a_checkstate(&sms->vdp, &r);
+                found |= MS_HAS_VDP;
+                break;
+            case MS_CHUNK_PSG:
+                ok = sn76489_checkstate(&r);
+                found |= MS_HAS_PSG;
+                break;
+            case MS_CHUNK_FM:
+                ok = ym2413_checkstate(&r);
+                break;
+            default:
+                continue; // unknown chunks are skipped
+        }
+        if(!ok || !state_chunkend(&r)) return 0;
+    }
+
+    return (found==MS_CHUNKS_REQUIRED) && !r.error;
+}
+
+// Returns 0 when the state is not a state of this console and ROM, the machine is unchanged
+int ms_loadstate(mastersystem *sms, const byte *buffer, int size)
+{
+    statereader r;
+    dword tag;
+    int i, n, type, version;
+    byte mregisters[MS_REGISTERS], cmregister;
+    qword cycle, from;
+
+    assert(sms->vdp.scanline==0);
+
+    if(!sms_checkstate(sms, buffer, size)) {
+        log4me_error(LOG_EMU_SMS, "The state does not belong to this game.\n");
+        return 0;
+    }
+
+    state_readbegin(&r, buffer, size);
+    while(state_nextchunk(&r, &tag, &version)) {
+        switch(tag) {
+            case MS_CHUNK_MAPPER:
+                state_read(&r, mregisters, MS_REGISTERS);
+                cmregister = state_read8(&r);
+                switch(getrommemorymapper(sms->rspecs)) {
+                    case MM_SEGA:
+                    case MM_SEGA_EEPROM:
+                        for(i=0;i<MS_REGISTERS;i++)
+                            ms_writemregister(sms, i, mregisters[i]);
+                        break;
+                    case MM_CODEMASTERS:
+                        sms_writememorycodemasters(sms, 0x8000, cmregister);
+                        break;
+                    default:
+                        break;
+                }
+                break;
+
+            case MS_CHUNK_PORTS:
+                state_read(&r, sms->ports, MS_GG_NUM_PORTS);
+                sms->port_3e = state_read8(&r);
+                sms->port_3f = state_read8(&r);
+                sms->port_dc = state_read8(&r);
+                sms->port_dd = state_read8(&r);
+                sms->port_f2 = state_read8(&r);
+                break;
+
+            case MS_CHUNK_RAM:
+                state_read(&r, sms->mem, MS_MEM_SIZE);
+                break;
+
+            case MS_CHUNK_CARTRAM:
+                state_read(&r, sms->cartridgeram, MS_CARTRIDGE_RAM);
+                sms->cartridgeram_detected = 1;
+                break;
+
+            case MS_CHUNK_EEPROM:
+                if(sms->mc93c46) seeprom_loadstate(sms->mc93c46, &r);
+                break;
+
+            case MS_CHUNK_TIMING:
+                from = sms->cycles;
+                sms->cycles = state_read64(&r);
+                vgmlog_rebase(sms->vgm, from);
+                sms->cpu = (int)state_read32(&r);
+                sms->curscanlineps = (int)state_read32(&r);
+                sms->lineend = state_read64(&r);
+                scheduler_init(&sms->events);
+                n = state_read8(&r);
+                for(i=0; i<n; i++) {
+                    type = state_read8(&r);
+                    cycle = state_read64(&r);
+                    if(type<SCHED_EVENTS) scheduler_add(&sms->events, type, cycle);
+                }
+                break;
+
+            case MS_CHUNK_Z80:
+                cpuZ80_loadstate(sms->z80, &r);
+                break;
+
+            case MS_CHUNK_VDP:
+                tms9918a_loadstate(&sms->vdp, &r);
+                break;
+
+            case MS_CHUNK_PSG:
+                sn76489_loadstate(&sms->snd, &r);
+                break;
+
+            case MS_CHUNK_FM:
+                if(sms->fmunit) ym2413_loadstate(&sms->fmsnd, &r);
+                break;
+        }
+    }
+
+    sms_markdirty(sms);
+
+    // Unreachable once the state is checked, the machine would be partly loaded
+    assert(!r.error);
+
+    return !r.error;
 }
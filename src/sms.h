@@ -10,7 +10,9 @@
 #include "ym2413.h"
 
 #include "input.h"
+#include "rewind.h"
 #include "rom.h"
+#include "scheduler.h"
 #include "misc/string.h"
 
 #define MS_MEM_SIZE         0x2000    /*  8K */
@@ -28,9 +30,74 @@
 
 #define MS_GG_NUM_PORTS     6
 
+#define MS_UNTHROTTLED      0         /* speed : no frame pacing */
+#define MS_DEFAULT_TURBO    4
+#define MS_MAX_RUNAHEAD     4         /* frames */
+#define MS_LATENCY_BUCKETS  32
+#define MS_LATENCY_BUCKET   4         /* ms */
+#define MS_DIRTY_SHIFT      8         /* write tracking pages of 256 bytes */
+#define MS_DIRTY_PAGES(size) ((size) >> MS_DIRTY_SHIFT)
+#define MS_STATE_SIZE       (MS_MEM_SIZE + MS_CARTRIDGE_RAM + TMS_VRAM_SIZE + 1024) /* binary state upper bound */
+
 struct _iomap;
 typedef struct _iomap iomap;
 
+// Machine state captured in memory before running ahead, the sound chips are not
+// part of it : their writes are dropped while running ahead
+typedef struct {
+    cpuZ80 z80;
+    tms9918a vdp;
+    seeprom *mc93c46;
+
+    byte *rdmap[8];
+    byte *wrmap[8];
+    qword *wrpages[8];
+    byte mem[MS_MEM_SIZE];
+    byte mregisters[MS_REGISTERS];
+    byte cmregister;
+    byte cartridgeram[MS_CARTRIDGE_RAM];
+    int cartridgeram_detected;
+
+    // Only the pages written since the checkpoint of the previous capture are copied
+    qword checkpoint;
+    qword rampages[MS_DIRTY_PAGES(MS_MEM_SIZE)];
+    qword cartpages[MS_DIRTY_PAGES(MS_CARTRIDGE_RAM)];
+
+    byte ports[MS_GG_NUM_PORTS];
+    byte port_3e, port_3f, port_dc, port_dd, port_f2;
+
+    int cpu;
+    qword cycles;
+    int curscanlineps;
+    qword lineend;
+    scheduler events;
+} ms_state;
+
+// Input to photon latency : SDL timestamp of the input event to the present of the first frame emulated with it
+typedef struct {
+    int enabled;
+    int pending; // a joypad change is latched, waiting for the next present
+    Uint32 stamp; // SDL timestamp of the oldest event of the change
+    int presents; // frames presented when the change was latched
+    int histogram[MS_LATENCY_BUCKETS]; // the last bucket counts the longer latencies
+    int samples;
+    Uint32 sum, max; // ms
+} ms_latency;
+
+// Pages written by the frames of the last second, to size the rewind history
+typedef struct {
+    int frames;
+    int ram, cartridgeram, vram; // pages written, summed over the frames
+    int peak; // most pages written by a frame
+} ms_dirtystats;
+
+// Scheduled events, delivered in this order when they are due at the same tstate
+typedef enum {
+    MS_EVENT_NMI,   // pause button (Master System)
+    MS_EVENT_LINE,  // end of a scanline : VDP line counter, line interrupt, vblank
+    MS_EVENT_FRAME  // end of the frame
+} ms_event;
+
 typedef struct _mastersystem {
     cpuZ80 *z80;
 
@@ -42,6 +109,8 @@ typedef struct _mastersystem {
     byte cmregister;
     byte cartridgeram[MS_CARTRIDGE_RAM]; // On-board cartridge RAM
     iomap *iomapper;
+    iomap *iosound; // I/O map with the sound chips
+    iomap *iosilent; // I/O map without the sound chips, while running ahead
 
     byte *rom;
     string romname;
@@ -56,40 +125,107 @@ typedef struct _mastersystem {
     byte port_3f; // automatic nationalisation
     byte port_dc; // joypad port 1
     byte port_dd; // joypad port 2
-    byte port_f2; // detect ym2413
+    byte port_f2; // detect ym2413, audio control when the FM sound unit is present
 
     int cartridgeram_detected;
 
+    // Dirty pages : each page keeps the write sequence of its last write, the pages written
+    // after a checkpoint have a greater sequence than the checkpoint
+    qword writeseq;
+    qword *wrpages[8]; // write sequences of the pages mapped by wrmap
+    qword rampages[MS_DIRTY_PAGES(MS_MEM_SIZE)];
+    qword cartpages[MS_DIRTY_PAGES(MS_CARTRIDGE_RAM)];
+    qword nullpages[MS_DIRTY_PAGES(8192)];
+    ms_dirtystats dirty, dirtyreadout;
+
     tms9918a vdp;
     sn76489 snd;
     ym2413  fmsnd;
+    int fmunit; // YM2413 FM sound unit, japanese Master System only
+    vgmlog  vgm; // sound chips register writes log, NULL when disabled
 
     int clock;
     int cpu;
+    qword cycles; // tstates executed since power on, timestamps the PSG writes
 
     int *lkptsps; // Lookup table tstates per scanline for 1 second
     int scanlinespersecond;
     int curscanlineps;
-    int tstates;
+    qword lineend; // tstate at the end of the current scanline
+    scheduler events;
 
     const iprofile *player1;
     const iprofile *player2;
 
     int pause;
 
+    // Emulation speed
+    sync_mode sync; // master clock of the frame pacing
+    int speed; // frames emulated per real time frame, MS_UNTHROTTLED to run as fast as possible
+    int frameskip; // real time frames skipped after each presented frame
+    int speedcount, skipcount;
+    Uint32 lastframe; // SDL ticks of the last real time frame when unthrottled
+    int fps, realtime; // speed readout : emulated frames per second and percentage of real time
+    int readout; // speed readout updated
+
+    // Run-ahead : the frame presented is emulated this number of frames ahead, then the state is restored
+    int runahead;
+    ms_state *ahead;
+    Uint64 aheadsave, aheadrun, aheadload; // performance counter ticks of the last second
+    int aheadframes;
+    Uint64 aheadticks; // performance counter ticks since power on, reported on exit
+    int aheadtotal;
+
+    ms_latency latency;
+
+    // Rewind : a state is captured every rewindinterval frames
+    rewindring *history;
+    byte *statebuffer;
+    int rewindinterval, rewindcount;
+    Uint64 rewindticks; // performance counter ticks of the last second
+    int rewindcaptures;
+
     string backupdir;
     sdlclock idclock1s;
 
 } mastersystem;
 
+// Copy of the machine taken between two frames, written to a snapshot by another thread
+typedef struct {
+    mastersystem machine; // the chips referenced by a pointer are replaced by the copies below
+    cpuZ80 z80;
+    seeprom *mc93c46;
+    byte framebuffer[TMS_BUFFER_WIDTH*TMS_BUFFER_HEIGHT];
+    byte *samples; // audio buffered for the device, NULL when the sound is off
+    int samplessize, nsamples; // bytes
+} ms_snapshot;
+
 
+void ms_setvgmlog(const char *filename);
 mastersystem* ms_init(const display *screen, const romspecs *rspecs, sound_onoff playsound, const iprofile *player1, const iprofile *player2, string backupdir);
 
 void ms_start(mastersystem *sms);
 void ms_execute(mastersystem *sms);
 void ms_pause(mastersystem *sms, int pause);
 int ms_ispaused(mastersystem *sms);
-
-void sms_takesnapshot(mastersystem *sms, xmlTextWriterPtr writer);
+void ms_setsync(mastersystem *sms, sync_mode sync);
+void ms_setspeed(mastersystem *sms, int speed);
+void ms_setframeskip(mastersystem *sms, int frameskip);
+void ms_setrunahead(mastersystem *sms, int frames);
+void ms_setlatencyreport(mastersystem *sms, int enable);
+void ms_setrewind(mastersystem *sms, int megabytes, int interval);
+int ms_rewind(mastersystem *sms);
+int ms_getspeed(mastersystem *sms, int *fps, int *realtime);
+qword ms_checkpoint(mastersystem *sms);
+int ms_getdirtypages(mastersystem *sms, qword checkpoint, int *ram, int *cartridgeram, int *vram);
+void ms_getdirtystats(mastersystem *sms, ms_dirtystats *stats);
+
+ms_snapshot *ms_createsnapshot(mastersystem *sms);
+void ms_freesnapshot(ms_snapshot *snapshot);
+void ms_copysnapshot(mastersystem *sms, ms_snapshot *snapshot);
+void ms_writesnapshot(ms_snapshot *snapshot, xmlTextWriterPtr writer);
+
+int ms_savestate(mastersystem *sms, byte *buffer, int size);
+int ms_loadstate(mastersystem *sms, const byte *buffer, int size);
 
 #endif // SMS_H_INCLUDED
@@ -25,8 +25,12 @@ SN76489 implementation based on :
 */
 
 #include <SDL.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "sn76489.h"
+#include "ym2413.h"
 #include "misc/log4me.h"
 
 #define SN7_CMD_MASK    0x90
@@ -34,6 +38,14 @@ SN76489 implementation based on :
 #define SN7_FREQ_CMD    0x80
 
 int _volume = 256;
+psg_synthesis _synthesis = PSG_POINT;
+int _latency = SN7_DEFAULT_LATENCY;
+int _samplerate = SND_DEFAULT_FREQUENCY;
+int _buffersamples = SDL_SAMPLES;
+const char *_exportfilename = NULL;
+
+static int sn76489_worker(void *data);
+static void sn76489_logwrite(sn76489 *snd, sn76489_log_type type, byte reg, byte data);
 
 short volume_table[16]={
    32767/4, 26028/4, 20675/4, 16422/4, 13045/4, 10362/4,  8231/4,  6568/4,
@@ -48,29 +60,83 @@ void audio_setvolume(int volume)
     _volume = (volume * 256) / 100;
 }
 
+void audio_setsynthesis(psg_synthesis synthesis)
+{
+    _synthesis = synthesis;
+}
+
+void audio_setlatency(int latency)
+{
+    if(latency<10) latency = 10;
+    if(latency>200) latency = 200;
+
+    _latency = latency;
+}
+
+void audio_setsamplerate(int samplerate)
+{
+    if(samplerate<8000) samplerate = 8000;
+    if(samplerate>192000) samplerate = 192000;
+
+    _samplerate = samplerate;
+}
+
+// The audio device buffer size is a power of two
+void audio_setbuffer(int samples)
+{
+    int pow2 = 64;
+
+    while((pow2<samples) && (pow2<8192)) pow2 <<= 1;
+    _buffersamples = pow2;
+}
+
+// Export the PSG output to a WAV (or raw PCM) file, the synthesis then runs even without audio device
+void audio_setexport(const char *filename)
+{
+    _exportfilename = filename;
+}
+
+// Start the synthesis thread once the output path is ready
+static void sn76489_startworker(sn76489 *snd)
+{
+    if(((snd->queue = rbcreate(SN7_QUEUE_WRITES * sizeof(sn76489_write_log)))==NULL) ||
+       ((snd->wakeup = SDL_CreateSemaphore(0))==NULL) ||
+       ((snd->synced = SDL_CreateSemaphore(0))==NULL) ||
+       ((snd->worker = SDL_CreateThread(sn76489_worker, "sn76489", snd))==NULL)) {
+        log4me_error(LOG_EMU_SN76489, "Unable to start the synthesis thread : %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void sn76489_stopworker(sn76489 *snd)
+{
+    if(snd->worker==NULL) return;
+
+    sn76489_logwrite(snd, SN7_LOG_QUIT, 0, 0);
+    SDL_WaitThread(snd->worker, NULL);
+    SDL_DestroySemaphore(snd->wakeup);
+    SDL_DestroySemaphore(snd->synced);
+    rbdelete(snd->queue);
+    snd->worker = NULL;
+}
+
 static void sn76489_SDLmixaudio(void *userdata, Uint8 *stream, int len)
 {
     sn76489 *snd = userdata;
-    Uint8 *buffer = (Uint8*)snd->buffer;
-    int buflen = (snd->curpos << 1);
+    int buflen = rbread(snd->buffer, stream, len);
 
     if(len>buflen) {
-        memset(stream, 0, len);
-		memcpy(stream+(len-buflen), buffer, buflen);
-		snd->curpos = 0;
+        memset(stream+buflen, 0, len-buflen);
         log4me_warning(LOG_EMU_SN76489, "not enough data (%d/%d)\n", buflen, len);
-        return;
     }
 
-    memcpy(stream, buffer, len);
-    memmove(buffer, buffer+len, buflen-len);
-    snd->curpos -= (len >> 1);
+    SDL_SemPost(snd->consumed);
 }
 
-void sn76489_init(sn76489 *snd, int clock, int scanlinespersecond, soundchannel channels, sound_onoff playsound)
+void sn76489_init(sn76489 *snd, int clock, const qword *cycles, soundchannel channels, sound_onoff playsound)
 {
     SDL_AudioSpec fmt, fmthave;
-    int i;
+    int i, size;
 
 	snd->dev = 0;
 	snd->channels = channels;
@@ -86,6 +152,10 @@ void sn76489_init(sn76489 *snd, int clock, int scanlinespersecond, soundchannel
     snd->freqch3_from_ch2 = 0;
     snd->distribution = 0xFF;
 
+    for(i=0;i<8;i++) snd->shadowregs[i] = (i & 1) ? 0xF : 0;
+    snd->shadowlatch = 0;
+    snd->shadowstereo = 0xFF;
+
     snd->playsound = playsound;
 
     // => http://www.smspower.org/Development/SN76489 / How the SN76489 makes sound
@@ -97,25 +167,73 @@ void sn76489_init(sn76489 *snd, int clock, int scanlinespersecond, soundchannel
 
     snd->samplerate = 0;
 
-    memset(snd->compute, 0, sizeof(snd->compute));
+    memset(snd->counter, 0, sizeof(snd->counter));
     memset(snd->polarity, 0, sizeof(snd->polarity));
 
-    memset(snd->buffer, 0, sizeof(snd->buffer));
-    snd->curpos = 0;
-
-    /* Set 16-bit mono audio at 22Khz */
+    snd->buffer = NULL;
+    snd->outputrate = SND_FREQUENCY;
+    snd->devicesamples = 0;
+    snd->resampler = NULL;
+    snd->resampled = NULL;
+    snd->exportfile = NULL;
+    snd->exportresampler = NULL;
+    snd->exported = NULL;
+    snd->output = SN7_FRAME_AUDIBLE;
+    snd->vgm = NULL;
+    snd->fm = NULL;
+
+    snd->cycles = cycles;
+    snd->nsamples = 0;
+    snd->queue = NULL;
+    snd->worker = NULL;
+    snd->wakeup = snd->synced = NULL;
+    snd->samplepos = snd->samplecycle = snd->samplefrac = 0;
+
+    snd->rate = SND_FREQUENCY * 1000;
+    snd->rateppm = 0;
+    snd->drift = 0;
+    snd->ratecontrol = 1;
+    snd->consumed = NULL;
+
+    snd->synthesis = (playsound==SND_ON) || (_exportfilename!=NULL) ? _synthesis : PSG_POINT;
+    snd->bleps[0] = snd->bleps[1] = NULL;
+    snd->blepstart = 0;
+    memset(snd->nextedge, 0, sizeof(snd->nextedge));
+    memset(snd->amplitude, 0, sizeof(snd->amplitude));
+
+    /* Set 16-bit audio at the requested rate */
 	memset(&fmt, 0, sizeof(SDL_AudioSpec));
-    fmt.freq = SND_FREQUENCY;
+    fmt.freq = _samplerate;
     fmt.format = AUDIO_S16;
     fmt.channels = channels;
-    fmt.samples = SDL_SAMPLES;
+    fmt.samples = _buffersamples;
     fmt.callback = sn76489_SDLmixaudio;
     fmt.userdata = snd;
 
-    snd->scanlinespersecond = scanlinespersecond;
-    snd->scanlines = 0;
+    if(_exportfilename!=NULL) {
+        if((snd->exportfile = wavfile_open(_exportfilename, SND_FREQUENCY, channels))==NULL) {
+            log4me_error(LOG_EMU_SN76489, "Unable to create the audio export file %s.\n", _exportfilename);
+            exit(EXIT_FAILURE);
+        }
+        log4me_info(LOG_EMU_SN76489, "audio export to %s (%d Hz)\n", _exportfilename, SND_FREQUENCY);
+    }
 
-    if(snd->playsound==SND_OFF) return;
+    if(snd->synthesis==PSG_BLEP) {
+        // The transitions are placed at the CPU clock resolution (PSG clock * 16)
+        for(i=0;i<channels;i++) {
+            if((snd->bleps[i] = blep_new(clock, SND_FREQUENCY, SN7_BLEP_CAPACITY))==NULL) {
+                log4me_error(LOG_EMU_SN76489, "Unable to allocate the memory block.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        log4me_info(LOG_EMU_SN76489, "band-limited synthesis enabled\n");
+    }
+
+    if(snd->playsound==SND_OFF) {
+        snd->latency = snd->fill = 0;
+        if(snd->exportfile!=NULL) sn76489_startworker(snd);
+        return;
+    }
 
 	/*for (i = 0; i < SDL_GetNumAudioDrivers(); ++i) {
 		log4me_info("Audio driver %d: %s\n", i, SDL_GetAudioDriver(i));
@@ -125,7 +243,8 @@ void sn76489_init(sn76489 *snd, int clock, int scanlinespersecond, soundchannel
 		log4me_info("Audio device %d: %s\n", i, SDL_GetAudioDeviceName(i, 0));
 	}*/
 
-	if((snd->dev=SDL_OpenAudioDevice(NULL, 0, &fmt, &fmthave, SDL_AUDIO_ALLOW_ANY_CHANGE))==0) {
+    // Only the rate may differ, SDL converts the format and the channels
+	if((snd->dev=SDL_OpenAudioDevice(NULL, 0, &fmt, &fmthave, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE))==0) {
         log4me_error(LOG_EMU_SN76489, "Unable to open audio: %s\n", SDL_GetError());
         exit(EXIT_FAILURE);
     }
@@ -133,22 +252,68 @@ void sn76489_init(sn76489 *snd, int clock, int scanlinespersecond, soundchannel
 	if(fmthave.samples>fmt.samples)
         log4me_info(LOG_EMU_SN76489, "WARNING !! Possible latency detected.\n");
 
-    snd->lkpspps = malloc(sizeof(int)*snd->scanlinespersecond);
-    for(i=0;i<snd->scanlinespersecond;i++)
-        snd->lkpspps[i] = (((uint64_t)SND_FREQUENCY*(i+1)) / snd->scanlinespersecond) - (((uint64_t)SND_FREQUENCY*i) / snd->scanlinespersecond);
+    snd->outputrate = fmthave.freq;
+    snd->devicesamples = fmthave.samples;
+    snd->latency = (snd->outputrate * _latency) / 1000;
+    snd->fill = snd->latency << 4;
+
+    if(snd->outputrate!=SND_FREQUENCY) {
+        if((snd->resampler = resampler_new(SND_FREQUENCY, snd->outputrate, channels, SN7_CHUNK_SAMPLES))==NULL ||
+           (snd->resampled = malloc(resampler_maxoutput(snd->resampler, SN7_CHUNK_SAMPLES) * channels * sizeof(short)))==NULL) {
+            log4me_error(LOG_EMU_SN76489, "Unable to allocate the memory block.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    log4me_info(LOG_EMU_SN76489, "audio device : %d Hz, %d samples buffer\n", snd->outputrate, snd->devicesamples);
+
+    // The rate control moves the synthesis rate, the export stays at the rate of its header
+    if(snd->exportfile!=NULL) {
+        if((snd->exportresampler = resampler_new(SND_FREQUENCY, SND_FREQUENCY, channels, SN7_CHUNK_SAMPLES))==NULL ||
+           (snd->exported = malloc(resampler_maxoutput(snd->exportresampler, SN7_CHUNK_SAMPLES) * channels * sizeof(short)))==NULL) {
+            log4me_error(LOG_EMU_SN76489, "Unable to allocate the memory block.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Room for twice the latency target, the audio device buffer and a frame at 50 Hz
+    size = (2 * snd->latency + 2 * snd->devicesamples + snd->outputrate / 50) * channels * sizeof(short);
+    if((snd->buffer = rbcreate(size))==NULL) {
+        log4me_error(LOG_EMU_SN76489, "Unable to allocate the memory block.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if((snd->consumed = SDL_CreateSemaphore(0))==NULL) {
+        log4me_error(LOG_EMU_SN76489, "Unable to create the semaphore : %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+
+    sn76489_startworker(snd);
 }
 
 
 void sn76489_free(sn76489 *snd)
 {
+    sn76489_stopworker(snd);
+    if(!wavfile_close(snd->exportfile))
+        log4me_error(LOG_EMU_SN76489, "Unable to write the audio export file %s.\n", _exportfilename);
+    blep_release(snd->bleps[0]);
+    blep_release(snd->bleps[1]);
+
     if(snd->playsound==SND_OFF) return;
 
-    free(snd->lkpspps);
     SDL_PauseAudioDevice(snd->dev, 1);
     SDL_CloseAudioDevice(snd->dev);
+    if(rboverruns(snd->buffer) || rbunderruns(snd->buffer))
+        log4me_info(LOG_EMU_SN76489, "audio buffer : %d overrun(s), %d underrun(s), %d ms latency (target %d ms)\n", rboverruns(snd->buffer), rbunderruns(snd->buffer), sn76489_getlatency(snd), (snd->latency * 1000) / snd->outputrate);
+    rbdelete(snd->buffer);
+    SDL_DestroySemaphore(snd->consumed);
+    resampler_release(snd->resampler);
+    free(snd->resampled);
+    resampler_release(snd->exportresampler);
+    free(snd->exported);
 }
 
-void sn76489_write(sn76489 *snd, byte port, byte data)
+static void sn76489_applywrite(sn76489 *snd, byte data)
 {
     int channel;
 
@@ -221,17 +386,108 @@ void sn76489_write(sn76489 *snd, byte port, byte data)
     }
 }
 
-void sn76489_writestereo(sn76489 *snd, byte port, byte data)
+// Same decoding as sn76489_applywrite, on the emulation thread
+static void sn76489_shadowwrite(sn76489 *snd, byte data)
+{
+    int reg;
+
+    if(bit7_is_set(data)) snd->shadowlatch = (data >> 4) & 0x07;
+    reg = snd->shadowlatch;
+
+    if((reg & 1) || (reg==6)) // volume or noise
+        snd->shadowregs[reg] = data & 0x0F;
+    else
+    if(bit7_is_set(data))
+        snd->shadowregs[reg] = (snd->shadowregs[reg] & 0x3F0) | (data & 0x0F);
+    else
+        snd->shadowregs[reg] = ((data & 0x3F) << 4) | (snd->shadowregs[reg] & 0x0F);
+}
+
+static void sn76489_applywritestereo(sn76489 *snd, byte data)
 {
     log4me_debug(LOG_EMU_SN76489, "set control the stereo output %02X\n", data);
     snd->distribution = data;
 }
 
-void sn76489_pause(sn76489 *snd, int value)
+// Advance the sample clock to a CPU tstates timestamp and return its sample position
+static qword sn76489_sampleat(sn76489 *snd, qword cycle)
 {
-    if(snd->playsound==SND_OFF) return;
+    qword clock = (qword)snd->cpuclock * 1000; // the rate is in mHz
 
-    SDL_PauseAudioDevice(snd->dev, value);
+    snd->samplefrac += (cycle - snd->samplecycle) * snd->rate;
+    snd->samplecycle = cycle;
+    snd->samplepos += snd->samplefrac / clock;
+    snd->samplefrac %= clock;
+
+    return snd->samplepos;
+}
+
+// Synthesis rate in mHz, the export is converted back to the nominal rate
+static void sn76489_setrate(sn76489 *snd, int rate)
+{
+    int c;
+
+    snd->rate = rate;
+    if(snd->synthesis==PSG_BLEP)
+        for(c=0; c<snd->channels; c++)
+            blep_setrate(snd->bleps[c], (qword)snd->cpuclock * 1000, snd->rate);
+    if(snd->exportresampler!=NULL)
+        resampler_setrate(snd->exportresampler, snd->rate, SND_FREQUENCY * 1000);
+}
+
+// Dynamic rate control : the output rate is adjusted by up to SN7_MAX_RATE_PPM so the audio buffer stays at the target fill level.
+// Called once per frame, the fill level is smoothed to ignore the audio callback reads granularity.
+static void sn76489_ratecontrol(sn76489 *snd)
+{
+    int error, fill = rbavailable(snd->buffer) / (snd->channels * sizeof(short));
+
+    snd->fill += fill - (snd->fill >> 4);
+
+    // PI controller : the proportional part reacts to the fill error, the drift absorbs the clock mismatch with the audio device
+    error = (int)(((int64_t)(snd->latency << 4) - snd->fill) * SN7_MAX_RATE_PPM * 4 / (snd->latency << 4));
+    snd->drift += error;
+    if(snd->drift>(SN7_MAX_RATE_PPM<<8)) snd->drift = SN7_MAX_RATE_PPM<<8;
+    if(snd->drift<-(SN7_MAX_RATE_PPM<<8)) snd->drift = -(SN7_MAX_RATE_PPM<<8);
+
+    snd->rateppm = error + (snd->drift >> 8);
+    if(snd->rateppm>SN7_MAX_RATE_PPM) snd->rateppm = SN7_MAX_RATE_PPM;
+    if(snd->rateppm<-SN7_MAX_RATE_PPM) snd->rateppm = -SN7_MAX_RATE_PPM;
+
+    sn76489_setrate(snd, (int)(((int64_t)SND_FREQUENCY * (1000000 + snd->rateppm)) / 1000));
+}
+
+// Smoothed audio buffer fill level in ms
+int sn76489_getlatency(sn76489 *snd)
+{
+    return snd->playsound==SND_OFF ? 0 : ((snd->fill >> 4) * 1000) / snd->outputrate;
+}
+
+// Square wave generator : the counter is decremented by the elapsed PSG clocks, the output flips on each underflow
+static void sn76489_tone(sn76489 *snd, int ch, short *amp, int n)
+{
+    int k, counter = snd->counter[ch], polarity = snd->polarity[ch];
+    int period = snd->frequency[ch] << 16;
+    short volume = volume_table[snd->volume[ch]];
+
+    // => http://www.smspower.org/Development/SN76489 / How the SN76489 makes sound
+    // If the register value is zero or one then the output is a constant value of +1. This is often used for sample playback on the SN76489.
+    if(snd->frequency[ch]<=1) {
+        snd->polarity[ch] = 1;
+        for(k=0;k<n;k++) amp[k] = -volume;
+        return;
+    }
+
+    for(k=0;k<n;k++) {
+        counter -= snd->step;
+        while(counter<=0) {
+            counter += period;
+            polarity ^= 1;
+        }
+        amp[k] = polarity ? -volume : volume;
+    }
+
+    snd->counter[ch] = counter;
+    snd->polarity[ch] = polarity;
 }
 
 static byte parity(word val)
@@ -244,71 +500,430 @@ static byte parity(word val)
      return val & 1;
 }
 
-static void sn76489_internalmixaudio(sn76489 *snd)
+// Noise generator : the LFSR is shifted on each underflow of the channel 3 counter
+static void sn76489_noise(sn76489 *snd, short *amp, int n)
 {
-    int i, ch;
-    short sound = 0;
+    int k, counter = snd->counter[3];
+    int period = (snd->frequency[3] ? snd->frequency[3] : 1) << 16;
+    short volume = volume_table[snd->volume[3]];
+    word lfsr = snd->lfsr;
+
+    for(k=0;k<n;k++) {
+        counter -= snd->step;
+        while(counter<=0) {
+            counter += period;
+            // => Code from http://www.smspower.org/Development/SN76489 / How the SN76489 makes sound
+            lfsr = (lfsr>>1) | ((snd->whitenoise ? parity(lfsr & 0x9) : lfsr & 1)<<15);
+        }
+        amp[k] = (lfsr & 1) ? volume : 0;
+    }
+
+    snd->counter[3] = counter;
+    snd->lfsr = lfsr;
+    snd->polarity[3] = lfsr & 1;
+}
+
+// Mix the channels enabled by the distribution register, the first output channel takes the bits 0-3, the second one the bits 4-7
+static void sn76489_mix(sn76489 *snd, short *out, short amp[NCHANNELS][SN7_CHUNK_SAMPLES], int n)
+{
+    int i, k, ch;
+    short mask[2][NCHANNELS], sound;
     byte distribution = snd->distribution;
 
-    assert((snd->channels==1) || (snd->channels==2));
-    if((snd->curpos + snd->channels - 1) >= SDL_BUF_SIZE) {
-        snd->curpos = 0;
+    for(ch=0; ch<snd->channels; ch++)
+        for(i=0; i<NCHANNELS; i++,distribution>>=1)
+            mask[ch][i] = (distribution & 1) ? -1 : 0;
+
+    k = 0;
+#ifdef __SSE2__
+    {
+        __m128i volume = _mm_set1_epi16(_volume);
+        __m128i mask0[NCHANNELS], mask1[NCHANNELS];
+
+        for(i=0; i<NCHANNELS; i++) {
+            mask0[i] = _mm_set1_epi16(mask[0][i]);
+            mask1[i] = _mm_set1_epi16(snd->channels==2 ? mask[1][i] : 0);
+        }
+
+        for(; k+8<=n; k+=8) {
+            __m128i s0 = _mm_setzero_si128(), s1 = _mm_setzero_si128(), a, lo, hi;
+
+            for(i=0; i<NCHANNELS; i++) {
+                a = _mm_load_si128((const __m128i*)(amp[i] + k));
+                s0 = _mm_add_epi16(s0, _mm_and_si128(a, mask0[i]));
+                s1 = _mm_add_epi16(s1, _mm_and_si128(a, mask1[i]));
+            }
+
+            // (sound * _volume) >> 8 on 32 bits
+            lo = _mm_mullo_epi16(s0, volume);
+            hi = _mm_mulhi_epi16(s0, volume);
+            s0 = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 8), _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 8));
+
+            if(snd->channels==1) {
+                _mm_storeu_si128((__m128i*)(out + k), s0);
+                continue;
+            }
+
+            lo = _mm_mullo_epi16(s1, volume);
+            hi = _mm_mulhi_epi16(s1, volume);
+            s1 = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 8), _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 8));
+
+            _mm_storeu_si128((__m128i*)(out + 2*k), _mm_unpacklo_epi16(s0, s1));
+            _mm_storeu_si128((__m128i*)(out + 2*k + 8), _mm_unpackhi_epi16(s0, s1));
+        }
+    }
+#endif
+
+    for(; k<n; k++) {
+        for(ch=0; ch<snd->channels; ch++) {
+            for(i=0,sound=0; i<NCHANNELS; i++)
+                sound += amp[i][k] & mask[ch][i];
+            *(out + k*snd->channels + ch) = ((int)sound * _volume) >> 8;
+        }
+    }
+}
+
+// Convert n synthesized samples to the audio device rate and queue them for the audio callback
+static void sn76489_output(sn76489 *snd, short *out, int n)
+{
+    if(snd->fm!=NULL) ym2413_mix(snd->fm, out, n, snd->channels, _volume);
+    if(snd->output==SN7_FRAME_SILENT) return;
+    if(snd->exportresampler!=NULL)
+        wavfile_write(snd->exportfile, snd->exported, resampler_process(snd->exportresampler, out, n, snd->exported));
+    else if(snd->exportfile!=NULL)
+        wavfile_write(snd->exportfile, out, n);
+    if((snd->playsound==SND_OFF) || (snd->output!=SN7_FRAME_AUDIBLE)) return;
+
+    if(snd->resampler!=NULL) {
+        n = resampler_process(snd->resampler, out, n, snd->resampled);
+        out = snd->resampled;
+    }
+
+    // Samples which do not fit in the buffer are dropped (overrun)
+    if(rbwrite(snd->buffer, out, n*snd->channels*sizeof(short))<n*snd->channels*(int)sizeof(short))
         log4me_warning(LOG_EMU_SN76489, "audio buffer is full\n");
+}
+
+// Synthesize the samples up to the sample position target with the current registers
+static void sn76489_render(sn76489 *snd, qword target)
+{
+    short amp[NCHANNELS][SN7_CHUNK_SAMPLES] __attribute__((aligned(16)));
+    short out[SN7_CHUNK_SAMPLES * 2];
+    int i, n;
+
+    while(snd->nsamples<target) {
+        n = (int)MIN(target - snd->nsamples, SN7_CHUNK_SAMPLES);
+
+        for(i=0;i<3;i++) sn76489_tone(snd, i, amp[i], n);
+        sn76489_noise(snd, amp[3], n);
+        sn76489_mix(snd, out, amp, n);
+
+        sn76489_output(snd, out, n);
+        snd->nsamples += n;
+        snd->samplerate += n;
     }
+}
+
+// Output of a channel before the distribution
+static int sn76489_amplitude(sn76489 *snd, int ch)
+{
+    short volume = volume_table[snd->volume[ch]];
+
+    if(ch==3) return (snd->lfsr & 1) ? volume : 0;
+    if(snd->frequency[ch]<=1) return -volume;
+    return snd->polarity[ch] ? -volume : volume;
+}
+
+// Add the change of a channel output to the BLEP buffers it is distributed to
+static void sn76489_blepupdate(sn76489 *snd, int ch, qword cycle)
+{
+    int c, amplitude = sn76489_amplitude(snd, ch), delta = amplitude - snd->amplitude[ch];
+
+    if(delta==0) return;
+
+    snd->amplitude[ch] = amplitude;
+    for(c=0; c<snd->channels; c++)
+        if(snd->distribution & (1 << (c*NCHANNELS + ch)))
+            blep_add(snd->bleps[c], (dword)(cycle - snd->blepstart), delta);
+}
+
+// Process the output transitions of all the channels before cycle, the work depends only on the number of transitions
+static void sn76489_blepupto(sn76489 *snd, qword cycle)
+{
+    int i, ch;
+    qword edge;
+
+    for(;;) {
+        for(i=0,ch=-1; i<NCHANNELS; i++) {
+            if((i<3) && (snd->frequency[i]<=1)) continue; // constant output
+            if((snd->nextedge[i]<cycle) && ((ch<0) || (snd->nextedge[i]<snd->nextedge[ch]))) ch = i;
+        }
+        if(ch<0) break;
+
+        edge = snd->nextedge[ch];
+        if(ch==3) {
+            // => Code from http://www.smspower.org/Development/SN76489 / How the SN76489 makes sound
+            snd->lfsr = (snd->lfsr>>1) | ((snd->whitenoise ? parity(snd->lfsr & 0x9) : snd->lfsr & 1)<<15);
+            snd->polarity[3] = snd->lfsr & 1;
+            snd->nextedge[3] += (snd->frequency[3] ? snd->frequency[3] : 1) << 4;
+        } else {
+            snd->polarity[ch] ^= 1;
+            snd->nextedge[ch] += snd->frequency[ch] << 4;
+        }
+        sn76489_blepupdate(snd, ch, edge);
+    }
+}
 
-    for(i=0;i<NCHANNELS;i++) {
-        // Recalculate compute if frequency channel changed
-        if(snd->frequency[i]!=0) snd->compute[i] %= (snd->frequency[i] << 16);
-        else snd->compute[i] = 0;
-
-        //
-        snd->compute[i] += snd->step;
-        if(snd->compute[i]>=(snd->frequency[i] << 16)) {
-            snd->compute[i] -= (snd->frequency[i] << 16);
-            if(i==3) {
-                // => Code from http://www.smspower.org/Development/SN76489 / How the SN76489 makes sound
-                snd->lfsr=(snd->lfsr>>1) | ((snd->whitenoise ? parity(snd->lfsr & 0x9):snd->lfsr & 1)<<15);
-                snd->polarity[3] =(snd->lfsr & 1);
-            } else
-                snd->polarity[i] ^= 1;
+// Report a register write applied at cycle
+static void sn76489_blepwrite(sn76489 *snd, byte distribution, qword cycle)
+{
+    int c, ch;
+    byte changed = distribution ^ snd->distribution;
+
+    for(ch=0; ch<NCHANNELS; ch++) {
+        // A channel leaving its constant output restarts counting from now
+        if(snd->nextedge[ch]<cycle)
+            snd->nextedge[ch] = cycle + ((ch==3 && !snd->frequency[3] ? 1 : snd->frequency[ch]) << 4);
+
+        // Channels added or removed from an output
+        for(c=0; c<snd->channels; c++) {
+            if(changed & (1 << (c*NCHANNELS + ch)))
+                blep_add(snd->bleps[c], (dword)(cycle - snd->blepstart), (snd->distribution & (1 << (c*NCHANNELS + ch))) ? snd->amplitude[ch] : -snd->amplitude[ch]);
         }
+
+        sn76489_blepupdate(snd, ch, cycle);
+    }
+}
+
+// Close the BLEP frame at cycle and output the samples
+static void sn76489_blepframe(sn76489 *snd, qword cycle)
+{
+    short out[SN7_CHUNK_SAMPLES * 2];
+    int c, k, n;
+
+    sn76489_blepupto(snd, cycle);
+
+    for(c=0; c<snd->channels; c++)
+        blep_endframe(snd->bleps[c], (dword)(cycle - snd->blepstart));
+    snd->blepstart = cycle;
+    sn76489_sampleat(snd, cycle); // positions the FM writes
+
+    while((n = MIN(blep_available(snd->bleps[0]), SN7_CHUNK_SAMPLES))>0) {
+        for(c=0; c<snd->channels; c++)
+            blep_read(snd->bleps[c], out + c, n, snd->channels);
+        for(k=0; k<n*snd->channels; k++)
+            out[k] = ((int)out[k] * _volume) >> 8;
+
+        sn76489_output(snd, out, n);
+        snd->nsamples += n;
+        snd->samplerate += n;
+    }
+}
+
+// Synthesize up to the cycle with the current registers
+static void sn76489_synthesize(sn76489 *snd, qword cycle)
+{
+    if(snd->synthesis==PSG_BLEP)
+        sn76489_blepframe(snd, cycle);
+    else
+        sn76489_render(snd, sn76489_sampleat(snd, cycle));
+}
+
+// Synthesize up to the write timestamp then apply it
+static void sn76489_replay(sn76489 *snd, const sn76489_write_log *w)
+{
+    byte distribution = snd->distribution;
+
+    if(snd->synthesis==PSG_BLEP)
+        sn76489_blepupto(snd, w->cycle);
+    else
+        sn76489_render(snd, sn76489_sampleat(snd, w->cycle));
+
+    switch(w->type) {
+        case SN7_LOG_PSG:
+            sn76489_applywrite(snd, w->data);
+            break;
+        case SN7_LOG_STEREO:
+            sn76489_applywritestereo(snd, w->data);
+            break;
+        case SN7_LOG_FM:
+            // Applied by the FM mixing at its sample position
+            ym2413_queue(snd->fm, sn76489_sampleat(snd, w->cycle), w->reg, w->data);
+            return;
     }
 
-    SDL_LockAudioDevice(snd->dev);
-    for(ch=0; ch<snd->channels; ch++) {
-        for(i=0,sound=0; i<NCHANNELS; i++,distribution>>=1) {
-            if((distribution & 1)==0) continue;
-            if(i==3) {
-                sound += snd->polarity[i]==1 ? volume_table[snd->volume[i]] : 0;
-            } else {
-                // => http://www.smspower.org/Development/SN76489 / How the SN76489 makes sound
-                // If the register value is zero or one then the output is a constant value of +1. This is often used for sample playback on the SN76489.
-                if(snd->frequency[i]<=1) snd->polarity[i] = 1;
-
-                sound += (snd->polarity[i] ? -volume_table[snd->volume[i]] : volume_table[snd->volume[i]]);
+    if(snd->synthesis==PSG_BLEP)
+        sn76489_blepwrite(snd, distribution, w->cycle);
+}
+
+// A machine state is loaded : the timeline restarts at cycle, the outputs keep their phase
+static void sn76489_rebase(sn76489 *snd, qword cycle)
+{
+    int c;
+
+    snd->samplecycle = cycle;
+    snd->samplefrac = 0;
+    if(snd->synthesis==PSG_BLEP) {
+        for(c=0; c<NCHANNELS; c++)
+            snd->nextedge[c] = cycle + (snd->nextedge[c] - snd->blepstart);
+        snd->blepstart = cycle;
+    }
+}
+
+// Synthesis thread : replays the queued writes and synthesizes ahead of the audio callback,
+// the emulation thread only timestamps the writes
+static int sn76489_worker(void *data)
+{
+    sn76489 *snd = data;
+    sn76489_write_log w;
+
+    for(;;) {
+        SDL_SemWait(snd->wakeup);
+
+        while(rbavailable(snd->queue)>=(int)sizeof(w)) {
+            rbread(snd->queue, &w, sizeof(w));
+            switch(w.type) {
+                case SN7_LOG_BEGIN:
+                    sn76489_synthesize(snd, w.cycle);
+                    snd->output = w.data;
+                    break;
+                case SN7_LOG_FRAME:
+                    sn76489_synthesize(snd, w.cycle);
+                    if((snd->playsound==SND_ON) && (snd->output==SN7_FRAME_AUDIBLE) && snd->ratecontrol) sn76489_ratecontrol(snd);
+                    break;
+                case SN7_LOG_SYNC:
+                    sn76489_synthesize(snd, w.cycle);
+                    SDL_SemPost(snd->synced);
+                    break;
+                case SN7_LOG_QUIT:
+                    sn76489_synthesize(snd, w.cycle);
+                    return 0;
+                case SN7_LOG_RESTORE:
+                    sn76489_rebase(snd, w.cycle);
+                    break;
+                default:
+                    sn76489_replay(snd, &w);
+                    break;
             }
         }
-        snd->buffer[snd->curpos++] = ((int)sound * _volume) >> 8;
     }
-    SDL_UnlockAudioDevice(snd->dev);
+}
+
+// Queue a write for the synthesis thread, the emulation thread waits only when the queue is full
+static void sn76489_logwrite(sn76489 *snd, sn76489_log_type type, byte reg, byte data)
+{
+    sn76489_write_log w;
 
-    snd->samplerate++;
+    w.cycle = *snd->cycles;
+    w.type = type;
+    w.reg = reg;
+    w.data = data;
+
+    while(rbspace(snd->queue)<(int)sizeof(w)) {
+        SDL_SemPost(snd->wakeup);
+        SDL_Delay(1);
+    }
+    rbwrite(snd->queue, &w, sizeof(w));
+
+    if(type>=SN7_LOG_FRAME) SDL_SemPost(snd->wakeup);
 }
 
-void sn76489_execute(sn76489 *snd)
+// Writes are applied immediately when the sound is off, otherwise they are timestamped and applied while synthesizing
+static void sn76489_post(sn76489 *snd, byte data)
 {
-    int i;
+    if(!sn76489_synthesizing(snd))
+        sn76489_applywrite(snd, data);
+    else
+        sn76489_logwrite(snd, SN7_LOG_PSG, 0, data);
+}
+
+static void sn76489_poststereo(sn76489 *snd, byte data)
+{
+    if(!sn76489_synthesizing(snd))
+        sn76489_applywritestereo(snd, data);
+    else
+        sn76489_logwrite(snd, SN7_LOG_STEREO, 0, data);
+}
+
+void sn76489_write(sn76489 *snd, byte port, byte data)
+{
+    if(snd->vgm!=NULL) vgmlog_psg(snd->vgm, data);
+
+    sn76489_shadowwrite(snd, data);
+    sn76489_post(snd, data);
+}
+
+void sn76489_writestereo(sn76489 *snd, byte port, byte data)
+{
+    if(snd->vgm!=NULL) vgmlog_stereo(snd->vgm, data);
+
+    snd->shadowstereo = data;
+    sn76489_poststereo(snd, data);
+}
+
+// Write to the FM sound unit, timestamped on the PSG queue so both chips share the synthesis thread
+void sn76489_writefm(sn76489 *snd, byte reg, byte data)
+{
+    sn76489_logwrite(snd, SN7_LOG_FM, reg, data);
+}
 
+void sn76489_pause(sn76489 *snd, int value)
+{
     if(snd->playsound==SND_OFF) return;
 
-    for(i=0;i<snd->lkpspps[snd->scanlines];i++)
-        sn76489_internalmixaudio(snd);
+    SDL_PauseAudioDevice(snd->dev, value);
+}
+
+// Without rate control the samples are produced at the nominal rate, the audio device clock is then the master clock
+void sn76489_setratecontrol(sn76489 *snd, int enable)
+{
+    sn76489_sync(snd);
+
+    snd->ratecontrol = enable;
+    if(enable) return;
+
+    snd->rateppm = snd->drift = 0;
+    sn76489_setrate(snd, SND_FREQUENCY * 1000);
+}
+
+// Block while the audio buffer holds more than the latency target : the next frame is emulated when the device needs it
+void sn76489_waitbuffer(sn76489 *snd)
+{
+    if(snd->playsound==SND_OFF) return;
+
+    while(rbavailable(snd->buffer)>snd->latency*snd->channels*(int)sizeof(short))
+        SDL_SemWaitTimeout(snd->consumed, 100);
+}
+
+// Start of frame : the output applies to the writes of the frame as they are replayed.
+// Fast-forward drops the samples of the frames not heard to keep the audio in real time, they are still exported.
+// A rewound frame replays the past : its samples are neither heard nor exported.
+void sn76489_beginframe(sn76489 *snd, sn76489_frame output)
+{
+    if(!sn76489_synthesizing(snd)) return;
+
+    sn76489_logwrite(snd, SN7_LOG_BEGIN, 0, output);
+}
+
+// End of frame : the synthesis thread catches up with the emulation
+void sn76489_execute(sn76489 *snd)
+{
+    if(!sn76489_synthesizing(snd)) return;
 
-    if(++snd->scanlines>=snd->scanlinespersecond)
-        snd->scanlines = 0;
+    sn76489_logwrite(snd, SN7_LOG_FRAME, 0, 0);
 }
 
-void sn76489_takesnapshot(sn76489 *snd, xmlTextWriterPtr writer)
+// Wait for the synthesis thread to process the writes up to now, it is then idle until the next write
+void sn76489_sync(sn76489 *snd)
+{
+    if(!sn76489_synthesizing(snd)) return;
+
+    sn76489_logwrite(snd, SN7_LOG_SYNC, 0, 0);
+    SDL_SemWait(snd->synced);
+}
+
+// The synthesis thread is synced beforehand, samples is the audio buffered for the device, NULL when the sound is off
+void sn76489_takesnapshot(const sn76489 *snd, const byte *samples, int len, xmlTextWriterPtr writer)
 {
     int i;
 
@@ -352,15 +967,31 @@ void sn76489_takesnapshot(sn76489 *snd, xmlTextWriterPtr writer)
         xmlTextWriterWriteFormatString(writer, "%02X", snd->distribution);
         xmlTextWriterEndElement(writer); /* distribution */
 
-        if(snd->playsound==SND_ON)
-            xmlTextWriterWriteArray(writer, "buffer", (byte*)snd->buffer, snd->curpos*2);
+        if(samples!=NULL)
+            xmlTextWriterWriteArray(writer, "buffer", (byte*)samples, len);
 
     xmlTextWriterEndElement(writer); /* sn76489 */
 }
 
 void sn76489_loadsnapshot(sn76489 *snd, xmlNode *sndnode)
 {
-    int nchan;
+    int i, nchan;
+
+    // Pending writes are superseded by the snapshot
+    sn76489_sync(snd);
+    snd->samplecycle = *snd->cycles;
+    snd->samplepos = snd->nsamples;
+    snd->samplefrac = 0;
+    if(snd->resampler!=NULL) resampler_clear(snd->resampler);
+    if(snd->synthesis==PSG_BLEP) {
+        int c;
+        for(c=0; c<snd->channels; c++)
+            blep_clear(snd->bleps[c]);
+        snd->blepstart = *snd->cycles;
+        for(c=0; c<NCHANNELS; c++)
+            snd->nextedge[c] = *snd->cycles;
+        memset(snd->amplitude, 0, sizeof(snd->amplitude));
+    }
 
     XML_ENUM_CHILD(sndnode, node,
         XML_ELEMENT_ENUM_CHILD("channels", node, channel,
@@ -402,7 +1033,66 @@ void sn76489_loadsnapshot(sn76489 *snd, xmlNode *sndnode)
         )
 
         XML_ELEMENT("buffer", node,
-            snd->curpos = xmlNodeReadArray(node, (byte*)snd->buffer, 2*SDL_BUF_SIZE) / 2;
+            if(snd->playsound==SND_ON) {
+                int len = rbspace(snd->buffer) + rbavailable(snd->buffer);
+                byte *buffer = malloc(len);
+                if(buffer!=NULL) {
+                    len = xmlNodeReadArray(node, buffer, len);
+                    SDL_LockAudioDevice(snd->dev);
+                    rbreset(snd->buffer);
+                    rbwrite(snd->buffer, buffer, len);
+                    SDL_UnlockAudioDevice(snd->dev);
+                    free(buffer);
+                }
+            }
         )
     )
+
+    // Outputs restart from the loaded registers
+    if(snd->synthesis==PSG_BLEP)
+        sn76489_blepwrite(snd, snd->distribution, *snd->cycles);
+
+    for(i=0; i<3; i++) snd->shadowregs[i*2] = snd->frequency[i];
+    for(i=0; i<4; i++) snd->shadowregs[i*2+1] = snd->volume[i];
+    snd->shadowregs[6] = snd->noise;
+    snd->shadowlatch = (snd->lregister >> 4) & 0x07;
+    snd->shadowstereo = snd->distribution;
+}
+
+// The registers are taken as written by the emulation, without waiting for the synthesis thread
+void sn76489_savestate(const sn76489 *snd, statewriter *w)
+{
+    int i;
+
+    for(i=0; i<8; i++)
+        state_write16(w, snd->shadowregs[i]);
+    state_write8(w, snd->shadowlatch);
+    state_write8(w, snd->shadowstereo);
+}
+
+// The registers are masked when loaded, only the size is checked
+int sn76489_checkstate(statereader *r)
+{
+    state_skip(r, 8 * 2 + 2);
+    return !r->error;
+}
+
+// The registers are written again, the noise shift register and the output phases go on
+void sn76489_loadstate(sn76489 *snd, statereader *r)
+{
+    int i;
+
+    for(i=0; i<8; i++)
+        snd->shadowregs[i] = state_read16(r) & 0x3FF;
+    snd->shadowlatch = state_read8(r) & 0x07;
+    snd->shadowstereo = state_read8(r);
+
+    if(sn76489_synthesizing(snd)) sn76489_logwrite(snd, SN7_LOG_RESTORE, 0, 0);
+
+    for(i=0; i<8; i++) {
+        sn76489_post(snd, 0x80 | (i << 4) | (snd->shadowregs[i] & 0x0F));
+        if(!(i & 1) && (i!=6)) sn76489_post(snd, (snd->shadowregs[i] >> 4) & 0x3F);
+    }
+    sn76489_post(snd, 0x80 | (snd->shadowlatch << 4) | (snd->shadowregs[snd->shadowlatch] & 0x0F));
+    sn76489_poststereo(snd, snd->shadowstereo);
 }
@@ -3,14 +3,51 @@
 
 #include "emul.h"
 #include "misc/xml.h"
+#include "misc/ringbuf.h"
+#include "blep.h"
+#include "resampler.h"
+#include "wavfile.h"
+#include "vgmlog.h"
+#include "savestate.h"
 
 #define NCHANNELS       4
 
-#define SDL_SAMPLES     512
-#define SND_FREQUENCY   22050
-#define SDL_BUF_SIZE    (SND_FREQUENCY/2) //SDL_SAMPLES*45
+#define SDL_SAMPLES     512     // default audio device buffer
+#define SND_FREQUENCY   44100   // internal synthesis rate, resampled to the audio device rate
+#define SND_DEFAULT_FREQUENCY   44100
+#define SN7_CHUNK_SAMPLES   256     // samples synthesized per batch
+#define SN7_QUEUE_WRITES    8192    // writes queued for the synthesis thread
+#define SN7_BLEP_CAPACITY   4096    // samples synthesized between two reads of the BLEP buffers
+#define SN7_MAX_RATE_PPM    5000    // maximum output rate adjustment (0.5%)
+#define SN7_DEFAULT_LATENCY 40      // ms
+
+typedef enum {
+    SN7_LOG_PSG,    // write to the PSG
+    SN7_LOG_STEREO, // write to the stereo control port (GG)
+    SN7_LOG_FM,     // write to a register of the FM sound unit
+    SN7_LOG_RESTORE,// a machine state is loaded : the timestamps restart from this one
+    SN7_LOG_BEGIN,  // start of a frame : data is the frame output, applied to the samples after the timestamp
+    SN7_LOG_FRAME,  // end of a frame : synthesize up to the timestamp and adjust the output rate
+    SN7_LOG_SYNC,   // synthesize up to the timestamp and signal the emulation thread
+    SN7_LOG_QUIT    // stop the synthesis thread
+} sn76489_log_type;
+
+typedef enum {
+    SN7_FRAME_SILENT,   // rewound frame : neither heard nor exported
+    SN7_FRAME_EXPORTED, // fast-forwarded frame : exported only
+    SN7_FRAME_AUDIBLE   // heard and exported
+} sn76489_frame;
 
 typedef struct {
+    qword cycle; // CPU tstates timestamp
+    byte type;
+    byte reg;
+    byte data;
+} sn76489_write_log;
+
+struct _ym2413;
+
+typedef struct _sn76489 {
 	SDL_AudioDeviceID dev;
 	soundchannel channels;
 
@@ -28,32 +65,88 @@ typedef struct {
     dword step;
     int samplerate;
 
-    dword compute[NCHANNELS];
+    int counter[NCHANNELS]; // 16.16 PSG clocks before the next output edge
     int polarity[NCHANNELS];
 
-    short buffer[SDL_BUF_SIZE];
-    int curpos;
+    ringbuf *buffer; // emulation thread -> SDL audio callback, at the audio device rate
+    int outputrate; // sample rate granted by the audio device
+    int devicesamples; // audio device buffer, in samples
+    resampler resampler; // NULL when the audio device runs at the synthesis rate
+    short *resampled;
+    wavfile exportfile; // audio export at the nominal rate, NULL when disabled
+    resampler exportresampler; // synthesis rate -> nominal rate of the export, NULL without rate control
+    short *exported;
+    vgmlog vgm; // register writes log, NULL when disabled
+    struct _ym2413 *fm; // FM sound unit mixed to the PSG output, NULL when absent
+
+    // Registers as written by the emulation thread, ahead of the synthesis thread : the machine state is taken from them
+    word shadowregs[8]; // tone 0, volume 0, tone 1, volume 1, tone 2, volume 2, noise, volume 3
+    byte shadowlatch; // latched register
+    byte shadowstereo;
 
     sound_onoff playsound;
-
-    int *lkpspps;
-    int scanlinespersecond;
-    int scanlines;
+    sn76489_frame output; // destinations of the samples of the current frame
+
+    const qword *cycles; // CPU tstates counter
+    qword nsamples; // samples synthesized since power on
+    qword samplepos, samplecycle, samplefrac; // sample clock, advanced with the CPU tstates
+
+    // Dynamic rate control
+    int rate; // output samples per second, in mHz
+    int rateppm; // output rate correction, proportional part plus the accumulated drift
+    int drift; // integral part of the correction, in 1/256 ppm
+    int latency; // target audio buffer fill level, in output samples
+    int fill; // smoothed audio buffer fill level, in 1/16 output samples
+    int ratecontrol; // disabled when the audio device paces the emulation
+    SDL_sem *consumed; // posted by the audio callback after each read
+
+    // Synthesis thread, fed with the timestamped writes by the emulation thread
+    ringbuf *queue; // lock-free queue of sn76489_write_log
+    SDL_Thread *worker;
+    SDL_sem *wakeup; // queue to process
+    SDL_sem *synced; // SN7_LOG_SYNC processed
+
+    psg_synthesis synthesis;
+    blep bleps[2]; // one per output channel
+    qword blepstart; // CPU tstates at the start of the BLEP frame
+    qword nextedge[NCHANNELS]; // CPU tstates of the next output transition
+    int amplitude[NCHANNELS];
 } sn76489;
 
+// The sound is synthesized for the audio device and/or the export file
+static inline int sn76489_synthesizing(const sn76489 *snd)
+{
+    return (snd->playsound==SND_ON) || (snd->exportfile!=NULL);
+}
+
 void audio_setvolume(int volume);
+void audio_setsynthesis(psg_synthesis synthesis);
+void audio_setlatency(int latency);
+void audio_setsamplerate(int samplerate);
+void audio_setbuffer(int samples);
+void audio_setexport(const char *filename);
 
-void sn76489_init(sn76489 *snd, int clock, int scanlinespersecond, soundchannel channels, sound_onoff playsound);
+void sn76489_init(sn76489 *snd, int clock, const qword *cycles, soundchannel channels, sound_onoff playsound);
 void sn76489_free(sn76489 *snd);
 
 void sn76489_write(sn76489 *snd, byte port, byte data);
 void sn76489_writestereo(sn76489 *snd, byte port, byte data);
 
+void sn76489_beginframe(sn76489 *snd, sn76489_frame output);
 void sn76489_execute(sn76489 *snd);
+void sn76489_sync(sn76489 *snd);
+void sn76489_writefm(sn76489 *snd, byte reg, byte data);
 
 void sn76489_pause(sn76489 *snd, int value);
+void sn76489_setratecontrol(sn76489 *snd, int enable);
+void sn76489_waitbuffer(sn76489 *snd);
+int sn76489_getlatency(sn76489 *snd);
 
-void sn76489_takesnapshot(sn76489 *snd, xmlTextWriterPtr writer);
+void sn76489_takesnapshot(const sn76489 *snd, const byte *samples, int len, xmlTextWriterPtr writer);
 void sn76489_loadsnapshot(sn76489 *snd, xmlNode *sndnode);
 
+void sn76489_savestate(const sn76489 *snd, statewriter *w);
+int sn76489_checkstate(statereader *r);
+void sn76489_loadstate(sn76489 *snd, statereader *r);
+
 #endif // SN76489_H_INCLUDED
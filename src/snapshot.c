@@ -19,69 +19,172 @@
 
 ************************************************************************/
 
+#include <stdlib.h>
 #include <string.h>
 #include <zip.h>
 
+#include <SDL.h>
+
 #include "snapshot.h"
 
 #include "emul.h"
 #include "environ.h"
-#include "screenshot.h"
+#include "misc/exit.h"
 #include "misc/log4me.h"
 #include "misc/xml.h"
 
-void takesnapshot(mastersystem *sms, const string snapshotsdir)
+// The machine is copied when the snapshot is taken, the writer thread serializes the copy, encodes
+// the screenshot and builds the zip file in memory : the emulation goes on meanwhile
+struct _snapshotwriter {
+    mastersystem *sms;
+    string snapshotsdir;
+    ms_snapshot *copy;
+    string filename; // zip file of the copy, without the directory and the extension
+    int quit;
+    SDL_Thread *thread;
+    SDL_sem *request; // a copy is ready to be written
+    SDL_sem *idle; // the copy may be taken again
+};
+
+// BMP file encoded in memory, returns its size, 0 when failed
+static int encodescreenshot(const tms9918a *vdp, byte **bmp)
 {
-    xmlTextWriterPtr writer;
-    string snapshotfilename;
+    SDL_Surface *image;
+    SDL_RWops *rw;
+    int size, len = 0;
+
+    *bmp = NULL;
+    if((image = tms9918a_takescreenshot(vdp))==NULL) return 0;
 
-    ms_pause(sms, 1);
+    size = image->w * image->h * 4 + 1024; // 32 bits per pixel at most, with the headers
+    if(((*bmp = malloc(size))!=NULL) && ((rw = SDL_RWFromMem(*bmp, size))!=NULL)) {
+        if(SDL_SaveBMP_RW(image, rw, 0)==0) len = (int)SDL_RWtell(rw);
+        SDL_RWclose(rw);
+    }
+
+    SDL_FreeSurface(image);
+    return len;
+}
+
+static void writesnapshot(snapshotwriter *sw)
+{
+    xmlBufferPtr xml;
+    xmlTextWriterPtr writer;
+    byte *bmp;
+    int bmplen, ok = 0;
+    struct zip *fzip = NULL;
+    struct zip_source *src = NULL;
 
-    snapshotfilename = pathcombc(gettemppath(), SNAPSHOT);
-    writer = xmlNewTextWriterFilename(CSTR(snapshotfilename), 0);
-    if (writer == NULL) {
+    if(((xml = xmlBufferCreate())==NULL) || ((writer = xmlNewTextWriterMemory(xml, 0))==NULL)) {
         log4me_error(LOG_EMU_SNAPSHOT, "Can not create snapshot file\n");
-        exit(EXIT_FAILURE);
+        if(xml) xmlBufferFree(xml);
+        return;
     }
     xmlTextWriterSetIndent(writer, 1);
     xmlTextWriterStartDocument(writer, NULL, NULL, NULL);
-    sms_takesnapshot(sms, writer);
+    ms_writesnapshot(sw->copy, writer);
     xmlTextWriterEndDocument(writer);
     xmlFreeTextWriter(writer);
 
-    string screenshotfilename = pathcombc(gettemppath(), SCREENSHOT);
-    savescreenshot(sms, screenshotfilename);
+    bmplen = encodescreenshot(&sw->copy->machine.vdp, &bmp);
 
-    string filename = gettimedfilename(CSTR(sms->romname), NULL);
-    string zipfilename = pathcombs(strdups(snapshotsdir), filename);
+    string zipfilename = pathcombs(strdups(sw->snapshotsdir), sw->filename);
     straddc(zipfilename, ".zip");
 
     remove(CSTR(zipfilename));
 
-    struct zip *fzip = NULL;
-    struct zip_source *src = NULL;
-
     if((fzip=zip_open(CSTR(zipfilename), ZIP_CREATE|ZIP_EXCL, NULL))==NULL) {
         log4me_error(LOG_EMU_SNAPSHOT, "Could not create file : %s\n", CSTR(zipfilename));
+    } else {
+        // The buffers are read by zip_close
+        src = zip_source_buffer(fzip, xmlBufferContent(xml), xmlBufferLength(xml), 0);
+        zip_add(fzip, SNAPSHOT, src);
+
+        if(bmplen>0) {
+            src = zip_source_buffer(fzip, bmp, bmplen, 0);
+            zip_add(fzip, SCREENSHOT, src);
+        }
+
+        ok = zip_close(fzip)==0;
+    }
+    strfree(zipfilename);
+
+    log4me_print("Snaphot %s ! => %s\n", ok ? "successful" : "failed", CSTR(sw->filename));
+
+    if(bmp) free(bmp);
+    xmlBufferFree(xml);
+}
+
+static int snapshotthread(void *data)
+{
+    snapshotwriter *sw = data;
+
+    for(;;) {
+        SDL_SemWait(sw->request);
+        if(sw->quit) break;
+
+        writesnapshot(sw);
+        SDL_SemPost(sw->idle);
+    }
+
+    return 0;
+}
+
+snapshotwriter *createsnapshotwriter(mastersystem *sms, const string snapshotsdir)
+{
+    snapshotwriter *sw = calloc(1, sizeof(snapshotwriter));
+
+    if((sw==NULL) ||
+       ((sw->request = SDL_CreateSemaphore(0))==NULL) ||
+       ((sw->idle = SDL_CreateSemaphore(1))==NULL)) {
+        log4me_error(LOG_EMU_SNAPSHOT, "Unable to allocate the memory block.\n");
         exit(EXIT_FAILURE);
     }
 
-    src = zip_source_file(fzip, CSTR(snapshotfilename), (off_t)0, (off_t)0);
-    zip_add(fzip, SNAPSHOT, src);
+    sw->sms = sms;
+    sw->snapshotsdir = snapshotsdir;
+    sw->copy = ms_createsnapshot(sms);
 
-    src = zip_source_file(fzip, CSTR(screenshotfilename), (off_t)0, (off_t)0);
-    zip_add(fzip, SCREENSHOT, src);
+    if((sw->thread = SDL_CreateThread(snapshotthread, "snapshot", sw))==NULL) {
+        log4me_error(LOG_EMU_SNAPSHOT, "Unable to create the snapshot thread : %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
 
-    zip_close(fzip);
-    strfree(zipfilename);
+    pushobject(sw, freesnapshotwriter);
+    return sw;
+}
+
+// The snapshot being written is completed before the writer stops
+void freesnapshotwriter(snapshotwriter *sw)
+{
+    SDL_SemWait(sw->idle);
+    sw->quit = 1;
+    SDL_SemPost(sw->request);
+    SDL_WaitThread(sw->thread, NULL);
+
+    SDL_DestroySemaphore(sw->request);
+    SDL_DestroySemaphore(sw->idle);
+    ms_freesnapshot(sw->copy);
+    strfree(sw->filename);
+    free(sw);
+}
+
+// Only the copy of the machine is taken here, the previous snapshot is waited for when it is still being written
+void takesnapshot(snapshotwriter *sw)
+{
+#ifdef DEBUG
+    Uint64 t0 = SDL_GetPerformanceCounter();
+#endif
+
+    SDL_SemWait(sw->idle);
 
-    remove(CSTR(screenshotfilename));
-    strfree(screenshotfilename);
+    ms_copysnapshot(sw->sms, sw->copy);
+    strfree(sw->filename);
+    sw->filename = gettimedfilename(CSTR(sw->sms->romname), NULL);
 
-    log4me_print("Snaphot %s ! => %s\n", "successful", CSTR(filename));
-    remove(CSTR(snapshotfilename));
-    strfree(snapshotfilename);
-    strfree(filename);
+    SDL_SemPost(sw->request);
 
-    ms_pause(sms, 0);
+#ifdef DEBUG
+    log4me_debug(LOG_EMU_SNAPSHOT, "snapshot copied in %.0f us\n", (SDL_GetPerformanceCounter() - t0) * 1000000.0 / SDL_GetPerformanceFrequency());
+#endif
 }
@@ -7,6 +7,12 @@
 #define SNAPSHOT    "snapshot.xml"
 #define SCREENSHOT  "screenshot.bmp"
 
-void takesnapshot(mastersystem *sms, const string snapshotsdir);
+struct _snapshotwriter;
+typedef struct _snapshotwriter snapshotwriter;
+
+snapshotwriter *createsnapshotwriter(mastersystem *sms, const string snapshotsdir);
+void freesnapshotwriter(snapshotwriter *sw);
+
+void takesnapshot(snapshotwriter *sw);
 
 #endif // SNAPSHOT_H_INCLUDED
@@ -19,8 +19,16 @@
 
 ************************************************************************/
 
+#include <stddef.h>
+
 #include "tms9918a.h"
 #include "misc/log4me.h"
+#include "misc/memcheck.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define TMS_SIMD_SSSE3
+#include <tmmintrin.h>
+#endif
 
 #define TILES_WIDTH_SCREEN      32
 #define TILES_HEIGHT_SCREEN     28
@@ -62,10 +70,21 @@ static const int lkp_mod256[512] = {
 #undef M1
 };
 
+#define GG_SCREEN_X         (6 * 8)
 #define GG_SCREEN_WIDTH     (20 * 8)    /* 160 pixels */
 #define GG_SCREEN_HEIGHT    (18 * 8)    /* 144 pixels */
-static const SDL_Rect ggrect192 = { 6*8, 3*8, GG_SCREEN_WIDTH, GG_SCREEN_HEIGHT };
-static const SDL_Rect ggrect224 = { 6*8, 5*8, GG_SCREEN_WIDTH, GG_SCREEN_HEIGHT };
+static const qword nowriteseq = 0; // until the machine shares its write sequence
+
+static const SDL_Rect ggrect192 = { GG_SCREEN_X, 3*8, GG_SCREEN_WIDTH, GG_SCREEN_HEIGHT };
+static const SDL_Rect ggrect224 = { GG_SCREEN_X, 5*8, GG_SCREEN_WIDTH, GG_SCREEN_HEIGHT };
+
+// Renderer variants : registers 0/1 and console type bits the line renderer depends on
+#define TMS_RENDER_TOP2ROWS_NO_HSCROLL  0x01
+#define TMS_RENDER_VERT_SCROLL_INHIBIT  0x02
+#define TMS_RENDER_MODE224              0x04
+#define TMS_RENDER_ZOOMED_SPRITES       0x08
+#define TMS_RENDER_8X16_SPRITES         0x10
+#define TMS_RENDER_GG                   0x20
 
 // => Sega Master System VDP documentation by Charles MacDonald
 // See chapter 11.) Display timing
@@ -152,14 +171,88 @@ static const byte lkp_vcounter_pal224[313] = {
 0xF7,0xF8,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
 };
 
+typedef void (*tms9918a_convertfunc)(word *dst, const byte *src, int len, const byte *lsb, const byte *msb);
+
+static tms9918a_convertfunc tms9918a_convertline = NULL;
+
 static void tms9918a_setregister(tms9918a *cpn, int reg, byte data);
+static void tms9918a_catchup(tms9918a *cpn);
+static void tms9918a_selectrenderer(tms9918a *cpn);
+
+static void tms9918a_convertline_c(word *dst, const byte *src, int len, const byte *lsb, const byte *msb)
+{
+    int i, c;
+
+    for(i=0; i<len; i++) {
+        c = src[i] & TMS_PIXEL_COLOR_MASK;
+        dst[i] = lsb[c] | (msb[c] << 8);
+    }
+}
+
+#ifdef TMS_SIMD_SSSE3
+// 16 pixels per iteration : each half of the 32 colors palette fits in a pshufb table (one for the LSB, one for the MSB)
+__attribute__((target("ssse3")))
+static void tms9918a_convertline_ssse3(word *dst, const byte *src, int len, const byte *lsb, const byte *msb)
+{
+    int i;
+    const __m128i lsb0 = _mm_loadu_si128((const __m128i*)lsb);
+    const __m128i lsb1 = _mm_loadu_si128((const __m128i*)(lsb + 16));
+    const __m128i msb0 = _mm_loadu_si128((const __m128i*)msb);
+    const __m128i msb1 = _mm_loadu_si128((const __m128i*)(msb + 16));
+    const __m128i mask0f = _mm_set1_epi8(0x0F);
+    const __m128i mask10 = _mm_set1_epi8(0x10);
+
+    for(i=0; i+16<=len; i+=16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i index = _mm_and_si128(pixels, mask0f);
+        __m128i high = _mm_cmpeq_epi8(_mm_and_si128(pixels, mask10), mask10);
+        __m128i l = _mm_or_si128(_mm_andnot_si128(high, _mm_shuffle_epi8(lsb0, index)), _mm_and_si128(high, _mm_shuffle_epi8(lsb1, index)));
+        __m128i m = _mm_or_si128(_mm_andnot_si128(high, _mm_shuffle_epi8(msb0, index)), _mm_and_si128(high, _mm_shuffle_epi8(msb1, index)));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi8(l, m));
+        _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpackhi_epi8(l, m));
+    }
+
+    tms9918a_convertline_c(dst + i, src + i, len - i, lsb, msb);
+}
+#endif
+
+static void tms9918a_selectconvertline(void)
+{
+    if(tms9918a_convertline) return;
+
+    tms9918a_convertline = tms9918a_convertline_c;
+#ifdef TMS_SIMD_SSSE3
+    if(__builtin_cpu_supports("ssse3"))
+        tms9918a_convertline = tms9918a_convertline_ssse3;
+#endif
+}
+
+static void tms9918a_torgb565(const tms9918a *cpn, word *dst, int dstpitch, const byte *src, int width, int height)
+{
+    byte lsb[TMS_COLORS], msb[TMS_COLORS];
+    int i;
+
+    for(i=0; i<TMS_COLORS; i++) {
+        lsb[i] = cpn->sdlcolors[i] & 0xFF;
+        msb[i] = (cpn->sdlcolors[i] >> 8) & 0xFF;
+    }
+
+    for(i=0; i<height; i++) {
+        tms9918a_convertline(dst, src, width, lsb, msb);
+        dst = (word*)((byte*)dst + dstpitch);
+        src += TMS_BUFFER_WIDTH;
+    }
+}
 
 void tms9918a_init(tms9918a *cpn, gameconsole gconsole, const display *screen, video_mode vmode)
 {
     memset(cpn->registers, 0, TMS_REGISTERS);
     memset(cpn->cram, 0, TMS_CRAM_SIZE);
     memset(cpn->vram, 0, TMS_VRAM_SIZE);
+    memset(cpn->vrampages, 0, sizeof(cpn->vrampages));
+    cpn->writeseq = &nowriteseq;
     memset(cpn->sdlcolors, 0, sizeof(cpn->sdlcolors));
+    memset(cpn->palette, 0, sizeof(cpn->palette));
     memset(cpn->tiles, 0, sizeof(cpn->tiles));
     memset(cpn->tiles_desc, 0, sizeof(cpn->tiles_desc));
 
@@ -178,13 +271,24 @@ void tms9918a_init(tms9918a *cpn, gameconsole gconsole, const display *screen, v
 
     cpn->screen = screen;
     cpn->ggrect = &ggrect192;
-    cpn->picture = gconsole==GC_GG ?
-                        SDL_CreateTexture(video_getrenderer(), SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING, GG_SCREEN_WIDTH, GG_SCREEN_HEIGHT) :
-                        SDL_CreateTexture(video_getrenderer(), SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING, 256, 192);
+    if(gconsole==GC_GG) {
+        cpn->pictures[0] = SDL_CreateTexture(video_getrenderer(), SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING, GG_SCREEN_WIDTH, GG_SCREEN_HEIGHT);
+        cpn->pictures[1] = NULL;
+    } else {
+        cpn->pictures[0] = SDL_CreateTexture(video_getrenderer(), SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING, 256, 192);
+        cpn->pictures[1] = SDL_CreateTexture(video_getrenderer(), SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING, 256, 224);
+    }
+    cpn->picture = cpn->pictures[0];
 
     cpn->pixelfmt = SDL_AllocFormat(SDL_PIXELFORMAT_RGB565);
-    cpn->buffer16 = calloc(256*224, sizeof(word));
-    // TODO: cpn->buffer16==NULL;
+    cpn->buffer8 = calloc(TMS_BUFFER_WIDTH*TMS_BUFFER_HEIGHT, sizeof(byte));
+    if(cpn->buffer8==NULL) {
+        log4me_error(LOG_EMU_SMSVDP, "Unable to allocate the memory block.\n");
+        exit(EXIT_FAILURE);
+    }
+    cpn->present = 1;
+    cpn->paced = 1;
+    tms9918a_selectconvertline();
 
     // => Sega Master System VDP documentation by Charles MacDonald
     // A NTSC machine displays 60 frames per second, each frame has 262 scanlines.
@@ -196,6 +300,8 @@ void tms9918a_init(tms9918a *cpn, gameconsole gconsole, const display *screen, v
     cpn->idclock = clock_new(cpn->framerate);
     cpn->frame = 0;
     cpn->scanline = 0;
+    cpn->renderline = 0;
+    cpn->catchups = 0;
     cpn->slcounter = 0xFF; // reg 10
     cpn->screenheight = 192;
 
@@ -218,16 +324,19 @@ void tms9918a_init(tms9918a *cpn, gameconsole gconsole, const display *screen, v
 
 #ifdef DEBUG
     cpn->showpalette = 0;
+    cpn->perfvariant = cpn->perfgeneric = 0;
 #endif
 }
 
 void tms9918a_free(tms9918a *cpn)
 {
-    free(cpn->buffer16);
+    free(cpn->buffer8);
     if(cpn->pixelfmt)
         SDL_FreeFormat(cpn->pixelfmt);
-    if(cpn->picture)
-        SDL_DestroyTexture(cpn->picture);
+    if(cpn->pictures[0])
+        SDL_DestroyTexture(cpn->pictures[0]);
+    if(cpn->pictures[1])
+        SDL_DestroyTexture(cpn->pictures[1]);
     clock_release(cpn->idclock);
 }
 
@@ -262,6 +371,7 @@ static void tms9918a_setregister(tms9918a *cpn, int reg, byte data)
                 log4me_warning(LOG_EMU_SMSVDP, "Force background base address (0x%04X)\n", tms9918a_getbgbaseaddr(cpn));
 #endif
             cpn->r2_bgbaseaddr = tms9918a_getbgbaseaddr(cpn);
+            tms9918a_selectrenderer(cpn);
             break;
 
         case 1:
@@ -283,6 +393,7 @@ static void tms9918a_setregister(tms9918a *cpn, int reg, byte data)
                 log4me_warning(LOG_EMU_SMSVDP, "Force background base address (0x%04X)\n", tms9918a_getbgbaseaddr(cpn));
 #endif
             cpn->r2_bgbaseaddr = tms9918a_getbgbaseaddr(cpn);
+            tms9918a_selectrenderer(cpn);
             break;
 
         case 2:
@@ -359,7 +470,11 @@ void tms9918a_setcolor(tms9918a *cpn, int clr, byte value)
             color.b = ((value & 0x30) >> 4) * 85;
             log4me_debug(LOG_EMU_SMSVDP, "set color %d = 0x%02X (r:%d, g:%d b:%d)\n", clr, value, color.r, color.g, color.b);
 #endif
-            cpn->sdlcolors[clr] = SDL_MapRGB(cpn->pixelfmt, (value & 0x03) * 85/*r*/, ((value & 0x0C) >> 2) * 85/*g*/, ((value & 0x30) >> 4) * 85/*b*/);
+            cpn->palette[clr].r =  (value & 0x03)       * 85;
+            cpn->palette[clr].g = ((value & 0x0C) >> 2) * 85;
+            cpn->palette[clr].b = ((value & 0x30) >> 4) * 85;
+            cpn->palette[clr].a = 255;
+            cpn->sdlcolors[clr] = SDL_MapRGB(cpn->pixelfmt, cpn->palette[clr].r, cpn->palette[clr].g, cpn->palette[clr].b);
             break;
         case GC_GG:
             assert(clr<64);
@@ -370,7 +485,11 @@ void tms9918a_setcolor(tms9918a *cpn, int clr, byte value)
             color.b = ((value & 0x0F00) >> 8) * 17;
             log4me_debug(LOG_EMU_SMSVDP, "set color %d = (r:%d, g:%d b:%d)\n", clr>>1, color.r, color.g, color.b);
 #endif
-            cpn->sdlcolors[clr>>1] = SDL_MapRGB(cpn->pixelfmt, (ggcolor & 0x000F) * 17/*r*/, ((ggcolor & 0x00F0) >> 4) * 17/*g*/, ((ggcolor & 0x0F00) >> 8) * 17/*b*/);
+            cpn->palette[clr>>1].r =  (ggcolor & 0x000F)       * 17;
+            cpn->palette[clr>>1].g = ((ggcolor & 0x00F0) >> 4) * 17;
+            cpn->palette[clr>>1].b = ((ggcolor & 0x0F00) >> 8) * 17;
+            cpn->palette[clr>>1].a = 255;
+            cpn->sdlcolors[clr>>1] = SDL_MapRGB(cpn->pixelfmt, cpn->palette[clr>>1].r, cpn->palette[clr>>1].g, cpn->palette[clr>>1].b);
             break;
         default:
             assert((cpn->gconsole==GC_SMS) || (cpn->gconsole==GC_GG));
@@ -380,6 +499,8 @@ void tms9918a_setcolor(tms9918a *cpn, int clr, byte value)
 
 void tms9918a_writeop(tms9918a *cpn, byte port, byte data)
 {
+    tms9918a_catchup(cpn);
+
     if(cpn->flagsetop & 1) {
         cpn->op.bytes.msb = data;
         cpn->curoperation = cpn->op.newoperation & 0xC000;
@@ -433,7 +554,10 @@ void tms9918a_writeop(tms9918a *cpn, byte port, byte data)
 
 byte tms9918a_readstatus(tms9918a *cpn, byte port)
 {
-    byte curstatus = cpn->status;
+    byte curstatus;
+
+    tms9918a_catchup(cpn); // sprites collision/overflow flags are set while rendering
+    curstatus = cpn->status;
     if(bit7_is_set(cpn->status))
         cpn->status &= TMS_STATUS_RESET_FLAGS; // Reset bits only on vsync int
     cpn->flagsetop = 0;
@@ -446,6 +570,7 @@ byte tms9918a_readstatus(tms9918a *cpn, byte port)
 
 void tms9918a_writedata(tms9918a *cpn, byte port, byte data)
 {
+    tms9918a_catchup(cpn);
     cpn->flagsetop = 0;
 
     if(cpn->curoperation==TMS_WRITE_COLOR) {
@@ -466,6 +591,7 @@ void tms9918a_writedata(tms9918a *cpn, byte port, byte data)
     cpn->tiles[cpn->vram_addr >> 5] = NULL; // Clear pre-calculate tiles
 
     cpn->read_buffer = data;
+    cpn->vrampages[cpn->vram_addr >> TMS_DIRTY_SHIFT] = *cpn->writeseq;
     cpn->vram[cpn->vram_addr++] = data;
     cpn->vram_addr &= 0x3FFF;
 }
@@ -557,28 +683,27 @@ static byte *tms9918a_gettilepixels(tms9918a *cpn, int tile)
     return pixels;
 }
 
-static void tms9918a_drawzoomedsprites(tms9918a *cpn, word *draw)
+// draw can be NULL : only the sprites collision/overflow status flags are updated
+static inline __attribute__((always_inline)) void tms9918a_drawzoomedsprites(tms9918a *cpn, int line, byte *draw, const int sprites8x16, const int mode224)
 {
     byte *tilepixels, *sprites, color, tilemask, spritescollide[256];
-    Uint32 *palette;
     int i, j, sx, sy, sw, tile, spritesonscanline;
 
     memset(spritescollide, 0, sizeof(spritescollide));
     spritesonscanline = 0;
     sprites = cpn->vram + cpn->r5_spattrbaseaddr;
-    palette = cpn->sdlcolors + 16;
 
     // => Sega Master System VDP documentation by Charles MacDonald
     // When bit 1 of register #1 is set, bit 0 of the pattern index is ignored.
     // ex : GG - Road Rash
-    tilemask = cpn->r1_8x16sprite ? 0xFE : 0xFF;
+    tilemask = sprites8x16 ? 0xFE : 0xFF;
 
     for(i=0;i<64;i++) {
         sy = (int)sprites[i];
         // => Sega Master System VDP documentation by Charles MacDonald
         // If the Y coordinate is set to $D0, then the sprite in question and all remaining sprites of the 64 available will not be drawn. This only works
         // in the 192-line display mode, in the 224 and 240-line modes a Y coordinate of $D0 has no special meaning.
-        if((sy==0xD0) && !mode224selected(cpn)) break;
+        if((sy==0xD0) && !mode224) break;
         if(sy<240) {
             // => Sega Master System VDP documentation by Charles MacDonald
             // The Y coordinate is treated as being plus one, so a value of zero would
@@ -587,15 +712,15 @@ static void tms9918a_drawzoomedsprites(tms9918a *cpn, word *draw)
         } else
             sy = sy - 255;
 
-        if((sy>cpn->scanline) || ((sy+(cpn->r1_8x16sprite?32:16))<=cpn->scanline)) continue;
+        if((sy>line) || ((sy+(sprites8x16?32:16))<=line)) continue;
 
         tile = cpn->r6_sprite_base_tiles + (sprites[129+i*2] & tilemask);
-        if(cpn->r1_8x16sprite && ((cpn->scanline-sy)>=16)) {
+        if(sprites8x16 && ((line-sy)>=16)) {
             sy += 16;
             tile++;
         }
 
-        tilepixels = tms9918a_gettilepixels(cpn, tile) + (((cpn->scanline-sy) >> 1) << 3);
+        tilepixels = tms9918a_gettilepixels(cpn, tile) + (((line-sy) >> 1) << 3);
         sx = sprites[128+i*2];
         sw = sx + (((sx+16)>=256) ? 256-sx : 16);
 
@@ -607,7 +732,7 @@ static void tms9918a_drawzoomedsprites(tms9918a *cpn, word *draw)
                     cpn->status |= TMS_STATUS_SPRITES_COLLIDE;
                 } else {
                     *(word*)(spritescollide + j) = 0x0101; // spritescollide[j] = 1; spritescollide[j+1] = 1;
-                    draw[j] = draw[j+1] = palette[color];
+                    if(draw) draw[j] = draw[j+1] = (16 + color) | TMS_PIXEL_SPRITE;
                 }
             }
         }
@@ -620,28 +745,26 @@ static void tms9918a_drawzoomedsprites(tms9918a *cpn, word *draw)
     }
 }
 
-static void tms9918a_drawsprites(tms9918a *cpn, word *draw)
+static inline __attribute__((always_inline)) void tms9918a_drawsprites(tms9918a *cpn, int line, byte *draw, const int sprites8x16, const int mode224)
 {
     byte *tilepixels, *sprites, color, tilemask, spritescollide[256];
-    Uint32 *palette;
     int i, j, sx, sy, sw, tile, spritesonscanline;
 
     memset(spritescollide, 0, sizeof(spritescollide));
     spritesonscanline = 0;
     sprites = cpn->vram + cpn->r5_spattrbaseaddr;
-    palette = cpn->sdlcolors + 16;
 
     // => Sega Master System VDP documentation by Charles MacDonald
     // When bit 1 of register #1 is set, bit 0 of the pattern index is ignored.
     // ex : GG - Road Rash
-    tilemask = cpn->r1_8x16sprite ? 0xFE : 0xFF;
+    tilemask = sprites8x16 ? 0xFE : 0xFF;
 
     for(i=0;i<64;i++) {
         sy = (int)sprites[i];
         // => Sega Master System VDP documentation by Charles MacDonald
         // If the Y coordinate is set to $D0, then the sprite in question and all remaining sprites of the 64 available will not be drawn. This only works
         // in the 192-line display mode, in the 224 and 240-line modes a Y coordinate of $D0 has no special meaning.
-        if((sy==0xD0) && !mode224selected(cpn)) break;
+        if((sy==0xD0) && !mode224) break;
         if(sy<240) {
             // => Sega Master System VDP documentation by Charles MacDonald
             // The Y coordinate is treated as being plus one, so a value of zero would
@@ -650,15 +773,15 @@ static void tms9918a_drawsprites(tms9918a *cpn, word *draw)
         } else
             sy = sy - 255;
 
-        if((sy>cpn->scanline) || ((sy+(cpn->r1_8x16sprite?16:8))<=cpn->scanline)) continue;
+        if((sy>line) || ((sy+(sprites8x16?16:8))<=line)) continue;
 
         tile = cpn->r6_sprite_base_tiles + (sprites[129+i*2] & tilemask);
-        if(cpn->r1_8x16sprite && ((cpn->scanline-sy)>=8)) {
+        if(sprites8x16 && ((line-sy)>=8)) {
             sy += 8;
             tile++;
         }
 
-        tilepixels = tms9918a_gettilepixels(cpn, tile) + ((cpn->scanline-sy) << 3);
+        tilepixels = tms9918a_gettilepixels(cpn, tile) + ((line-sy) << 3);
         sx = sprites[128+i*2];
         sw = sx + (((sx+8)>=256) ? 256-sx : 8);
 
@@ -670,7 +793,7 @@ static void tms9918a_drawsprites(tms9918a *cpn, word *draw)
                     cpn->status |= TMS_STATUS_SPRITES_COLLIDE;
                 } else {
                     spritescollide[j] = 1;
-                    draw[j] = palette[color];
+                    if(draw) draw[j] = (16 + color) | TMS_PIXEL_SPRITE;
                 }
             }
         }
@@ -683,91 +806,95 @@ static void tms9918a_drawsprites(tms9918a *cpn, word *draw)
     }
 }
 
-static void tms9918a_clearline(tms9918a *cpn)
+static void tms9918a_clearline(tms9918a *cpn, int line, int left, int right)
 {
-    word *draw = cpn->buffer16 + (cpn->scanline << 8); // scanline*256
-    Uint32 color = cpn->sdlcolors[cpn->r7_bordercolor];
+    byte *draw = cpn->buffer8 + (line << 8); // line*256
 
     assert(cpn->r1_display==0);
-    int i;
-    for(i=0; i<TILES_WIDTH_SCREEN*8; i++)
-        *draw++ = color;
+    memset(draw + left, cpn->r7_bordercolor, right - left);
 
-    log4me_debug(LOG_EMU_SMSVDP, "render line %d (clear)\n", cpn->scanline);
+    log4me_debug(LOG_EMU_SMSVDP, "render line %d (clear)\n", line);
 }
 
-static void tms9918a_renderline(tms9918a *cpn)
+// Line renderer template, flags is a combination of TMS_RENDER_* bits.
+// Only the columns [left, right) are guaranteed to be rendered, the others may be left partially drawn
+static inline __attribute__((always_inline)) void tms9918a_renderline_t(tms9918a *cpn, int line, byte *draw, const int left, const int right, const int flags)
 {
-    word *tilesdesc, *draw;
-    byte *tilepixels;
-    Uint32 *palette;
-    int i, j, x, y, ft, tile, tileoffset;
+    word *tilesdesc;
+    byte *tilepixels, palette;
+    int i, j, x, y, ft, tile, tileoffset, sx;
     const int *lkpmodulo;
     tms99818a_fgtile foregroundtiles[TILES_WIDTH_SCREEN];
 
     assert(cpn->r1_display);
-    lkpmodulo = mode224selected(cpn) ? lkp_mod256 : lkp_mod224;
+    lkpmodulo = (flags & TMS_RENDER_MODE224) ? lkp_mod256 : lkp_mod224;
 
-    x = (cpn->r0_top2rows_no_hscroll && (cpn->scanline<16)) ? 0 : cpn->r8_scrollx;
-    y = lkpmodulo[cpn->scanline + cpn->r9_scrolly];
+    x = ((flags & TMS_RENDER_TOP2ROWS_NO_HSCROLL) && (line<16)) ? 0 : cpn->r8_scrollx;
+    y = lkpmodulo[line + cpn->r9_scrolly];
 
     tilesdesc = (word*)(cpn->vram + cpn->r2_bgbaseaddr) + (y >> 3)*TILES_WIDTH_SCREEN;
     tileoffset = (y & 0x7) << 3;
-    draw = cpn->buffer16 + (cpn->scanline << 8); // scanline*256
 
     ft = 0; // no foreground tiles to draw
 
-    log4me_debug(LOG_EMU_SMSVDP, "render line %d : scroll X : 0x%02X (%d)\n", cpn->scanline, x, x);
+    log4me_debug(LOG_EMU_SMSVDP, "render line %d : scroll X : 0x%02X (%d)\n", line, x, x);
 
     // Draw background tiles
     for(i=0; i<TILES_WIDTH_SCREEN; i++,tilesdesc++) {
-        if((i==TILES_WIDTH_SCREEN-8) && cpn->r0_vert_scroll_inhibit) {
-            y = lkpmodulo[cpn->scanline];
+        if((i==TILES_WIDTH_SCREEN-8) && (flags & TMS_RENDER_VERT_SCROLL_INHIBIT)) {
+            y = lkpmodulo[line];
             tilesdesc = (word*)(cpn->vram + cpn->r2_bgbaseaddr) + (y >> 3)*TILES_WIDTH_SCREEN + i;
             tileoffset = (y & 0x7) << 3;
         }
 
+        // Skip the tiles outside the visible columns (the tile may wrap around the line)
+        sx = x & 0xFF;
+        if(((sx+8<=left) || (sx>=right)) && (sx+8-256<=left)) {
+            x += 8;
+            continue;
+        }
+
         tile = *tilesdesc & 0x01FF;
-        palette = *tilesdesc & TMS_BG_ATTR_SPRITE_PAL ? cpn->sdlcolors + 16 : cpn->sdlcolors;
+        palette = *tilesdesc & TMS_BG_ATTR_SPRITE_PAL ? 16 : 0;
 
         if(*tilesdesc & 0x1000) { // It's a foreground tile ?
             foregroundtiles[ft].x = x;
             foregroundtiles[ft].offset = tileoffset;
             foregroundtiles[ft++].desc = *tilesdesc;
-            for(j=0;j<8;j++,x++) draw[x&0xFF] = palette[0];
+            for(j=0;j<8;j++,x++) draw[x&0xFF] = palette;
             continue;
         }
 
         switch(*tilesdesc & (TMS_BG_ATTR_FLIPH | TMS_BG_ATTR_FLIPV)) {
             case 0:
                 tilepixels = tms9918a_gettilepixels(cpn, tile) + tileoffset;
-                for(j=0;j<8;j++,x++) draw[x&0xFF] = palette[*tilepixels++];
+                for(j=0;j<8;j++,x++) draw[x&0xFF] = palette + *tilepixels++;
                 break;
             case TMS_BG_ATTR_FLIPH:
                 tilepixels = tms9918a_gettilepixels(cpn, tile) + tileoffset + 7;
-                for(j=0;j<8;j++,x++) draw[x&0xFF] = palette[*tilepixels--];
+                for(j=0;j<8;j++,x++) draw[x&0xFF] = palette + *tilepixels--;
                 break;
             case TMS_BG_ATTR_FLIPV:
                 tilepixels = tms9918a_gettilepixels(cpn, tile) + 7*8 - tileoffset;
-                for(j=0;j<8;j++,x++) draw[x&0xFF] = palette[*tilepixels++];
+                for(j=0;j<8;j++,x++) draw[x&0xFF] = palette + *tilepixels++;
                 break;
             case TMS_BG_ATTR_FLIPH | TMS_BG_ATTR_FLIPV:
                 tilepixels = tms9918a_gettilepixels(cpn, tile) + (7*8+7) - tileoffset;
-                for(j=0;j<8;j++,x++) draw[x&0xFF] = palette[*tilepixels--];
+                for(j=0;j<8;j++,x++) draw[x&0xFF] = palette + *tilepixels--;
                 break;
         }
     }
 
     // Draw sprites
-    if(cpn->r1_zoomedsprites)
-        tms9918a_drawzoomedsprites(cpn, draw);
+    if(flags & TMS_RENDER_ZOOMED_SPRITES)
+        tms9918a_drawzoomedsprites(cpn, line, draw, flags & TMS_RENDER_8X16_SPRITES, flags & TMS_RENDER_MODE224);
     else
-        tms9918a_drawsprites(cpn, draw);
+        tms9918a_drawsprites(cpn, line, draw, flags & TMS_RENDER_8X16_SPRITES, flags & TMS_RENDER_MODE224);
 
     // Draw foreground tiles with transparence
     for(i=0; i<ft; i++) {
         tile = foregroundtiles[i].desc & 0x01FF;
-        palette = foregroundtiles[i].desc & TMS_BG_ATTR_SPRITE_PAL ? cpn->sdlcolors + 16 : cpn->sdlcolors;
+        palette = (foregroundtiles[i].desc & TMS_BG_ATTR_SPRITE_PAL ? 16 : 0) | TMS_PIXEL_PRIORITY;
 
         x = foregroundtiles[i].x;
         tileoffset = foregroundtiles[i].offset;
@@ -776,70 +903,223 @@ static void tms9918a_renderline(tms9918a *cpn)
             case 0:
                 tilepixels = tms9918a_gettilepixels(cpn, tile) + tileoffset;
                 for(j=0;j<8;j++,x++) {
-                    if(*tilepixels) draw[x&0xFF] = palette[*tilepixels];
+                    if(*tilepixels) draw[x&0xFF] = palette + *tilepixels;
                     tilepixels++;
                 }
                 break;
             case TMS_BG_ATTR_FLIPH:
                 tilepixels = tms9918a_gettilepixels(cpn, tile) + tileoffset + 7;
                 for(j=0;j<8;j++,x++) {
-                    if(*tilepixels) draw[x&0xFF] = palette[*tilepixels];
+                    if(*tilepixels) draw[x&0xFF] = palette + *tilepixels;
                     tilepixels--;
                 }
                 break;
             case TMS_BG_ATTR_FLIPV:
                 tilepixels = tms9918a_gettilepixels(cpn, tile) + 7*8 - tileoffset;
                 for(j=0;j<8;j++,x++) {
-                    if(*tilepixels) draw[x&0xFF] = palette[*tilepixels];
+                    if(*tilepixels) draw[x&0xFF] = palette + *tilepixels;
                     tilepixels++;
                 }
                 break;
             case TMS_BG_ATTR_FLIPH | TMS_BG_ATTR_FLIPV:
                 tilepixels = tms9918a_gettilepixels(cpn, tile) + (7*8+7) - tileoffset;
                 for(j=0;j<8;j++,x++) {
-                    if(*tilepixels) draw[x&0xFF] = palette[*tilepixels];
+                    if(*tilepixels) draw[x&0xFF] = palette + *tilepixels;
                     tilepixels--;
                 }
                 break;
         }
     }
 
-    if(cpn->r0_do_not_display_leftmost_col) {
-        Uint32 c = cpn->sdlcolors[cpn->r7_bordercolor];
-        for(i=0;i<8;i++) *draw++ = c;
+    if(cpn->r0_do_not_display_leftmost_col)
+        memset(draw, cpn->r7_bordercolor, 8);
+}
+
+static int tms9918a_renderflags(tms9918a *cpn)
+{
+    return (cpn->r0_top2rows_no_hscroll ? TMS_RENDER_TOP2ROWS_NO_HSCROLL : 0) |
+           (cpn->r0_vert_scroll_inhibit ? TMS_RENDER_VERT_SCROLL_INHIBIT : 0) |
+           (mode224selected(cpn) ? TMS_RENDER_MODE224 : 0) |
+           (cpn->r1_zoomedsprites ? TMS_RENDER_ZOOMED_SPRITES : 0) |
+           (cpn->r1_8x16sprite ? TMS_RENDER_8X16_SPRITES : 0) |
+           (cpn->gconsole==GC_GG ? TMS_RENDER_GG : 0);
+}
+
+// Generic renderer, handles every registers combination
+static void tms9918a_renderline_generic(tms9918a *cpn, int line, byte *draw)
+{
+    if(cpn->gconsole==GC_GG)
+        tms9918a_renderline_t(cpn, line, draw, GG_SCREEN_X, GG_SCREEN_X+GG_SCREEN_WIDTH, tms9918a_renderflags(cpn));
+    else
+        tms9918a_renderline_t(cpn, line, draw, 0, TILES_WIDTH_SCREEN*8, tms9918a_renderflags(cpn));
+}
+
+// Specialized renderers, built at compile time for the most common registers combinations
+#define TMS_RENDERLINE_VARIANT(name, flags) \
+static void tms9918a_renderline_##name(tms9918a *cpn, int line, byte *draw) \
+{ \
+    if((flags) & TMS_RENDER_GG) \
+        tms9918a_renderline_t(cpn, line, draw, GG_SCREEN_X, GG_SCREEN_X+GG_SCREEN_WIDTH, flags); \
+    else \
+        tms9918a_renderline_t(cpn, line, draw, 0, TILES_WIDTH_SCREEN*8, flags); \
+}
+
+TMS_RENDERLINE_VARIANT(sms, 0)
+TMS_RENDERLINE_VARIANT(sms_8x16, TMS_RENDER_8X16_SPRITES)
+TMS_RENDERLINE_VARIANT(sms_nohscroll, TMS_RENDER_TOP2ROWS_NO_HSCROLL)
+TMS_RENDERLINE_VARIANT(sms_nohscroll_8x16, TMS_RENDER_TOP2ROWS_NO_HSCROLL | TMS_RENDER_8X16_SPRITES)
+TMS_RENDERLINE_VARIANT(gg, TMS_RENDER_GG)
+TMS_RENDERLINE_VARIANT(gg_8x16, TMS_RENDER_GG | TMS_RENDER_8X16_SPRITES)
+TMS_RENDERLINE_VARIANT(gg_nohscroll, TMS_RENDER_GG | TMS_RENDER_TOP2ROWS_NO_HSCROLL)
+TMS_RENDERLINE_VARIANT(gg_nohscroll_8x16, TMS_RENDER_GG | TMS_RENDER_TOP2ROWS_NO_HSCROLL | TMS_RENDER_8X16_SPRITES)
+
+static const struct {
+    int flags;
+    tms9918a_renderfunc renderline;
+} lkp_renderers[] = {
+    { 0, tms9918a_renderline_sms },
+    { TMS_RENDER_8X16_SPRITES, tms9918a_renderline_sms_8x16 },
+    { TMS_RENDER_TOP2ROWS_NO_HSCROLL, tms9918a_renderline_sms_nohscroll },
+    { TMS_RENDER_TOP2ROWS_NO_HSCROLL | TMS_RENDER_8X16_SPRITES, tms9918a_renderline_sms_nohscroll_8x16 },
+    { TMS_RENDER_GG, tms9918a_renderline_gg },
+    { TMS_RENDER_GG | TMS_RENDER_8X16_SPRITES, tms9918a_renderline_gg_8x16 },
+    { TMS_RENDER_GG | TMS_RENDER_TOP2ROWS_NO_HSCROLL, tms9918a_renderline_gg_nohscroll },
+    { TMS_RENDER_GG | TMS_RENDER_TOP2ROWS_NO_HSCROLL | TMS_RENDER_8X16_SPRITES, tms9918a_renderline_gg_nohscroll_8x16 },
+};
+
+// Called when registers 0/1 change
+static void tms9918a_selectrenderer(tms9918a *cpn)
+{
+    int i, flags = tms9918a_renderflags(cpn);
+
+    cpn->renderlinefunc = tms9918a_renderline_generic;
+    for(i=0; i<sizeof(lkp_renderers)/sizeof(lkp_renderers[0]); i++) {
+        if(lkp_renderers[i].flags==flags) {
+            cpn->renderlinefunc = lkp_renderers[i].renderline;
+            break;
+        }
+    }
+}
+
+#ifdef DEBUG
+// Render the line with both the selected and the generic renderer, the results must be identical.
+// Each renderer is timed alone and the first one alternates with the lines, so the caches are not always warmed by the generic one.
+static void tms9918a_checkrenderline(tms9918a *cpn, int line, byte *draw, int left, int right)
+{
+    byte generic[TMS_BUFFER_WIDTH], status = cpn->status, genericstatus, variantstatus;
+    Uint64 t0;
+
+    if(line & 1) {
+        t0 = SDL_GetPerformanceCounter();
+        cpn->renderlinefunc(cpn, line, draw);
+        cpn->perfvariant += SDL_GetPerformanceCounter() - t0;
+        variantstatus = cpn->status;
+        cpn->status = status;
+
+        t0 = SDL_GetPerformanceCounter();
+        tms9918a_renderline_generic(cpn, line, generic);
+        cpn->perfgeneric += SDL_GetPerformanceCounter() - t0;
+        genericstatus = cpn->status;
+    } else {
+        t0 = SDL_GetPerformanceCounter();
+        tms9918a_renderline_generic(cpn, line, generic);
+        cpn->perfgeneric += SDL_GetPerformanceCounter() - t0;
+        genericstatus = cpn->status;
+        cpn->status = status;
+
+        t0 = SDL_GetPerformanceCounter();
+        cpn->renderlinefunc(cpn, line, draw);
+        cpn->perfvariant += SDL_GetPerformanceCounter() - t0;
+        variantstatus = cpn->status;
     }
+    cpn->status = variantstatus;
 
-    //if(cpn->slcounter==0) draw[255] = 0xFFFF;
-    /*if(cpn->slcounter==0) {
-        draw = cpn->buffer16 + (cpn->scanline << 8); // scanline * 256
-        for(i=0;i<256;i++) draw[i] = 0xFFFF;
-    }*/
+    if((memcmp(generic + left, draw + left, right - left)!=0) || (genericstatus!=variantstatus)) {
+        log4me_error(LOG_EMU_SMSVDP, "line %d : specialized renderer (flags 0x%02X) differs from the generic one\n", line, tms9918a_renderflags(cpn));
+        exit(EXIT_FAILURE);
+    }
 }
+#endif
 
-static void tms9918a_flip(tms9918a *cpn)
+// Render the lines whose CPU time slice is complete, with the VDP state they were displayed with.
+// Called before any access able to change (or observe) the rendering, and at vblank for the remaining lines.
+static void tms9918a_catchup(tms9918a *cpn)
 {
-    word *buffer = cpn->buffer16;
+    int lastline = MIN(cpn->scanline, cpn->screenheight);
+    int left = 0, right = TILES_WIDTH_SCREEN*8, top = 0, bottom = cpn->screenheight;
 
-    if(cpn->gconsole==GC_GG)
-        buffer += ((cpn->ggrect->y << 8) + cpn->ggrect->x);
+    if(cpn->renderline>=lastline) return;
+
+    // Game Gear displays only a part of the screen
+    if(cpn->gconsole==GC_GG) {
+        left = cpn->ggrect->x;
+        right = cpn->ggrect->x + cpn->ggrect->w;
+        top = cpn->ggrect->y;
+        bottom = cpn->ggrect->y + cpn->ggrect->h;
+    }
+
+    cpn->catchups++;
+    for(; cpn->renderline<lastline; cpn->renderline++) {
+        if((cpn->renderline<top) || (cpn->renderline>=bottom)) {
+            // Hidden line, sprites are still processed for the status flags
+            if(cpn->r1_display) {
+                if(cpn->r1_zoomedsprites)
+                    tms9918a_drawzoomedsprites(cpn, cpn->renderline, NULL, cpn->r1_8x16sprite, mode224selected(cpn));
+                else
+                    tms9918a_drawsprites(cpn, cpn->renderline, NULL, cpn->r1_8x16sprite, mode224selected(cpn));
+            }
+            continue;
+        }
+
+        if(cpn->r1_display) {
+            byte *draw = cpn->buffer8 + (cpn->renderline << 8); // line*256
+#ifdef DEBUG
+            if(cpn->renderlinefunc!=tms9918a_renderline_generic) {
+                tms9918a_checkrenderline(cpn, cpn->renderline, draw, left, right);
+                continue;
+            }
+#endif
+            cpn->renderlinefunc(cpn, cpn->renderline, draw);
+        } else
+            tms9918a_clearline(cpn, cpn->renderline, left, right);
+    }
+}
+
+static void tms9918a_flip(tms9918a *cpn)
+{
+    int width, height, pitch;
+    byte *buffer = (byte*)tms9918a_getframebuffer(cpn, &width, &height, NULL);
+    void *pixels;
 
 #ifdef DEBUG
     if(cpn->showpalette) {
         int i, j;
-        word *palettebuf = buffer;
+        byte *palettebuf = buffer;
         for(i=0;i<TMS_COLORS;i++) {
-            for(j=0; j<(cpn->gconsole==GC_GG ? GG_SCREEN_WIDTH : 256)/TMS_COLORS; j++, palettebuf++) {
-                palettebuf[  0] = cpn->sdlcolors[i];
-                palettebuf[256] = cpn->sdlcolors[i];
-                palettebuf[512] = cpn->sdlcolors[i];
+            for(j=0; j<width/TMS_COLORS; j++, palettebuf++) {
+                palettebuf[  0] = i;
+                palettebuf[256] = i;
+                palettebuf[512] = i;
             }
         }
     }
 #endif
 
-    SDL_UpdateTexture(cpn->picture, NULL, buffer, 256*sizeof(word));
+    // The video driver is allowed to allocate memory
+    memcheck_suspend();
+
+    // Palette lookup is done only here, once per presented pixel
+    if(SDL_LockTexture(cpn->picture, NULL, &pixels, &pitch)<0) {
+        log4me_error(LOG_EMU_SDL, "Unable to lock texture: %s\n", SDL_GetError());
+        memcheck_resume();
+        return;
+    }
+    tms9918a_torgb565(cpn, (word*)pixels, pitch, buffer, width, height);
+    SDL_UnlockTexture(cpn->picture);
 
     displaytexture(cpn->screen, cpn->picture, cpn->pixelfmt, cpn->gconsole==GC_GG ? 0 : cpn->sdlcolors[cpn->r7_bordercolor]);
+
+    memcheck_resume();
 }
 
 void tms9918a_waitnextframe(tms9918a *cpn)
@@ -858,23 +1138,17 @@ void tms9918a_execute(tms9918a *cpn)
         cpn->screenheight = mode224selected(cpn) ? 224 : 192;
         if(cpn->screenheight!=oldscreenheight) {
             if(cpn->gconsole==GC_SMS) {
-                SDL_DestroyTexture(cpn->picture);
-                cpn->picture = SDL_CreateTexture(video_getrenderer(), SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING, 256, cpn->screenheight);
+                cpn->picture = cpn->pictures[cpn->screenheight==224 ? 1 : 0];
             } else {
                 assert(cpn->gconsole==GC_GG);
                 cpn->ggrect = cpn->screenheight==224 ? &ggrect224 : &ggrect192;
             }
         }
+        cpn->renderline = 0;
+        cpn->catchups = 0;
         log4me_debug(LOG_EMU_SMSVDP, "start new frame (%d) - %d lines\n", cpn->frame, cpn->screenheight);
     }
 
-    if(cpn->scanline<cpn->screenheight) {
-        if(cpn->r1_display)
-            tms9918a_renderline(cpn);
-        else
-            tms9918a_clearline(cpn);
-    }
-
     if((cpn->scanline<=cpn->screenheight) && (--cpn->slcounter<0)) {
         cpn->slcounter = cpn->r10_value;
         if(cpn->r0_hsync_int) {
@@ -884,18 +1158,26 @@ void tms9918a_execute(tms9918a *cpn)
     }
 
     if(cpn->scanline==cpn->screenheight+1) {
+        tms9918a_catchup(cpn);
+        log4me_debug(LOG_EMU_SMSVDP, "frame %d rendered in %d batches\n", cpn->frame, cpn->catchups);
+#ifdef DEBUG
+        if(cpn->perfgeneric && ((cpn->frame % cpn->framerate)==0)) {
+            log4me_debug(LOG_EMU_SMSVDP, "specialized line renderer : %d%% of the generic renderer time\n", (int)(cpn->perfvariant*100/cpn->perfgeneric));
+            cpn->perfvariant = cpn->perfgeneric = 0;
+        }
+#endif
         cpn->status |= TMS_STATUS_VSYNC;
         if(cpn->r1_vsync_int) {
             cpn->vsyncint = 1;
             log4me_debug(LOG_EMU_SMSVDP, "vsync int\n");
         }
-        tms9918a_flip(cpn);
+        if(cpn->present) tms9918a_flip(cpn);
         cpn->frame++;
     }
 
     if(++cpn->scanline==cpn->internalscanlines) {
         cpn->scanline = 0;
-        clock_step(cpn->idclock);
+        if(cpn->paced) clock_step(cpn->idclock);
     }
 }
 
@@ -904,26 +1186,38 @@ int tms9918a_int_pending(tms9918a *cpn)
     return cpn->vsyncint || cpn->hsyncint;
 }
 
-SDL_Surface *tms9918a_takescreenshot(const tms9918a *cpn)
+const byte *tms9918a_getframebuffer(const tms9918a *cpn, int *width, int *height, int *pitch)
 {
-    int width, height;
-    word *buffer;
+    const byte *buffer;
 
     switch(cpn->gconsole) {
         case GC_GG :
-            width = GG_SCREEN_WIDTH;
-            height = GG_SCREEN_HEIGHT;
-            buffer = cpn->buffer16 + ((cpn->ggrect->y << 8) + cpn->ggrect->x);
+            if(width) *width = GG_SCREEN_WIDTH;
+            if(height) *height = GG_SCREEN_HEIGHT;
+            buffer = cpn->buffer8 + ((cpn->ggrect->y << 8) + cpn->ggrect->x);
             break;
         case GC_SMS : default :
-            width = 256;
-            height = cpn->screenheight;
-            buffer = cpn->buffer16;
+            if(width) *width = TMS_BUFFER_WIDTH;
+            if(height) *height = cpn->screenheight;
+            buffer = cpn->buffer8;
             break;
     }
 
-    return SDL_CreateRGBSurfaceFrom(buffer, width, height, cpn->pixelfmt->BitsPerPixel, 256*sizeof(word),
+    if(pitch) *pitch = TMS_BUFFER_WIDTH;
+    return buffer;
+}
+
+SDL_Surface *tms9918a_takescreenshot(const tms9918a *cpn)
+{
+    int width, height;
+    const byte *buffer = tms9918a_getframebuffer(cpn, &width, &height, NULL);
+    SDL_Surface *image = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, cpn->pixelfmt->BitsPerPixel,
                         cpn->pixelfmt->Rmask, cpn->pixelfmt->Gmask, cpn->pixelfmt->Bmask, cpn->pixelfmt->Amask);
+
+    if(image)
+        tms9918a_torgb565(cpn, (word*)image->pixels, image->pitch, buffer, width, height);
+
+    return image;
 }
 
 void tms9918a_takesnapshot(tms9918a *cpn, xmlTextWriterPtr writer)
@@ -991,6 +1285,8 @@ void tms9918a_takesnapshot(tms9918a *cpn, xmlTextWriterPtr writer)
 
 void tms9918a_loadsnapshot(tms9918a *cpn, xmlNode *vdpnode)
 {
+    tms9918a_catchup(cpn);
+
     XML_ENUM_CHILD(vdpnode, node,
         XML_ELEMENT_ENUM_CHILD("registers", node, child,
             XML_ELEMENT_CONTENT("register", child,
@@ -1046,6 +1342,88 @@ void tms9918a_loadsnapshot(tms9918a *cpn, xmlNode *vdpnode)
     )
 }
 
+// Copy the whole VDP, the VRAM pages are copied only when written after the checkpoint in
+// any of both : the older pages of the destination are known to be the same
+void tms9918a_copystate(tms9918a *dst, const tms9918a *src, qword checkpoint)
+{
+    int i;
+
+    for(i=0; i<TMS_DIRTY_PAGES; i++)
+        if((src->vrampages[i]>checkpoint) || (dst->vrampages[i]>checkpoint))
+            memcpy(dst->vram + (i << TMS_DIRTY_SHIFT), src->vram + (i << TMS_DIRTY_SHIFT), 1 << TMS_DIRTY_SHIFT);
+
+    memcpy(dst, src, offsetof(tms9918a, vram));
+    memcpy((byte*)dst + offsetof(tms9918a, vrampages), (const byte*)src + offsetof(tms9918a, vrampages), sizeof(tms9918a) - offsetof(tms9918a, vrampages));
+}
+
+// The state is taken between two frames, the line renderer has nothing pending
+void tms9918a_savestate(const tms9918a *cpn, statewriter *w)
+{
+    assert(cpn->scanline==0);
+
+    state_write(w, cpn->registers, TMS_REGISTERS);
+    state_write8(w, (byte)cpn->cramsize);
+    state_write(w, cpn->cram, cpn->cramsize);
+    state_write(w, cpn->vram, TMS_VRAM_SIZE);
+
+    state_write16(w, (word)cpn->curoperation);
+    state_write16(w, (word)cpn->op.newoperation);
+    state_write32(w, cpn->flagsetop);
+    state_write8(w, (byte)cpn->color_index);
+    state_write16(w, cpn->vram_addr);
+    state_write8(w, cpn->read_buffer);
+    state_write8(w, cpn->status);
+    state_write8(w, cpn->vsyncint);
+    state_write8(w, cpn->hsyncint);
+}
+
+// The state is read without being loaded, returns 0 when it does not fit this VDP
+int tms9918a_checkstate(const tms9918a *cpn, statereader *r)
+{
+    state_skip(r, TMS_REGISTERS);
+    if(state_read8(r)!=cpn->cramsize) return 0;
+    state_skip(r, cpn->cramsize + TMS_VRAM_SIZE);
+
+    state_skip(r, 2 + 2 + 4); // operations
+    if(state_read8(r)>cpn->crammask) return 0; // color_index
+    if(state_read16(r)>0x3FFF) return 0; // vram_addr
+    state_skip(r, 4); // read buffer, status and interrupts
+
+    return !r->error;
+}
+
+void tms9918a_loadstate(tms9918a *cpn, statereader *r)
+{
+    byte registers[TMS_REGISTERS], cram[TMS_CRAM_SIZE];
+    int i, cramsize;
+
+    assert(cpn->scanline==0);
+
+    state_read(r, registers, TMS_REGISTERS);
+    cramsize = state_read8(r);
+    if(cramsize!=cpn->cramsize) r->error = 1;
+    state_read(r, cram, MIN(cramsize, TMS_CRAM_SIZE));
+    if(r->error) return;
+
+    state_read(r, cpn->vram, TMS_VRAM_SIZE);
+
+    for(i=0; i<TMS_REGISTERS; i++)
+        tms9918a_setregister(cpn, i, registers[i]);
+    for(i=0; i<cpn->cramsize; i++)
+        tms9918a_setcolor(cpn, i, cram[i]);
+    memset(cpn->tiles, 0, sizeof(cpn->tiles)); // the tiles are decoded again from the VRAM
+
+    cpn->curoperation = state_read16(r);
+    cpn->op.newoperation = state_read16(r);
+    cpn->flagsetop = state_read32(r);
+    cpn->color_index = state_read8(r);
+    cpn->vram_addr = state_read16(r);
+    cpn->read_buffer = state_read8(r);
+    cpn->status = state_read8(r);
+    cpn->vsyncint = state_read8(r);
+    cpn->hsyncint = state_read8(r);
+}
+
 #ifdef DEBUG
 void tms9918a_save_tiles(tms9918a *cpn, const string filename)
 {
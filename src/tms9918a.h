@@ -8,6 +8,7 @@
 #include "video.h"
 #include "misc/string.h"
 #include "misc/xml.h"
+#include "savestate.h"
 
 #define TMS_REGISTERS   16
 #define TMS_COLORS      32
@@ -15,8 +16,18 @@
 #define TMS_CRAM_SIZE   64 /* SMS:32 GG:64 */
 
 #define TMS_VRAM_SIZE   0x4000
+#define TMS_DIRTY_SHIFT 8 /* VRAM write tracking pages of 256 bytes */
+#define TMS_DIRTY_PAGES (TMS_VRAM_SIZE >> TMS_DIRTY_SHIFT)
 #define TMS_VRAM_TILES_OFS      0x0000
 
+#define TMS_BUFFER_WIDTH        256
+#define TMS_BUFFER_HEIGHT       224
+
+// Indexed framebuffer pixel : bits 0-4 = CRAM index, bit 5 = sprite, bit 6 = high priority tile
+#define TMS_PIXEL_COLOR_MASK    0x1F
+#define TMS_PIXEL_SPRITE        0x20
+#define TMS_PIXEL_PRIORITY      0x40
+
 typedef enum {
     TMS_READ_RAM = 0x0000,
     TMS_WRITE_RAM = 0x4000,
@@ -24,12 +35,18 @@ typedef enum {
     TMS_WRITE_COLOR = 0xC000
 } tms9918a_op;
 
+struct _tms9918a;
+typedef void (*tms9918a_renderfunc)(struct _tms9918a *cpn, int line, byte *draw);
+
 typedef struct _tms9918a {
     byte registers[TMS_REGISTERS];
     byte cram[TMS_CRAM_SIZE]; // 32 bytes for SMS / 64 bytes for GG
     byte vram[TMS_VRAM_SIZE];
+    qword vrampages[TMS_DIRTY_PAGES]; // write sequence of the last write of each VRAM page
+    const qword *writeseq; // current write sequence, owned by the machine
 
     Uint32 sdlcolors[TMS_COLORS];
+    SDL_Color palette[TMS_COLORS];
 
     gameconsole gconsole;   // SMS or GG
 
@@ -59,7 +76,11 @@ typedef struct _tms9918a {
     int framerate;
     int internalscanlines;
     int frame;
+    int present; // present the current frame, cleared to skip it
+    int paced; // the frame clock is stepped at each frame, cleared while running ahead
     int scanline;
+    int renderline; // next line to render (rendering is deferred until the VDP state changes or vblank)
+    int catchups;
     int slcounter;
     int screenheight;
 
@@ -93,11 +114,14 @@ typedef struct _tms9918a {
     const display *screen;
     const SDL_Rect *ggrect;
     SDL_Texture *picture;
+    SDL_Texture *pictures[2]; // 192 and 224 lines (Master System), built once to avoid any allocation while running
     SDL_PixelFormat *pixelfmt;
-    word *buffer16;
+    byte *buffer8;
+    tms9918a_renderfunc renderlinefunc; // specialized for the current registers 0/1 values
 
 #ifdef DEBUG
     int showpalette;
+    Uint64 perfvariant, perfgeneric; // specialized vs generic line renderer timings
 #endif
 } tms9918a;
 
@@ -120,11 +144,18 @@ void tms9918a_execute(tms9918a *cpn);
 int tms9918a_int_pending(tms9918a *cpn);
 void tms9918a_reset_int(tms9918a *cpn);
 
+const byte *tms9918a_getframebuffer(const tms9918a *cpn, int *width, int *height, int *pitch);
+
 SDL_Surface *tms9918a_takescreenshot(const tms9918a *cpn);
 
 void tms9918a_takesnapshot(tms9918a *cpn, xmlTextWriterPtr writer);
 void tms9918a_loadsnapshot(tms9918a *cpn, xmlNode *vdpnode);
 
+void tms9918a_copystate(tms9918a *dst, const tms9918a *src, qword checkpoint);
+void tms9918a_savestate(const tms9918a *cpn, statewriter *w);
+int tms9918a_checkstate(const tms9918a *cpn, statereader *r);
+void tms9918a_loadstate(tms9918a *cpn, statereader *r);
+
 #ifdef DEBUG
 void tms9918a_save_tiles(tms9918a *cpn, const string filename);
 void tms9918a_toggledisplaypalette(tms9918a *cpn);
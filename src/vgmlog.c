@@ -0,0 +1,195 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+/*
+VGM register writes logger based on :
+    - http://vgmrips.net/wiki/VGM_Specification
+Each write is preceded by the wait commands which bring the VGM sample clock (44100 Hz) to its CPU tstates timestamp.
+The commands are queued in memory and written to the file by a background thread.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "vgmlog.h"
+#include "emul.h"
+#include "misc/asyncwriter.h"
+
+#define VGM_HEADER_SIZE     0x40
+#define VGM_VERSION         0x150
+#define VGM_SAMPLERATE      44100
+#define VGM_BUFFER_SIZE     (256 << 10) // bytes queued between the emulation and the writer thread
+#define VGM_CHUNK_SIZE      (16 << 10)  // bytes per file write
+
+#define VGM_CMD_GGSTEREO    0x4F
+#define VGM_CMD_SN76489     0x50
+#define VGM_CMD_YM2413      0x51
+#define VGM_CMD_WAIT        0x61
+#define VGM_CMD_WAIT735     0x62
+#define VGM_CMD_WAIT882     0x63
+#define VGM_CMD_END         0x66
+#define VGM_CMD_WAITSHORT   0x70 // 0x7n : wait n+1 samples
+
+struct _vgmlog {
+    FILE *file;
+    asyncwriter *writer;
+    const qword *cycles;
+    int clock;      // CPU, PSG and FM clock
+    int framerate;
+    int ymused;
+    qword start;    // CPU tstates at the start of the log
+    qword samples;  // samples already waited
+    dword length;   // data bytes queued
+};
+
+static void vgmlog_put32(byte *p, dword value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+// The sizes and the FM clock are known only when the log is closed
+static int vgmlog_writeheader(vgmlog v)
+{
+    byte header[VGM_HEADER_SIZE];
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, "Vgm ", 4);
+    vgmlog_put32(header + 0x04, VGM_HEADER_SIZE + v->length - 4);
+    vgmlog_put32(header + 0x08, VGM_VERSION);
+    vgmlog_put32(header + 0x0C, v->clock);
+    vgmlog_put32(header + 0x10, v->ymused ? v->clock : 0);
+    vgmlog_put32(header + 0x18, (dword)v->samples);
+    vgmlog_put32(header + 0x24, v->framerate);
+    header[0x28] = 0x09; // SN76489 feedback pattern of the Sega VDP
+    header[0x2A] = 16;   // SN76489 shift register width
+    vgmlog_put32(header + 0x34, VGM_HEADER_SIZE - 0x34); // data offset
+
+    return fwrite(header, 1, VGM_HEADER_SIZE, v->file)==VGM_HEADER_SIZE;
+}
+
+static void vgmlog_command(vgmlog v, const byte *command, int len)
+{
+    awwrite(v->writer, command, len);
+    v->length += len;
+}
+
+// Wait up to the current CPU tstates
+static void vgmlog_wait(vgmlog v)
+{
+    qword target = ((*v->cycles - v->start) * VGM_SAMPLERATE) / v->clock;
+    byte command[3];
+    dword n;
+
+    while(v->samples<target) {
+        n = (dword)MIN(target - v->samples, 0xFFFF);
+        if(n==735)
+            command[0] = VGM_CMD_WAIT735;
+        else if(n==882)
+            command[0] = VGM_CMD_WAIT882;
+        else if(n<=16)
+            command[0] = VGM_CMD_WAITSHORT + n - 1;
+        else {
+            command[0] = VGM_CMD_WAIT;
+            command[1] = n & 0xFF;
+            command[2] = n >> 8;
+        }
+        vgmlog_command(v, command, command[0]==VGM_CMD_WAIT ? 3 : 1);
+        v->samples += n;
+    }
+}
+
+vgmlog vgmlog_open(const char *filename, const qword *cycles, int clock, int framerate)
+{
+    vgmlog v = calloc(1, sizeof(struct _vgmlog));
+    if(v==NULL) return NULL;
+
+    v->cycles = cycles;
+    v->clock = clock;
+    v->framerate = framerate;
+    v->start = *cycles;
+
+    if(((v->file = fopen(filename, "wb"))==NULL) ||
+       !vgmlog_writeheader(v) ||
+       ((v->writer = awcreate(v->file, VGM_BUFFER_SIZE, VGM_CHUNK_SIZE))==NULL)) {
+        if(v->file) fclose(v->file);
+        free(v);
+        return NULL;
+    }
+
+    return v;
+}
+
+// Flush the queued commands and complete the header, returns 0 on a write error
+int vgmlog_close(vgmlog v)
+{
+    byte command = VGM_CMD_END;
+    int ok;
+
+    if(v==NULL) return 1;
+
+    vgmlog_wait(v);
+    vgmlog_command(v, &command, 1);
+
+    ok = awdelete(v->writer);
+    if((fseek(v->file, 0, SEEK_SET)!=0) || !vgmlog_writeheader(v)) ok = 0;
+    if(fclose(v->file)!=0) ok = 0;
+    free(v);
+
+    return ok;
+}
+
+// The CPU tstates counter jumped from the value from (a state is loaded) : the log time goes on from where it was
+void vgmlog_rebase(vgmlog v, qword from)
+{
+    if(v==NULL) return;
+
+    v->start += *v->cycles - from;
+}
+
+void vgmlog_psg(vgmlog v, byte data)
+{
+    byte command[2] = { VGM_CMD_SN76489, data };
+
+    vgmlog_wait(v);
+    vgmlog_command(v, command, sizeof(command));
+}
+
+void vgmlog_stereo(vgmlog v, byte data)
+{
+    byte command[2] = { VGM_CMD_GGSTEREO, data };
+
+    vgmlog_wait(v);
+    vgmlog_command(v, command, sizeof(command));
+}
+
+void vgmlog_ym2413(vgmlog v, byte reg, byte data)
+{
+    byte command[3] = { VGM_CMD_YM2413, reg, data };
+
+    v->ymused = 1;
+    vgmlog_wait(v);
+    vgmlog_command(v, command, sizeof(command));
+}
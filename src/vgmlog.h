@@ -0,0 +1,19 @@
+#ifndef VGMLOG_H_INCLUDED
+#define VGMLOG_H_INCLUDED
+
+#include "misc/types.h"
+
+// Sound chips register writes log in the VGM format.
+
+struct _vgmlog;
+typedef struct _vgmlog * vgmlog;
+
+vgmlog vgmlog_open(const char *filename, const qword *cycles, int clock, int framerate);
+int vgmlog_close(vgmlog v);
+void vgmlog_rebase(vgmlog v, qword from);
+
+void vgmlog_psg(vgmlog v, byte data);
+void vgmlog_stereo(vgmlog v, byte data);
+void vgmlog_ym2413(vgmlog v, byte reg, byte data);
+
+#endif // VGMLOG_H_INCLUDED
@@ -0,0 +1,243 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+/*
+VGM player : renders the SN76489 and YM2413 parts of a VGM file with the emulator sound chips as fast as possible.
+The output goes to a WAV (or raw PCM) file, or is discarded to benchmark the synthesis alone.
+*/
+
+#ifdef HAVE_CONFIG_H
+	#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <SDL.h>
+
+#include "emul.h"
+#include "sn76489.h"
+#include "ym2413.h"
+#include "misc/log4me.h"
+
+#ifdef WIN32
+    #define NULL_DEVICE "NUL"
+#else
+    #define NULL_DEVICE "/dev/null"
+#endif
+
+#define VGM_SAMPLERATE  44100
+#define VGM_MIN_HEADER  0x40
+
+static dword vgm_get32(const byte *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((dword)p[3] << 24);
+}
+
+// Length of the command at p, 0 for an unknown command
+static int vgm_cmdlength(const byte *p, const byte *end)
+{
+    byte cmd = *p;
+
+    if((cmd>=0x70) && (cmd<=0x8F)) return 1;
+    if((cmd==0x62) || (cmd==0x63)) return 1;
+    if((cmd>=0x30) && (cmd<=0x3F)) return 2;
+    if((cmd==0x4F) || (cmd==0x50)) return 2;
+    if((cmd>=0x40) && (cmd<=0x5F)) return 3;
+    if(cmd==0x61) return 3;
+    if(cmd==0x67) return end-p<7 ? 0 : 7 + vgm_get32(p + 3); // data block
+    if(cmd==0x68) return 12;
+    if((cmd==0x90) || (cmd==0x91) || (cmd==0x95)) return 5;
+    if(cmd==0x92) return 6;
+    if(cmd==0x93) return 11;
+    if(cmd==0x94) return 2;
+    if((cmd>=0xA0) && (cmd<=0xBF)) return 3;
+    if((cmd>=0xC0) && (cmd<=0xDF)) return 4;
+    if(cmd>=0xE0) return 5;
+    return 0;
+}
+
+// Wait in samples of the command at p
+static int vgm_cmdwait(const byte *p)
+{
+    switch(*p) {
+        case 0x61: return p[1] | (p[2] << 8);
+        case 0x62: return 735;
+        case 0x63: return 882;
+        default:
+            if((*p>=0x70) && (*p<=0x7F)) return (*p & 0x0F) + 1;
+            if((*p>=0x80) && (*p<=0x8F)) return *p & 0x0F;
+            return 0;
+    }
+}
+
+static byte *vgm_load(const char *filename, long *size)
+{
+    FILE *f;
+    byte *data;
+
+    if((f = fopen(filename, "rb"))==NULL) return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if((*size<=0) || ((data = malloc(*size))==NULL) || (fread(data, 1, *size, f)!=(size_t)*size)) {
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+
+    return data;
+}
+
+static void printhelp()
+{
+    log4me_print("Usage: vgmplay [OPTIONS] FILE\n");
+    log4me_print("\nOptions:\n");
+    log4me_print("  --output FILE\t\t: Write the sound to a WAV file (raw PCM if FILE ends with .raw or .pcm)\n");
+    log4me_print("  --psg ENGINE\t\t: Set the PSG synthesis [point/blep] (default=point)\n");
+    log4me_print("  --repeat NUM\t\t: Play the file NUM times (default=1)\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, option_index, repeat = 1, stereo = 0, clock, fmclock, len, wait;
+    const char *output = NULL;
+    byte *data;
+    const byte *p, *start, *end;
+    long size;
+    qword cycles = 0, samples = 0, target, nextframe, ticks;
+    double elapsed;
+    static sn76489 snd;
+    static ym2413 fm;
+
+    struct option long_options[] = {
+        {"output", required_argument, NULL, 'o'},
+        {"psg", required_argument, NULL, 'p'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        { NULL, 0, NULL, 0}
+    };
+
+    log4me_init(LOG_EMU_NONE);
+
+    while((c = getopt_long(argc, argv, "", long_options, &option_index))!=-1) {
+        switch(c) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'p':
+                audio_setsynthesis(strcasecmp(optarg, "blep")==0 ? PSG_BLEP : PSG_POINT);
+                break;
+            case 'r':
+                if((repeat = atoi(optarg))<1) repeat = 1;
+                break;
+            default:
+                printhelp();
+                return EXIT_SUCCESS;
+        }
+    }
+
+    if(optind>=argc) {
+        printhelp();
+        return EXIT_FAILURE;
+    }
+
+    if((data = vgm_load(argv[optind], &size))==NULL) {
+        log4me_error(LOG_EMU_MAIN, "Unable to read %s.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if((size>=2) && (data[0]==0x1F) && (data[1]==0x8B)) {
+        log4me_error(LOG_EMU_MAIN, "%s is compressed, uncompress it first (gzip -dc FILE.vgz > FILE.vgm).\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    if((size<VGM_MIN_HEADER) || (memcmp(data, "Vgm ", 4)!=0)) {
+        log4me_error(LOG_EMU_MAIN, "%s is not a VGM file.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    // The PSG synthesis drives the mixing, it runs silent at the YM2413 clock for a FM only file
+    clock = vgm_get32(data + 0x0C) & 0x3FFFFFFF;
+    fmclock = vgm_get32(data + 0x10) & 0x3FFFFFFF;
+    if(clock==0) clock = fmclock;
+    if(clock==0) {
+        log4me_error(LOG_EMU_MAIN, "%s does not use a SN76489 or a YM2413.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    start = data + ((vgm_get32(data + 0x08)>=0x150 && vgm_get32(data + 0x34)) ? 0x34 + vgm_get32(data + 0x34) : VGM_MIN_HEADER);
+    end = data + size;
+
+    // The Game Gear stereo needs two output channels
+    for(p=start; (p<end) && (*p!=0x66) && ((len = vgm_cmdlength(p, end))>0); p+=len)
+        stereo |= (*p==0x4F);
+
+    audio_setexport(output ? output : NULL_DEVICE);
+    sn76489_init(&snd, clock, &cycles, stereo ? SC_STEREO : SC_MONO, SND_OFF);
+    ym2413_init(&fm, fmclock, fmclock ? &snd : NULL);
+    if(fmclock) {
+        snd.fm = &fm;
+        ym2413_setcontrol(&fm, 0x03); // PSG and FM
+    }
+
+    ticks = SDL_GetPerformanceCounter();
+    nextframe = clock / 60;
+
+    while(repeat--) {
+        for(p=start; (p<end) && (*p!=0x66); p+=len) {
+            if((len = vgm_cmdlength(p, end))==0) {
+                log4me_error(LOG_EMU_MAIN, "Unknown VGM command %02X at offset %lX.\n", *p, (long)(p - data));
+                break;
+            }
+
+            if(*p==0x50) sn76489_write(&snd, 0x7F, p[1]);
+            else if(*p==0x4F) sn76489_writestereo(&snd, 0x06, p[1]);
+            else if(*p==0x51) {
+                ym2413_write(&fm, 0xF0, p[1]);
+                ym2413_write(&fm, 0xF1, p[2]);
+            }
+            else if((wait = vgm_cmdwait(p))>0) {
+                samples += wait;
+                target = (samples * clock) / VGM_SAMPLERATE;
+
+                // Synthesize once per frame, as the emulator does
+                for(; nextframe<=target; nextframe+=clock/60) {
+                    cycles = nextframe;
+                    sn76489_execute(&snd);
+                }
+                cycles = target;
+            }
+        }
+    }
+    sn76489_execute(&snd);
+    sn76489_free(&snd);
+    ym2413_free(&fm);
+
+    elapsed = (double)(SDL_GetPerformanceCounter() - ticks) / SDL_GetPerformanceFrequency();
+    log4me_print("%.1f s of sound rendered in %.3f s (%.0fx real time)\n", (double)samples / VGM_SAMPLERATE, elapsed, elapsed>0 ? ((double)samples / VGM_SAMPLERATE) / elapsed : 0);
+
+    free(data);
+    return EXIT_SUCCESS;
+}
@@ -36,6 +36,9 @@ SDL_Texture *_overlay = NULL;
 SDL_Texture *_bezel = NULL;
 SDL_RendererInfo _rendererinfo;
 int _fixedres = 0;
+int _vsync = 1;
+int _presents = 0;
+Uint32 _presentticks = 0;
 int _width = 0;
 int _height = 0;
 int _bzmarginx, _bzmarginy, _bzwidth, _bzheight;
@@ -50,6 +53,24 @@ static void video_free()
     SDL_DestroyWindow(_window);
 }
 
+static void video_createrenderer()
+{
+    _renderer = SDL_CreateRenderer(_window, -1, _vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+
+    if(!_renderer) {
+        log4me_error(LOG_EMU_SDL, "Unable to create renderer: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&_rendererinfo, 0, sizeof(_rendererinfo));
+    SDL_GetRendererInfo(_renderer, &_rendererinfo);
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+
+    SDL_SetRenderDrawColor(_renderer, 0, 0, 0, 255);
+    SDL_RenderClear(_renderer);
+    SDL_RenderPresent(_renderer);
+}
+
 void video_init()
 {
     int flags = 0;
@@ -89,20 +110,32 @@ void video_init()
             _desktopmode = windowmode;
     }
 
-    _renderer = SDL_CreateRenderer(_window, -1, SDL_RENDERER_PRESENTVSYNC);
+    video_createrenderer();
+}
 
-    if(!_renderer) {
-        log4me_error(LOG_EMU_SDL, "Unable to create renderer: %s\n", SDL_GetError());
-        exit(EXIT_FAILURE);
-    }
+// The renderer is created again, no texture must exist yet
+void video_setvsync(int enable)
+{
+    assert(_overlay==NULL && _bezel==NULL);
 
-    memset(&_rendererinfo, 0, sizeof(_rendererinfo));
-    SDL_GetRendererInfo(_renderer, &_rendererinfo);
-    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+    if(_vsync==enable) return;
 
-    SDL_SetRenderDrawColor(_renderer, 0, 0, 0, 255);
-    SDL_RenderClear(_renderer);
-    SDL_RenderPresent(_renderer);
+    _vsync = enable;
+    SDL_DestroyRenderer(_renderer);
+    video_createrenderer();
+}
+
+// Number of frames presented, ticks is set to the SDL ticks after the last present
+int video_getpresents(Uint32 *ticks)
+{
+    if(ticks) *ticks = _presentticks;
+    return _presents;
+}
+
+// Refresh rate of the display in Hz, 0 when unknown
+int video_getrefreshrate()
+{
+    return _desktopmode.refresh_rate;
 }
 
 void video_event(const SDL_Event *event)
@@ -184,6 +217,8 @@ void displaytexture(const display *screen, SDL_Texture *picture, SDL_PixelFormat
         SDL_RenderCopy(_renderer, _bezel, NULL, NULL);
 
     SDL_RenderPresent(_renderer);
+    _presents++;
+    _presentticks = SDL_GetTicks();
 }
 
 void video_setoverlay(display *screen, const char *filename)
@@ -17,6 +17,9 @@ typedef struct {
 void video_init(void);
 void video_event(const SDL_Event *event);
 void video_setmode(display *screen);
+void video_setvsync(int enable);
+int video_getrefreshrate(void);
+int video_getpresents(Uint32 *ticks);
 void displaytexture(const display *screen, SDL_Texture *picture, SDL_PixelFormat *pixelfmt, Uint32 backgroundcolor);
 void video_setoverlay(display *screen, const char *filename);
 void video_setbezel(display *screen, const char *filename);
@@ -0,0 +1,127 @@
+/************************************************************************
+
+    Copyright 2013-2014 Xavier PINEAU
+
+    This file is part of Emulika.
+
+    Emulika is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Emulika is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Emulika.  If not, see <http://www.gnu.org/licenses/>.
+
+************************************************************************/
+
+/*
+Audio export to a WAV or raw PCM file, the samples are written by a background thread.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <SDL.h>
+
+#include "wavfile.h"
+#include "emul.h"
+#include "misc/asyncwriter.h"
+
+#define WAV_BUFFER_SIZE     (1 << 20)   // bytes queued between the emulation and the writer thread
+#define WAV_CHUNK_SIZE      (64 << 10)  // bytes per file write
+#define WAV_HEADER_SIZE     44
+
+struct _wavfile {
+    FILE *file;
+    int raw;
+    int samplerate;
+    int channels;
+    qword length;   // data bytes queued
+    asyncwriter *writer;
+};
+
+static void wavfile_put16(byte *p, word value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void wavfile_put32(byte *p, dword value)
+{
+    wavfile_put16(p, value & 0xFFFF);
+    wavfile_put16(p + 2, value >> 16);
+}
+
+// RIFF header of a 16 bits PCM stream, the sizes are known only when the file is closed
+static int wavfile_writeheader(wavfile w)
+{
+    byte header[WAV_HEADER_SIZE];
+    dword length = w->length>0xFFFFFFFF - (WAV_HEADER_SIZE - 8) ? 0xFFFFFFFF - (WAV_HEADER_SIZE - 8) : (dword)w->length;
+
+    memcpy(header, "RIFF", 4);
+    wavfile_put32(header + 4, length + WAV_HEADER_SIZE - 8);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    wavfile_put32(header + 16, 16);
+    wavfile_put16(header + 20, 1); // PCM
+    wavfile_put16(header + 22, w->channels);
+    wavfile_put32(header + 24, w->samplerate);
+    wavfile_put32(header + 28, w->samplerate * w->channels * sizeof(short));
+    wavfile_put16(header + 32, w->channels * sizeof(short));
+    wavfile_put16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    wavfile_put32(header + 40, length);
+
+    return fwrite(header, 1, WAV_HEADER_SIZE, w->file)==WAV_HEADER_SIZE;
+}
+
+// The file is written as raw PCM when its extension is .raw or .pcm, as WAV otherwise
+wavfile wavfile_open(const char *filename, int samplerate, int channels)
+{
+    const char *ext = strrchr(filename, '.');
+    wavfile w = calloc(1, sizeof(struct _wavfile));
+    if(w==NULL) return NULL;
+
+    w->raw = (ext!=NULL) && ((strcasecmp(ext, ".raw")==0) || (strcasecmp(ext, ".pcm")==0));
+    w->samplerate = samplerate;
+    w->channels = channels;
+
+    if(((w->file = fopen(filename, "wb"))==NULL) ||
+       (!w->raw && !wavfile_writeheader(w)) ||
+       ((w->writer = awcreate(w->file, WAV_BUFFER_SIZE, WAV_CHUNK_SIZE))==NULL)) {
+        if(w->file) fclose(w->file);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+// Queue count samples (per channel), waits when the file is slower than the emulation
+void wavfile_write(wavfile w, const short *samples, int count)
+{
+    int len = count * w->channels * sizeof(short);
+
+    awwrite(w->writer, samples, len);
+    w->length += len;
+}
+
+// Flush the queued samples and complete the header, returns 0 on a write error
+int wavfile_close(wavfile w)
+{
+    int ok;
+
+    if(w==NULL) return 1;
+
+    ok = awdelete(w->writer);
+    if(!w->raw && (fseek(w->file, 0, SEEK_SET)!=0 || !wavfile_writeheader(w))) ok = 0;
+    if(fclose(w->file)!=0) ok = 0;
+    free(w);
+
+    return ok;
+}
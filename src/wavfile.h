@@ -0,0 +1,15 @@
+#ifndef WAVFILE_H_INCLUDED
+#define WAVFILE_H_INCLUDED
+
+#include "misc/types.h"
+
+// 16 bits PCM audio export, written by a background thread.
+
+struct _wavfile;
+typedef struct _wavfile * wavfile;
+
+wavfile wavfile_open(const char *filename, int samplerate, int channels);
+void wavfile_write(wavfile w, const short *samples, int count);
+int wavfile_close(wavfile w);
+
+#endif // WAVFILE_H_INCLUDED
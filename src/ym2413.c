@@ -19,23 +19,697 @@
 
 ************************************************************************/
 
+/*
+YM2413 (OPLL) implementation based on :
+    - YM2413 application manual (Yamaha)
+    - http://www.smspower.org/Development/YM2413
+    - the built-in instruments dumped by plgDavid
+The operators work in the logarithmic domain : a log-sine table gives the attenuation of the wave,
+the envelope and the levels are added to it and an exponent table converts the sum back to a linear output.
+The samples are generated by batches of YM2413_BLOCK at the native rate (clock / 72) then resampled to the PSG synthesis rate.
+*/
+
+#include <SDL.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "ym2413.h"
+#include "sn76489.h"
+#include "misc/log4me.h"
+
+#define EG_MUTE     127
+#define EG_DAMPED   124 // level reached by the damping before the attack
+
+enum { EG_DAMP, EG_ATTACK, EG_DECAY, EG_SUSTAIN, EG_RELEASE, EG_OFF };
+
+// Instruments : modulator and carrier flags/multiple, modulator KSL/TL, carrier KSL/waves/feedback, attack/decay, sustain/release
+static const byte ym2413_rom[YM2413_PATCHES][8] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // user instrument
+    { 0x71, 0x61, 0x1E, 0x17, 0xD0, 0x78, 0x00, 0x17 }, // violin
+    { 0x13, 0x41, 0x1A, 0x0D, 0xD8, 0xF7, 0x23, 0x13 }, // guitar
+    { 0x13, 0x01, 0x99, 0x00, 0xF2, 0xC4, 0x11, 0x23 }, // piano
+    { 0x31, 0x61, 0x0E, 0x07, 0xA8, 0x64, 0x70, 0x27 }, // flute
+    { 0x32, 0x21, 0x1E, 0x06, 0xE0, 0x76, 0x00, 0x28 }, // clarinet
+    { 0x31, 0x22, 0x16, 0x05, 0xE0, 0x71, 0x00, 0x18 }, // oboe
+    { 0x21, 0x61, 0x1D, 0x07, 0x82, 0x81, 0x10, 0x07 }, // trumpet
+    { 0x23, 0x21, 0x2D, 0x14, 0xA2, 0x72, 0x00, 0x07 }, // organ
+    { 0x61, 0x61, 0x1B, 0x06, 0x64, 0x65, 0x10, 0x17 }, // horn
+    { 0x41, 0x61, 0x0B, 0x18, 0x85, 0xF7, 0x71, 0x07 }, // synthesizer
+    { 0x13, 0x01, 0x83, 0x11, 0xFA, 0xE4, 0x10, 0x04 }, // harpsichord
+    { 0x17, 0xC1, 0x24, 0x07, 0xF8, 0xF8, 0x22, 0x12 }, // vibraphone
+    { 0x61, 0x50, 0x0C, 0x05, 0xC2, 0xF5, 0x20, 0x42 }, // synthesizer bass
+    { 0x01, 0x01, 0x55, 0x03, 0xC9, 0x95, 0x03, 0x02 }, // acoustic bass
+    { 0x61, 0x41, 0x89, 0x03, 0xF1, 0xE4, 0x40, 0x13 }, // electric guitar
+    { 0x01, 0x01, 0x18, 0x0F, 0xDF, 0xF8, 0x6A, 0x6D }, // bass drum
+    { 0x01, 0x01, 0x00, 0x00, 0xC8, 0xD8, 0xA7, 0x68 }, // high hat (modulator), snare drum (carrier)
+    { 0x05, 0x01, 0x00, 0x00, 0xF8, 0xAA, 0x59, 0x55 }  // tom-tom (modulator), top cymbal (carrier)
+};
+
+// Frequency multiple, doubled
+static const byte mult_table[16] = { 1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 20, 24, 24, 30, 30 };
 
-void ym2413_init(ym2413 *cpn)
+// Vibrato offset of the doubled F-Number by its 3 upper bits and the vibrato step
+static const signed char pm_table[8][8] = {
+    { 0, 0, 0, 0, 0,  0,  0,  0 },
+    { 0, 0, 1, 0, 0,  0, -1,  0 },
+    { 0, 1, 2, 1, 0, -1, -2, -1 },
+    { 0, 1, 3, 1, 0, -1, -3, -1 },
+    { 0, 2, 4, 2, 0, -2, -4, -2 },
+    { 0, 2, 5, 2, 0, -2, -5, -2 },
+    { 0, 3, 6, 3, 0, -3, -6, -3 },
+    { 0, 3, 7, 3, 0, -3, -7, -3 }
+};
+
+// Key scale level of the block 7 by the 4 upper bits of the F-Number, by 0.375 dB
+static const byte ksl_table[16] = { 0, 24, 32, 37, 40, 43, 45, 47, 48, 50, 51, 52, 53, 54, 55, 56 };
+
+// Envelope increments over 8 steps by the 2 lower bits of the rate
+static const byte eg_inc[4][8] = {
+    { 0, 1, 0, 1, 0, 1, 0, 1 },
+    { 0, 1, 0, 1, 1, 1, 0, 1 },
+    { 0, 1, 1, 1, 0, 1, 1, 1 },
+    { 0, 1, 1, 1, 1, 1, 1, 1 }
+};
+
+static word logsin_table[512]; // -log2(sin) of a half wave, 8 bits fraction
+static word exp_table[256]; // 2^-x on 12 bits for the fraction of the attenuation
+static int tables_built = 0;
+
+static void ym2413_buildtables()
 {
-    cpn->data = 0;
+    int i;
+
+    if(tables_built) return;
+
+    for(i=0; i<512; i++)
+        logsin_table[i] = (word)SDL_floor(-SDL_log(SDL_sin((i + 0.5) * M_PI / 512)) / SDL_log(2.0) * 256 + 0.5);
+    for(i=0; i<256; i++)
+        exp_table[i] = (word)SDL_floor(SDL_pow(2.0, -i / 256.0) * 4095 + 0.5);
+
+    tables_built = 1;
 }
 
+static void ym2413_decodepatch(ym2413_patch p[2], const byte *data)
+{
+    int i;
+
+    for(i=0; i<2; i++) {
+        p[i].am = (data[i] >> 7) & 1;
+        p[i].pm = (data[i] >> 6) & 1;
+        p[i].eg = (data[i] >> 5) & 1;
+        p[i].ksr = (data[i] >> 4) & 1;
+        p[i].mult = data[i] & 0x0F;
+        p[i].ksl = data[2 + i] >> 6;
+        p[i].ar = data[4 + i] >> 4;
+        p[i].dr = data[4 + i] & 0x0F;
+        p[i].sl = data[6 + i] >> 4;
+        p[i].rr = data[6 + i] & 0x0F;
+    }
+
+    p[0].tl = data[2] & 0x3F;
+    p[0].wave = (data[3] >> 3) & 1;
+    p[0].fb = data[3] & 0x07;
+    p[1].tl = 0;
+    p[1].wave = (data[3] >> 4) & 1;
+    p[1].fb = 0;
+}
 
-void ym2413_free()
+// Linear output of an operator from its 10 bits sine index and its attenuation (log-sine units)
+static inline int ym2413_operator(int index, int att, int wave)
 {
+    int out;
 
+    index &= 0x3FF;
+    if((index & 0x200) && wave) return 0; // half sine
+
+    att += logsin_table[index & 0x1FF];
+    out = exp_table[att & 0xFF] >> (att >> 8);
+
+    return (index & 0x200) ? -out : out;
+}
+
+static void ym2413_attack(ym2413_slot *s)
+{
+    s->state = EG_ATTACK;
+    s->phase = 0;
+    s->output[0] = s->output[1] = 0;
+}
+
+static void ym2413_setkey(ym2413_slot *s, int key)
+{
+    if(key && !s->key) {
+        // The current sound is damped before the attack
+        if(s->eg>=EG_DAMPED) ym2413_attack(s);
+        else s->state = EG_DAMP;
+    } else if(!key && s->key && (s->state!=EG_OFF))
+        s->state = EG_RELEASE;
+
+    s->key = key;
+}
+
+static int ym2413_egrate(const ym2413_slot *s)
+{
+    const ym2413_patch *p = s->patch;
+    int rate;
+
+    switch(s->state) {
+        case EG_DAMP: rate = 12; break;
+        case EG_ATTACK: rate = p->ar; break;
+        case EG_DECAY: rate = p->dr; break;
+        case EG_SUSTAIN: rate = p->eg ? 0 : p->rr; break; // a percussive tone keeps decaying
+        case EG_RELEASE: rate = s->sus ? 5 : (p->eg ? p->rr : 7); break;
+        default: return 0;
+    }
+
+    return rate ? MIN(rate * 4 + s->rks, 63) : 0;
+}
+
+// Envelope step of a rate at the sample counter
+static inline int ym2413_eginc(int rate, dword counter)
+{
+    int shift;
+
+    if(rate==0) return 0;
+    if(rate<52) {
+        shift = 12 - (rate >> 2);
+        if(counter & ((1 << shift) - 1)) return 0;
+        return eg_inc[rate & 3][(counter >> shift) & 7];
+    }
+    return (eg_inc[rate & 3][counter & 7] + 1) << ((rate >> 2) - 13);
+}
+
+// Envelope of a slot for a batch, att receives the attenuation of each sample in log-sine units.
+// Returns 0 when the slot stays silent during the whole batch.
+static int ym2413_envelope(ym2413 *cpn, ym2413_slot *s, int am, short *att)
+{
+    short eg[YM2413_BLOCK] __attribute__((aligned(16)));
+    int k, inc, rate, loudest = EG_MUTE, base = s->level + (s->patch->am ? am : 0);
+
+    if(s->state==EG_OFF) {
+        for(k=0; k<YM2413_BLOCK; k++) att[k] = EG_MUTE << 4;
+        return 0;
+    }
+
+    rate = ym2413_egrate(s);
+    for(k=0; k<YM2413_BLOCK; k++) {
+        if((s->state==EG_ATTACK) && (rate>=60)) {
+            s->eg = 0;
+            s->state = EG_DECAY;
+            rate = ym2413_egrate(s);
+        }
+
+        if((inc = ym2413_eginc(rate, cpn->counter + k))!=0) {
+            switch(s->state) {
+                case EG_DAMP:
+                    if((s->eg += inc)>=EG_DAMPED) {
+                        ym2413_attack(s);
+                        rate = ym2413_egrate(s);
+                    }
+                    break;
+                case EG_ATTACK:
+                    // Exponential attack
+                    s->eg += (~s->eg * inc) >> 2;
+                    if(s->eg<=0) {
+                        s->eg = 0;
+                        s->state = EG_DECAY;
+                        rate = ym2413_egrate(s);
+                    }
+                    break;
+                case EG_DECAY:
+                    if((s->eg += inc)>=s->patch->sl * 8) {
+                        s->state = EG_SUSTAIN;
+                        rate = ym2413_egrate(s);
+                    }
+                    break;
+                default:
+                    if((s->eg += inc)>=EG_MUTE) {
+                        s->eg = EG_MUTE;
+                        if(s->state==EG_RELEASE) s->state = EG_OFF;
+                        rate = ym2413_egrate(s);
+                    }
+                    break;
+            }
+        }
+
+        eg[k] = s->eg;
+        if(s->eg<loudest) loudest = s->eg;
+    }
+
+    // Total attenuation : envelope + levels + tremolo, saturated
+    k = 0;
+#ifdef __SSE2__
+    {
+        __m128i vbase = _mm_set1_epi16(base), vmute = _mm_set1_epi16(EG_MUTE);
+
+        for(; k<YM2413_BLOCK; k+=8) {
+            __m128i v = _mm_add_epi16(_mm_load_si128((const __m128i*)(eg + k)), vbase);
+            _mm_store_si128((__m128i*)(att + k), _mm_slli_epi16(_mm_min_epi16(v, vmute), 4));
+        }
+    }
+#endif
+    for(; k<YM2413_BLOCK; k++)
+        att[k] = MIN(eg[k] + base, EG_MUTE) << 4;
+
+    return loudest + base<EG_MUTE;
+}
+
+static inline dword ym2413_increment(const ym2413_slot *s, int pmstep)
+{
+    int fnum = s->fnum << 1;
+
+    if(s->patch->pm) fnum += pm_table[s->fnum >> 6][pmstep];
+
+    return ((dword)(fnum * mult_table[s->patch->mult]) << s->block) >> 2;
+}
+
+// mix += out << shift
+static void ym2413_accumulate(int *mix, const int *out, int shift)
+{
+    int k = 0;
+
+#ifdef __SSE2__
+    for(; k<YM2413_BLOCK; k+=4) {
+        __m128i v = _mm_slli_epi32(_mm_load_si128((const __m128i*)(out + k)), shift);
+        _mm_store_si128((__m128i*)(mix + k), _mm_add_epi32(_mm_load_si128((const __m128i*)(mix + k)), v));
+    }
+#endif
+    for(; k<YM2413_BLOCK; k++)
+        mix[k] += out[k] << shift;
+}
+
+// Two operators channel : the modulator output, with its own feedback, shifts the carrier phase
+static void ym2413_channel(ym2413 *cpn, int ch, int am, int pmstep, int *mix, int shift)
+{
+    short attm[YM2413_BLOCK] __attribute__((aligned(16))), attc[YM2413_BLOCK] __attribute__((aligned(16)));
+    int out[YM2413_BLOCK] __attribute__((aligned(16))), mod[YM2413_BLOCK];
+    ym2413_slot *m = &cpn->slots[ch*2], *c = m + 1;
+    dword incm = ym2413_increment(m, pmstep), incc = ym2413_increment(c, pmstep);
+    int k, fb = m->patch->fb, modulating;
+
+    modulating = ym2413_envelope(cpn, m, am, attm);
+    if(!ym2413_envelope(cpn, c, am, attc)) {
+        m->phase += incm * YM2413_BLOCK;
+        c->phase += incc * YM2413_BLOCK;
+        return;
+    }
+
+    if(modulating) {
+        for(k=0; k<YM2413_BLOCK; k++) {
+            mod[k] = ym2413_operator((m->phase >> 9) + (fb ? (m->output[0] + m->output[1]) >> (8 - fb) : 0), attm[k], m->patch->wave);
+            m->output[1] = m->output[0];
+            m->output[0] = mod[k];
+            mod[k] <<= 1;
+            m->phase += incm;
+        }
+    } else {
+        memset(mod, 0, sizeof(mod));
+        m->output[0] = m->output[1] = 0;
+        m->phase += incm * YM2413_BLOCK;
+    }
+
+    for(k=0; k<YM2413_BLOCK; k++) {
+        out[k] = ym2413_operator((c->phase >> 9) + mod[k], attc[k], c->patch->wave);
+        c->phase += incc;
+    }
+
+    ym2413_accumulate(mix, out, shift);
+}
+
+// Rhythm mode : the channel 6 plays the bass drum, the 4 slots of the channels 7 and 8 play the other drums
+// from the noise and from a combination of the high hat and top cymbal phases
+static void ym2413_rhythm(ym2413 *cpn, int am, int pmstep, const byte *noise, int *mix)
+{
+    short atthh[YM2413_BLOCK] __attribute__((aligned(16))), attsd[YM2413_BLOCK] __attribute__((aligned(16)));
+    short atttom[YM2413_BLOCK] __attribute__((aligned(16))), attcym[YM2413_BLOCK] __attribute__((aligned(16)));
+    int out[YM2413_BLOCK] __attribute__((aligned(16)));
+    ym2413_slot *hh = &cpn->slots[14], *sd = &cpn->slots[15], *tom = &cpn->slots[16], *cym = &cpn->slots[17];
+    dword inchh = ym2413_increment(hh, pmstep), incsd = ym2413_increment(sd, pmstep);
+    dword inctom = ym2413_increment(tom, pmstep), inccym = ym2413_increment(cym, pmstep);
+    int k, p7, p8, res, phase, active;
+
+    ym2413_channel(cpn, 6, am, pmstep, mix, 1);
+
+    active = ym2413_envelope(cpn, hh, am, atthh);
+    active |= ym2413_envelope(cpn, sd, am, attsd);
+    active |= ym2413_envelope(cpn, tom, am, atttom);
+    active |= ym2413_envelope(cpn, cym, am, attcym);
+
+    if(!active) {
+        hh->phase += inchh * YM2413_BLOCK;
+        sd->phase += incsd * YM2413_BLOCK;
+        tom->phase += inctom * YM2413_BLOCK;
+        cym->phase += inccym * YM2413_BLOCK;
+        return;
+    }
+
+    for(k=0; k<YM2413_BLOCK; k++) {
+        p7 = hh->phase >> 9;
+        p8 = cym->phase >> 9;
+        res = ((((p7 >> 2) ^ (p7 >> 7)) | (p7 >> 3)) | ((p8 >> 3) ^ (p8 >> 5))) & 1;
+
+        // High hat
+        phase = res ? 0x200 | (0xD0 >> 2) : 0xD0;
+        if(noise[k]) phase = (phase & 0x200) ? 0x200 | 0xD0 : 0xD0 >> 2;
+        out[k] = ym2413_operator(phase, atthh[k], 0);
+
+        // Snare drum
+        phase = (p7 & 0x100) ? 0x200 : 0x100;
+        if(noise[k]) phase ^= 0x100;
+        out[k] += ym2413_operator(phase, attsd[k], 0);
+
+        // Tom-tom
+        out[k] += ym2413_operator(tom->phase >> 9, atttom[k], 0);
+
+        // Top cymbal
+        out[k] += ym2413_operator(res ? 0x300 : 0x100, attcym[k], 0);
+
+        hh->phase += inchh;
+        sd->phase += incsd;
+        tom->phase += inctom;
+        cym->phase += inccym;
+    }
+
+    ym2413_accumulate(mix, out, 1);
+}
+
+// Generate a batch at the native rate and resample it to the FIFO
+static void ym2413_generate(ym2413 *cpn)
+{
+    int mix[YM2413_BLOCK] __attribute__((aligned(16)));
+    short out[YM2413_BLOCK] __attribute__((aligned(16)));
+    byte noise[YM2413_BLOCK];
+    int k, ch, am, pmstep, rhythm = cpn->regs[0x0E] & 0x20;
+
+    // Tremolo : triangle of 210 steps of 64 samples (3.7 Hz) up to 4.875 dB, vibrato : 8 steps of 1024 samples (6.1 Hz)
+    am = (cpn->counter >> 6) % 210;
+    am = (am<105 ? am : 209 - am) >> 3;
+    pmstep = (cpn->counter >> 10) & 7;
+
+    for(k=0; k<YM2413_BLOCK; k++) {
+        noise[k] = cpn->noise & 1;
+        if(cpn->noise & 1) cpn->noise ^= 0x800302;
+        cpn->noise >>= 1;
+    }
+
+    memset(mix, 0, sizeof(mix));
+    for(ch=0; ch<(rhythm ? 6 : YM2413_CHANNELS); ch++)
+        ym2413_channel(cpn, ch, am, pmstep, mix, 0);
+    if(rhythm) ym2413_rhythm(cpn, am, pmstep, noise, mix);
+
+    // A full scale channel matches a full volume PSG channel
+    k = 0;
+#ifdef __SSE2__
+    for(; k<YM2413_BLOCK; k+=8) {
+        __m128i lo = _mm_slli_epi32(_mm_load_si128((const __m128i*)(mix + k)), 1);
+        __m128i hi = _mm_slli_epi32(_mm_load_si128((const __m128i*)(mix + k + 4)), 1);
+        _mm_store_si128((__m128i*)(out + k), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for(; k<YM2413_BLOCK; k++) {
+        int sample = mix[k] << 1;
+        out[k] = sample>32767 ? 32767 : (sample<-32768 ? -32768 : sample);
+    }
+
+    cpn->counter += YM2413_BLOCK;
+
+    cpn->fifostart = 0;
+    cpn->fifolen = resampler_process(cpn->resampler, out, YM2413_BLOCK, cpn->fifo);
+}
+
+static int ym2413_ksl(int ksl, int fnum, int block)
+{
+    int level;
+
+    if(ksl==0) return 0;
+
+    level = ksl_table[fnum >> 5] - 8 * (7 - block);
+    return level>0 ? level >> (3 - ksl) : 0;
+}
+
+// Apply the registers of a channel to its slots, the channels 6 to 8 play the drums in rhythm mode
+static void ym2413_updatechannel(ym2413 *cpn, int ch)
+{
+    // Key on bits of the register 0x0E : bass drum, high hat/snare drum, tom-tom/top cymbal
+    static const byte drumkeys[3][2] = { { 0x10, 0x10 }, { 0x01, 0x08 }, { 0x04, 0x02 } };
+    byte rhythm = cpn->regs[0x0E], fh = cpn->regs[0x20 + ch], iv = cpn->regs[0x30 + ch];
+    int i, fnum = cpn->regs[0x10 + ch] | ((fh & 1) << 8), block = (fh >> 1) & 7;
+    int drums = (rhythm & 0x20) && (ch>=6);
+    const ym2413_patch *p = cpn->patches[drums ? ch + 10 : iv >> 4];
+    ym2413_slot *s;
+
+    for(i=0; i<2; i++) {
+        s = &cpn->slots[ch*2 + i];
+        s->patch = &p[i];
+        s->fnum = fnum;
+        s->block = block;
+        s->sus = (fh & 0x20) ? 1 : 0;
+        s->rks = p[i].ksr ? (block << 1) | (fnum >> 8) : block >> 1;
+
+        s->level = ym2413_ksl(p[i].ksl, fnum, block);
+        if(i==1) s->level += (iv & 0x0F) << 3; // volume by 3 dB
+        else if(drums && (ch>6)) s->level += (iv >> 4) << 3; // high hat and tom-tom volumes
+        else s->level += p[i].tl << 1; // total level by 0.75 dB
+
+        ym2413_setkey(s, (fh & 0x10) || (drums && (rhythm & drumkeys[ch - 6][i])));
+    }
+}
+
+static void ym2413_applywrite(ym2413 *cpn, byte reg, byte data)
+{
+    int ch;
+
+    if(reg==YM2413_CONTROL) {
+        cpn->control = data & 0x03;
+        return;
+    }
+    if(reg>=YM2413_REGISTERS) return;
+
+    log4me_debug(LOG_EMU_YM2413, "write register %02X : 0x%02X\n", reg, data);
+    cpn->regs[reg] = data;
+
+    if(reg<0x08) {
+        ym2413_decodepatch(cpn->patches[0], cpn->regs);
+        for(ch=0; ch<YM2413_CHANNELS; ch++)
+            if((cpn->regs[0x30 + ch] >> 4)==0) ym2413_updatechannel(cpn, ch);
+    } else if(reg==0x0E) {
+        for(ch=6; ch<YM2413_CHANNELS; ch++)
+            ym2413_updatechannel(cpn, ch);
+    } else if((reg>=0x10) && ((reg & 0x0F)<YM2413_CHANNELS))
+        ym2413_updatechannel(cpn, reg & 0x0F);
+}
+
+// Registers cleared, all the slots silent
+static void ym2413_reset(ym2413 *cpn)
+{
+    int ch;
+
+    memset(cpn->regs, 0, sizeof(cpn->regs));
+    memset(cpn->slots, 0, sizeof(cpn->slots));
+    ym2413_decodepatch(cpn->patches[0], cpn->regs);
+
+    for(ch=0; ch<YM2413_SLOTS; ch++) {
+        cpn->slots[ch].eg = EG_MUTE;
+        cpn->slots[ch].state = EG_OFF;
+    }
+    for(ch=0; ch<YM2413_CHANNELS; ch++)
+        ym2413_updatechannel(cpn, ch);
+}
+
+void ym2413_init(ym2413 *cpn, int clock, struct _sn76489 *psg)
+{
+    int i;
+
+    ym2413_buildtables();
+
+    cpn->address = 0;
+    cpn->control = cpn->shadowcontrol = 0;
+    memset(cpn->shadowregs, 0, sizeof(cpn->shadowregs));
+    for(i=1; i<YM2413_PATCHES; i++)
+        ym2413_decodepatch(cpn->patches[i], ym2413_rom[i]);
+    ym2413_reset(cpn);
+
+    cpn->noise = 1;
+    cpn->counter = 0;
+    cpn->fifostart = cpn->fifolen = 0;
+    cpn->nwrites = 0;
+    cpn->psg = psg;
+    cpn->vgm = NULL;
+    cpn->resampler = NULL;
+
+    if(psg==NULL) return;
+
+    if((cpn->resampler = resampler_new(clock / YM2413_DIVIDER, SND_FREQUENCY, 1, YM2413_BLOCK))==NULL) {
+        log4me_error(LOG_EMU_YM2413, "Unable to allocate the memory block.\n");
+        exit(EXIT_FAILURE);
+    }
+    assert(resampler_maxoutput(cpn->resampler, YM2413_BLOCK)<=YM2413_FIFO);
+    log4me_info(LOG_EMU_YM2413, "FM sound unit enabled (%d Hz)\n", clock / YM2413_DIVIDER);
+}
+
+void ym2413_free(ym2413 *cpn)
+{
+    resampler_release(cpn->resampler);
+    cpn->resampler = NULL;
+}
+
+// Apply the writes not consumed by the synthesis
+static void ym2413_flush(ym2413 *cpn)
+{
+    int i;
+
+    for(i=0; i<cpn->nwrites; i++)
+        ym2413_applywrite(cpn, cpn->writes[i].reg, cpn->writes[i].data);
+    cpn->nwrites = 0;
+}
+
+// Write positioned on the PSG sample clock by the synthesis thread, applied while mixing
+void ym2413_queue(ym2413 *cpn, qword sample, byte reg, byte data)
+{
+    ym2413_write_log *w;
+
+    if(cpn->nwrites==YM2413_WRITES_LOG) ym2413_flush(cpn);
+
+    w = &cpn->writes[cpn->nwrites++];
+    w->sample = sample;
+    w->reg = reg;
+    w->data = data;
+}
+
+// Writes are applied immediately when the sound is off, otherwise they are timestamped and applied while mixing
+static void ym2413_post(ym2413 *cpn, byte reg, byte data)
+{
+    if((cpn->psg==NULL) || !sn76489_synthesizing(cpn->psg))
+        ym2413_applywrite(cpn, reg, data);
+    else
+        sn76489_writefm(cpn->psg, reg, data);
+}
+
+// Audio control (port F2) : 0 PSG only, 1 FM only, 2 none, 3 PSG and FM
+void ym2413_setcontrol(ym2413 *cpn, byte data)
+{
+    cpn->shadowcontrol = data & 0x03;
+    ym2413_post(cpn, YM2413_CONTROL, cpn->shadowcontrol);
 }
 
 void ym2413_write(ym2413 *cpn, byte port, byte data)
 {
-    if(cpn->data==0) {
-        cpn->data++;
-        log4me_warning(LOG_EMU_YM2413, "YM2413 not implemented\n");
+    if(bit0_not_set(port)) {
+        cpn->address = data;
+        return;
+    }
+
+    if(cpn->vgm!=NULL) vgmlog_ym2413(cpn->vgm, cpn->address, data);
+
+    if(cpn->address>=YM2413_REGISTERS) return;
+
+    cpn->shadowregs[cpn->address] = data;
+    ym2413_post(cpn, cpn->address, data);
+}
+
+// Add the FM output to n PSG samples starting at the PSG sample position, the PSG is muted by the audio control
+void ym2413_mix(ym2413 *cpn, short *out, int n, int channels, int volume)
+{
+    qword pos = cpn->psg->nsamples;
+    int i, k, c, w, len, sample;
+    int fm = cpn->control & 1, psg = (cpn->control==0) || (cpn->control==3);
+
+    for(k=0,w=0; k<n; ) {
+        while((w<cpn->nwrites) && (cpn->writes[w].sample<=pos + k)) {
+            ym2413_applywrite(cpn, cpn->writes[w].reg, cpn->writes[w].data);
+            w++;
+        }
+
+        while(cpn->fifolen==0) ym2413_generate(cpn);
+
+        len = MIN(n - k, cpn->fifolen);
+        if(w<cpn->nwrites) len = (int)MIN((qword)len, cpn->writes[w].sample - (pos + k));
+
+        for(i=0; i<len; i++,k++) {
+            sample = fm ? (cpn->fifo[cpn->fifostart + i] * volume) >> 8 : 0;
+            for(c=0; c<channels; c++) {
+                int s = sample + (psg ? out[k*channels + c] : 0);
+                out[k*channels + c] = s>32767 ? 32767 : (s<-32768 ? -32768 : s);
+            }
+        }
+        cpn->fifostart += len;
+        cpn->fifolen -= len;
+    }
+
+    if(w>0) {
+        memmove(cpn->writes, cpn->writes + w, (cpn->nwrites - w) * sizeof(ym2413_write_log));
+        cpn->nwrites -= w;
     }
 }
+
+// Taken from the registers written by the emulation thread, the synthesis thread is left alone
+void ym2413_takesnapshot(const ym2413 *cpn, xmlTextWriterPtr writer)
+{
+    xmlTextWriterStartElement(writer, BAD_CAST "ym2413");
+        xmlTextWriterStartElement(writer, BAD_CAST "address");
+        xmlTextWriterWriteFormatString(writer, "%02X", cpn->address);
+        xmlTextWriterEndElement(writer); /* address */
+
+        xmlTextWriterStartElement(writer, BAD_CAST "control");
+        xmlTextWriterWriteFormatString(writer, "%02X", cpn->shadowcontrol);
+        xmlTextWriterEndElement(writer); /* control */
+
+        xmlTextWriterWriteArray(writer, "registers", (byte*)cpn->shadowregs, YM2413_REGISTERS);
+    xmlTextWriterEndElement(writer); /* ym2413 */
+}
+
+// The registers are written again, the notes playing restart from their attack
+void ym2413_loadsnapshot(ym2413 *cpn, xmlNode *fmnode)
+{
+    byte regs[YM2413_REGISTERS];
+    int i;
+
+    // The synthesis thread is idle while the registers are replaced, the pending writes are superseded by the snapshot
+    if(cpn->psg!=NULL) sn76489_sync(cpn->psg);
+    memset(regs, 0, sizeof(regs));
+    cpn->nwrites = 0;
+
+    XML_ENUM_CHILD(fmnode, node,
+        XML_ELEMENT_CONTENT("address", node,
+            cpn->address = (byte)strtoul((const char*)content, NULL, 16);
+        )
+        XML_ELEMENT_CONTENT("control", node,
+            cpn->control = cpn->shadowcontrol = (byte)strtoul((const char*)content, NULL, 16) & 0x03;
+        )
+        XML_ELEMENT("registers", node,
+            xmlNodeReadArray(node, regs, YM2413_REGISTERS);
+        )
+    )
+
+    ym2413_reset(cpn);
+    for(i=0; i<YM2413_REGISTERS; i++)
+        ym2413_applywrite(cpn, i, regs[i]);
+    memcpy(cpn->shadowregs, regs, YM2413_REGISTERS);
+}
+
+void ym2413_savestate(const ym2413 *cpn, statewriter *w)
+{
+    state_write8(w, cpn->address);
+    state_write8(w, cpn->shadowcontrol);
+    state_write(w, cpn->shadowregs, YM2413_REGISTERS);
+}
+
+// The control is masked and the registers are taken as written, only the size is checked
+int ym2413_checkstate(statereader *r)
+{
+    state_skip(r, 2 + YM2413_REGISTERS);
+    return !r->error;
+}
+
+// The registers are written again after the PSG state, the notes keyed on go on
+void ym2413_loadstate(ym2413 *cpn, statereader *r)
+{
+    int i;
+
+    cpn->address = state_read8(r);
+    ym2413_setcontrol(cpn, state_read8(r));
+    state_read(r, cpn->shadowregs, YM2413_REGISTERS);
+
+    for(i=0; i<YM2413_REGISTERS; i++)
+        ym2413_post(cpn, i, cpn->shadowregs[i]);
+}
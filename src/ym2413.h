@@ -2,14 +2,85 @@
 #define YM2413_H_INCLUDED
 
 #include "emul.h"
+#include "misc/xml.h"
+#include "resampler.h"
+#include "vgmlog.h"
+#include "savestate.h"
 
+#define YM2413_CHANNELS     9
+#define YM2413_SLOTS        (YM2413_CHANNELS * 2) // modulator and carrier of each channel
+#define YM2413_REGISTERS    0x40
+#define YM2413_PATCHES      19      // user instrument, 15 ROM instruments, 3 rhythm instruments
+#define YM2413_DIVIDER      72      // master clock cycles per sample
+#define YM2413_BLOCK        64      // samples generated per batch, the LFOs are constant during a batch
+#define YM2413_FIFO         256     // generated samples, at the PSG synthesis rate
+#define YM2413_WRITES_LOG   1024    // writes waiting for their sample position
+#define YM2413_CONTROL      0xFF    // write log entry of the audio control, outside of the registers
+
+struct _sn76489;
+
+typedef struct {
+    qword sample; // PSG sample position
+    byte reg;
+    byte data;
+} ym2413_write_log;
+
+// Instrument parameters of one operator
 typedef struct {
-    int data;
+    byte am, pm, eg, ksr, mult; // tremolo, vibrato, sustained tone, key scale rate, multiple
+    byte ksl, tl, wave, fb; // key scale level, modulator total level, half sine, modulator feedback
+    byte ar, dr, sl, rr; // envelope
+} ym2413_patch;
+
+typedef struct {
+    const ym2413_patch *patch;
+    dword phase; // 10 bits sine index + 9 bits fraction
+    int fnum, block;
+    int eg; // envelope attenuation, 0 (max) to 127 (mute) by 0.375 dB
+    int state;
+    int key, sus;
+    int rks; // rate key scale
+    int level; // total level or volume plus key scale level, by 0.375 dB
+    int output[2]; // last outputs, modulator feedback
+} ym2413_slot;
+
+typedef struct _ym2413 {
+    byte address; // register latched by a write to port F0
+    byte regs[YM2413_REGISTERS];
+    byte shadowregs[YM2413_REGISTERS]; // registers as written by the emulation thread, ahead of the synthesis
+    byte control; // audio control (port F2) : 0 PSG only, 1 FM only, 2 none, 3 PSG and FM
+    byte shadowcontrol; // audio control as written by the emulation thread, applied by the mixing at its sample position
+
+    ym2413_patch patches[YM2413_PATCHES][2];
+    ym2413_slot slots[YM2413_SLOTS];
+    dword noise; // rhythm noise LFSR
+    dword counter; // samples since reset, clocks the envelopes and the LFOs
+
+    resampler resampler; // native rate (clock / 72) -> PSG synthesis rate
+    short fifo[YM2413_FIFO];
+    int fifostart, fifolen;
+
+    ym2413_write_log writes[YM2413_WRITES_LOG];
+    int nwrites;
+
+    struct _sn76489 *psg; // mixing path and sample clock, NULL when the FM sound unit is absent
+    vgmlog vgm; // register writes log, NULL when disabled
 } ym2413;
 
-void ym2413_init(ym2413 *cpn);
-void ym2413_free();
+void ym2413_init(ym2413 *cpn, int clock, struct _sn76489 *psg);
+void ym2413_free(ym2413 *cpn);
 
 void ym2413_write(ym2413 *cpn, byte port, byte data);
+void ym2413_queue(ym2413 *cpn, qword sample, byte reg, byte data);
+void ym2413_setcontrol(ym2413 *cpn, byte data);
+
+void ym2413_mix(ym2413 *cpn, short *out, int n, int channels, int volume);
+
+void ym2413_takesnapshot(const ym2413 *cpn, xmlTextWriterPtr writer);
+void ym2413_loadsnapshot(ym2413 *cpn, xmlNode *fmnode);
+
+void ym2413_savestate(const ym2413 *cpn, statewriter *w);
+int ym2413_checkstate(statereader *r);
+void ym2413_loadstate(ym2413 *cpn, statereader *r);
 
 #endif // YM2413_H_INCLUDED